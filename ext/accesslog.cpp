@@ -0,0 +1,286 @@
+/*****************************************************************************
+
+File:     accesslog.cpp
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include <chrono>
+#ifdef OS_WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#include "accesslog.h"
+
+
+AccessLog_t *AccessLog_t::Current = NULL;
+AccessLog_t *AccessLog_t::Slow = NULL;
+long long AccessLog_t::SlowThreshold = 0;
+
+
+/************************
+AccessLog_t::AccessLog_t
+************************/
+
+AccessLog_t::AccessLog_t (const char *path, const char *format, int capacity):
+	Mask (0),
+	Head (0),
+	Tail (0),
+	bStop (false),
+	bReopen (false),
+	Written (0),
+	Dropped (0),
+	Path (path ? path : ""),
+	Format ((format && *format) ? format : "%t \"%m %U%q %H\" %s %O %D"),
+	File (NULL),
+	Pid (getpid())
+{
+	File = fopen (Path.c_str(), "a");
+	if (!File)
+		throw std::runtime_error ("unable to open access log " + Path);
+
+	// Round the capacity up to a power of two so we can mask indices.
+	size_t n = 1;
+	while (n < (size_t)((capacity > 0) ? capacity : DefaultCapacity))
+		n <<= 1;
+	Entries.resize (n);
+	Mask = n - 1;
+
+	Writer = thread (&AccessLog_t::_Run, this);
+}
+
+
+/*************************
+AccessLog_t::~AccessLog_t
+*************************/
+
+AccessLog_t::~AccessLog_t()
+{
+	// Whatever is still in the ring gets written before we go.
+	bStop = true;
+	Ready.notify_one();
+	if (Writer.joinable())
+		Writer.join();
+	if (File)
+		fclose (File);
+}
+
+
+/************************
+AccessLog_t::IsInherited
+************************/
+
+bool AccessLog_t::IsInherited() const
+{
+	return Pid != (long)getpid();
+}
+
+
+/*****************
+AccessLog_t::Push
+*****************/
+
+bool AccessLog_t::Push (const AccessLogEntry_t &e)
+{
+	size_t head = Head.load (memory_order_relaxed);
+	if (head - Tail.load (memory_order_acquire) > Mask) {
+		Dropped++;
+		return false;
+	}
+	Entries [head & Mask] = e;
+	Head.store (head + 1, memory_order_release);
+
+	// Unlocked, so a wakeup can be missed. The writer also polls.
+	Ready.notify_one();
+	return true;
+}
+
+
+/*********************
+AccessLog_t::PushText
+*********************/
+
+bool AccessLog_t::PushText (const string &text)
+{
+	{
+		lock_guard<mutex> lock (TextMutex);
+		if (Texts.size() >= MaxQueuedText) {
+			Dropped++;
+			return false;
+		}
+		Texts.push_back (text);
+	}
+	Ready.notify_one();
+	return true;
+}
+
+
+/*****************
+AccessLog_t::_Run
+*****************/
+
+void AccessLog_t::_Run()
+{
+	string buf;
+	while (true) {
+		size_t tail = Tail.load (memory_order_relaxed);
+		size_t head = Head.load (memory_order_acquire);
+		Written += head - tail;
+		for (; tail != head; tail++) {
+			_Format (Entries [tail & Mask], buf);
+			Tail.store (tail + 1, memory_order_release);
+			if (buf.length() >= 64 * 1024) {
+				fwrite (buf.data(), 1, buf.length(), File);
+				buf.clear();
+			}
+		}
+		if (!buf.empty()) {
+			fwrite (buf.data(), 1, buf.length(), File);
+			buf.clear();
+		}
+
+		deque<string> texts;
+		{
+			lock_guard<mutex> lock (TextMutex);
+			texts.swap (Texts);
+		}
+		Written += texts.size();
+		for (size_t i=0; i < texts.size(); i++)
+			fwrite (texts[i].data(), 1, texts[i].length(), File);
+		fflush (File);
+
+		if (bReopen.exchange (false)) {
+			// For log rotation: the file has been renamed under us.
+			FILE *f = fopen (Path.c_str(), "a");
+			if (f) {
+				fclose (File);
+				File = f;
+			}
+		}
+
+		if (bStop && (Tail.load() == Head.load()) && _NoText())
+			break;
+
+		unique_lock<mutex> lock (ReadyMutex);
+		if (!bStop && !bReopen && (Tail.load() == Head.load()) && _NoText())
+			Ready.wait_for (lock, chrono::milliseconds (50));
+	}
+}
+
+
+/********************
+AccessLog_t::_NoText
+********************/
+
+bool AccessLog_t::_NoText()
+{
+	lock_guard<mutex> lock (TextMutex);
+	return Texts.empty();
+}
+
+
+/********************
+AccessLog_t::_Format
+********************/
+
+void AccessLog_t::_Format (const AccessLogEntry_t &e, string &out)
+{
+	/* Format directives, after Apache's:
+	 *   %t  time the request started, in common log format
+	 *   %m  request method
+	 *   %U  request path
+	 *   %q  query string, with its leading ? (or nothing)
+	 *   %H  protocol
+	 *   %s  status
+	 *   %O  bytes sent, including headers
+	 *   %D  time taken to serve the request, in microseconds
+	 *   %%  a literal %
+	 */
+
+	char tmp [64];
+	const char *target = e.Target;
+	const char *query = strchr (target, '?');
+
+	for (const char *f = Format.c_str(); *f; f++) {
+		if ((*f != '%') || !f[1]) {
+			out += *f;
+			continue;
+		}
+		switch (*++f) {
+			case 't': {
+				struct tm tm;
+				#ifdef OS_WIN32
+				localtime_s (&tm, &e.Time);
+				#else
+				localtime_r (&e.Time, &tm);
+				#endif
+				strftime (tmp, sizeof(tmp), "[%d/%b/%Y:%H:%M:%S %z]", &tm);
+				out += tmp;
+				break;
+			}
+			case 'm':
+				out += e.Method[0] ? e.Method : "-";
+				break;
+			case 'U':
+				if (query)
+					out.append (target, query - target);
+				else
+					out += target;
+				break;
+			case 'q':
+				if (query)
+					out += query;
+				break;
+			case 'H':
+				out += e.Protocol[0] ? e.Protocol : "-";
+				break;
+			case 's':
+				if (e.Status > 0) {
+					snprintf (tmp, sizeof(tmp), "%d", e.Status);
+					out += tmp;
+				}
+				else
+					out += "-";
+				break;
+			case 'O':
+				snprintf (tmp, sizeof(tmp), "%lld", e.Bytes);
+				out += tmp;
+				break;
+			case 'D':
+				snprintf (tmp, sizeof(tmp), "%lld", e.Duration);
+				out += tmp;
+				break;
+			case '%':
+				out += '%';
+				break;
+			default:
+				out += '%';
+				out += *f;
+				break;
+		}
+	}
+	out += '\n';
+}
@@ -0,0 +1,132 @@
+/*****************************************************************************
+
+File:     accesslog.h
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#ifndef __AccessLog__H_
+#define __AccessLog__H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include <time.h>
+
+/**********************
+struct AccessLogEntry_t
+**********************/
+
+struct AccessLogEntry_t
+{
+	// Fixed size, so the ring buffer never allocates. Long request
+	// targets are truncated.
+	time_t Time;
+	long long Duration;
+	long long Bytes;
+	int Status;
+	char Method [8];
+	char Protocol [12];
+	char Target [512];
+};
+
+
+/*******************
+class AccessLog_t
+*******************/
+
+class AccessLog_t
+{
+	/* An access log written by a background thread, so a slow disk never
+	 * stalls the reactor. Entries go through a fixed-size single-producer
+	 * single-consumer ring: the producer is the reactor thread, which never
+	 * blocks or allocates, and entries that don't fit are dropped and
+	 * counted.
+	 * Preformatted text (the slow-request log) goes through a short locked
+	 * queue instead. It's only used for the odd request, so the lock and
+	 * the allocation don't matter.
+	 */
+
+	public:
+		AccessLog_t (const char *path, const char *format, int capacity);
+		virtual ~AccessLog_t();
+
+		bool Push (const AccessLogEntry_t&);
+		bool PushText (const std::string&);
+		void Reopen() {bReopen = true; Ready.notify_one();}
+		unsigned long long GetWritten() const {return Written;}
+		unsigned long long GetDropped() const {return Dropped;}
+		const std::string &GetPath() const {return Path;}
+		const std::string &GetFormat() const {return Format;}
+		int GetCapacity() const {return (int)Entries.size();}
+
+		// The writer thread doesn't survive a fork, so the child needs
+		// a log of its own.
+		bool IsInherited() const;
+
+		// The log connections write to, if any. Reactor thread only.
+		static AccessLog_t *Current;
+
+		// The slow-request log, and how long a request has to take (in
+		// microseconds) to go in it.
+		static AccessLog_t *Slow;
+		static long long SlowThreshold;
+
+		enum {
+			DefaultCapacity = 4096,
+			MaxQueuedText = 256
+		};
+
+	private:
+		std::vector<AccessLogEntry_t> Entries;
+		size_t Mask;
+		std::atomic<size_t> Head;
+		std::atomic<size_t> Tail;
+
+		std::atomic<bool> bStop;
+		std::atomic<bool> bReopen;
+		std::atomic<unsigned long long> Written;
+		std::atomic<unsigned long long> Dropped;
+
+		std::string Path;
+		std::string Format;
+		FILE *File;
+		long Pid;
+
+		std::mutex TextMutex;
+		std::deque<std::string> Texts;
+
+		std::mutex ReadyMutex;
+		std::condition_variable Ready;
+		std::thread Writer;
+
+	private:
+		AccessLog_t (const AccessLog_t&);
+		AccessLog_t &operator= (const AccessLog_t&);
+
+		void _Run();
+		bool _NoText();
+		void _Format (const AccessLogEntry_t&, std::string&);
+};
+
+#endif // __AccessLog__H_
@@ -0,0 +1,433 @@
+/*****************************************************************************
+
+File:     cache.cpp
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#include <string>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <chrono>
+
+#ifdef OS_WIN32
+#define strncasecmp _strnicmp
+#endif
+
+using namespace std;
+
+#include "cache.h"
+#include "http.h"
+
+
+ResponseCache_t *ResponseCache_t::Current = NULL;
+void (*ResponseCache_t::Releaser) (ResponseCache_t*) = NULL;
+
+
+/********************************
+ResponseCache_t::ResponseCache_t
+********************************/
+
+ResponseCache_t::ResponseCache_t (long long max_bytes, size_t max_responses):
+	nMaxBytes (max_bytes),
+	nMaxResponses (max_responses),
+	nBytes (0),
+	nHits (0),
+	nMisses (0),
+	nCoalesced (0),
+	nEvicted (0)
+{
+}
+
+
+/*********************************
+ResponseCache_t::~ResponseCache_t
+*********************************/
+
+ResponseCache_t::~ResponseCache_t()
+{
+	// Anyone still waiting goes through to user code. The caller must
+	// have stopped using us as Current, or they'd only wait again.
+	Clear();
+}
+
+
+/***********************
+ResponseCache_t::Lookup
+***********************/
+
+int ResponseCache_t::Lookup (const string &key, const char *headers, int headerslen, HttpConnection_t *conn, const Response_t **hit)
+{
+	/* Return Hit (with the response in *hit) if we have a fresh response
+	 * for this request. Return Wait if another connection is refreshing it,
+	 * in which case the connection is handed back with CacheReleased when
+	 * that finishes. Otherwise return Miss, and if the key has been cached
+	 * before, the connection becomes the one refreshing it.
+	 */
+	map<string, Entry_t>::iterator e = Entries.find (key);
+	if (e == Entries.end()) {
+		nMisses++;
+		return Miss;
+	}
+
+	string variant = _VariantKey (e->second.Vary, headers, headerslen);
+	map<string, Response_t>::iterator v = e->second.Variants.find (variant);
+	if ((v != e->second.Variants.end()) && (v->second.Expires > _Now())) {
+		nHits++;
+		Lru.splice (Lru.end(), Lru, v->second.Lru);
+		*hit = &v->second;
+		return Hit;
+	}
+
+	string refresh = key;
+	refresh += '\n';
+	refresh += variant;
+	map<string, Refresh_t>::iterator r = Refreshes.find (refresh);
+	if ((r != Refreshes.end()) && (r->second.Leader != conn)) {
+		r->second.Waiters.push_back (conn);
+		nCoalesced++;
+		return Wait;
+	}
+
+	if (r == Refreshes.end()) {
+		// A connection only refreshes one thing at a time.
+		Abandon (conn);
+		Refreshes [refresh].Leader = conn;
+		Leaders [conn] = refresh;
+	}
+	nMisses++;
+	return Miss;
+}
+
+
+/****************************
+ResponseCache_t::IsCacheable
+****************************/
+
+bool ResponseCache_t::IsCacheable (const string &response)
+{
+	/* Only a plain 200 may be replayed to other requests. Anything else,
+	 * a 206 for one client's Range in particular, would be wrong for
+	 * most of the requests that share its key.
+	 */
+	const char *s = response.c_str();
+	if (strncmp (s, "HTTP/1.", 7) || !isdigit ((unsigned char)s[7]) || strncmp (s + 8, " 200", 4))
+		return false;
+	return (s[12] == ' ') || (s[12] == '\r') || (s[12] == '\n');
+}
+
+
+/**********************
+ResponseCache_t::Store
+**********************/
+
+bool ResponseCache_t::Store (HttpConnection_t *conn, const string &key, const char *headers, int headerslen, const vector<string> &vary, double ttl, const string &bytes, bool close)
+{
+	/* Keep the response the connection sent for ttl seconds, and hand it
+	 * to anyone who was waiting for it. Return false if it doesn't fit.
+	 */
+	vector<string> names (vary);
+	for (size_t i=0; i < names.size(); i++)
+		transform (names[i].begin(), names[i].end(), names[i].begin(), ::tolower);
+
+	if ((ttl <= 0) || ((long long)bytes.length() > nMaxBytes) || !IsCacheable (bytes)) {
+		_Release (conn, false);
+		return false;
+	}
+
+	string variant = _VariantKey (names, headers, headerslen);
+	map<string, Entry_t>::iterator e = Entries.find (key);
+	if (e != Entries.end()) {
+		Entry_t &old = e->second;
+		if (old.Vary != names) {
+			// The variants were chosen on other headers, so none of them
+			// can be told apart any more.
+			while (!old.Variants.empty())
+				_DropVariant (old, old.Variants.begin());
+		}
+		else {
+			// Replaced below, and it mustn't count against the room.
+			map<string, Response_t>::iterator v = old.Variants.find (variant);
+			if (v != old.Variants.end())
+				_DropVariant (old, v);
+		}
+	}
+	_MakeRoom (bytes.length());
+
+	Entry_t &entry = Entries [key];
+	entry.Vary = names;
+	Response_t &r = entry.Variants [variant];
+	nBytes += bytes.length();
+	r.Bytes = bytes;
+	r.bClose = close;
+	r.Expires = _Now() + (long long)(ttl * 1000000);
+	r.Lru = Lru.insert (Lru.end(), make_pair (key, variant));
+
+	_Release (conn, true);
+	return true;
+}
+
+
+/************************
+ResponseCache_t::Abandon
+************************/
+
+void ResponseCache_t::Abandon (HttpConnection_t *conn)
+{
+	// The connection's response isn't going into the cache after all.
+	_Release (conn, false);
+}
+
+
+/***********************
+ResponseCache_t::Forget
+***********************/
+
+void ResponseCache_t::Forget (HttpConnection_t *conn)
+{
+	// The connection is going away, and mustn't be called back.
+	_Release (conn, false);
+	_RemoveWaiter (conn);
+}
+
+
+/***********************
+ResponseCache_t::Unlink
+***********************/
+
+void ResponseCache_t::Unlink (HttpConnection_t *conn)
+{
+	/* Forget the connection without calling anyone back, for when it's
+	 * being destroyed (maybe by the GC) and user code can't run. Anyone
+	 * waiting on its refresh is queued for ReleaseNext.
+	 */
+	_RemoveWaiter (conn);
+	_EndRefresh (conn, false);
+}
+
+
+/******************************
+ResponseCache_t::_RemoveWaiter
+******************************/
+
+void ResponseCache_t::_RemoveWaiter (HttpConnection_t *conn)
+{
+	map<string, Refresh_t>::iterator r;
+	for (r = Refreshes.begin(); r != Refreshes.end(); r++) {
+		vector<HttpConnection_t*> &w = r->second.Waiters;
+		w.erase (remove (w.begin(), w.end(), conn), w.end());
+	}
+
+	deque< pair<HttpConnection_t*, bool> >::iterator i = Released.begin();
+	while (i != Released.end()) {
+		if (i->first == conn)
+			i = Released.erase (i);
+		else
+			i++;
+	}
+}
+
+
+/**********************
+ResponseCache_t::Clear
+**********************/
+
+void ResponseCache_t::Clear()
+{
+	Entries.clear();
+	Lru.clear();
+	nBytes = 0;
+
+	while (!Leaders.empty())
+		_Release (Leaders.begin()->first, false);
+}
+
+
+/*************************
+ResponseCache_t::_Release
+*************************/
+
+void ResponseCache_t::_Release (HttpConnection_t *leader, bool stored)
+{
+	_EndRefresh (leader, stored);
+	if (Releaser)
+		(*Releaser) (this);
+	else
+		ReleasePending();
+}
+
+
+/****************************
+ResponseCache_t::_EndRefresh
+****************************/
+
+void ResponseCache_t::_EndRefresh (HttpConnection_t *leader, bool stored)
+{
+	/* End the leader's refresh, if it has one, and queue its waiters to
+	 * be handed back. If it stored a response they'll find it when they
+	 * look again (unless they vary from the leader on a header we didn't
+	 * know about when they started waiting). If not, it wasn't cacheable,
+	 * and they go straight through to user code.
+	 */
+	map<HttpConnection_t*, string>::iterator l = Leaders.find (leader);
+	if (l == Leaders.end())
+		return;
+
+	map<string, Refresh_t>::iterator r = Refreshes.find (l->second);
+	if (r != Refreshes.end()) {
+		vector<HttpConnection_t*> &w = r->second.Waiters;
+		for (size_t i=0; i < w.size(); i++)
+			Released.push_back (make_pair (w[i], !stored));
+		Refreshes.erase (r);
+	}
+	Leaders.erase (l);
+}
+
+
+/****************************
+ResponseCache_t::ReleaseNext
+****************************/
+
+bool ResponseCache_t::ReleaseNext()
+{
+	/* Hand back the first connection whose refresh has finished. This
+	 * runs user code, which can get here again (or raise). Returns false
+	 * if nobody was waiting.
+	 */
+	if (Released.empty())
+		return false;
+	pair<HttpConnection_t*, bool> c = Released.front();
+	Released.pop_front();
+	c.first->CacheReleased (c.second);
+	return true;
+}
+
+
+/*******************************
+ResponseCache_t::ReleasePending
+*******************************/
+
+void ResponseCache_t::ReleasePending()
+{
+	// Whichever call is innermost carries on with the queue. If user code
+	// raises, the rest wait for the next call.
+	while (ReleaseNext())
+		;
+}
+
+
+/***********************
+ResponseCache_t::_Purge
+***********************/
+
+void ResponseCache_t::_Purge()
+{
+	// Drop everything that has expired.
+	long long now = _Now();
+	map<string, Entry_t>::iterator e = Entries.begin();
+	while (e != Entries.end()) {
+		map<string, Response_t>::iterator v = e->second.Variants.begin();
+		while (v != e->second.Variants.end()) {
+			if (v->second.Expires <= now)
+				_DropVariant (e->second, v++);
+			else
+				v++;
+		}
+		if (e->second.Variants.empty())
+			Entries.erase (e++);
+		else
+			e++;
+	}
+}
+
+
+/**************************
+ResponseCache_t::_MakeRoom
+**************************/
+
+void ResponseCache_t::_MakeRoom (long long bytes)
+{
+	/* Drop responses until one more of the given size fits, the expired
+	 * ones first and then those least recently used.
+	 */
+	if ((nBytes + bytes > nMaxBytes) || (Lru.size() >= nMaxResponses))
+		_Purge();
+	while (!Lru.empty() && ((nBytes + bytes > nMaxBytes) || (Lru.size() >= nMaxResponses))) {
+		map<string, Entry_t>::iterator e = Entries.find (Lru.front().first);
+		_DropVariant (e->second, e->second.Variants.find (Lru.front().second));
+		if (e->second.Variants.empty())
+			Entries.erase (e);
+		nEvicted++;
+	}
+}
+
+
+/*****************************
+ResponseCache_t::_DropVariant
+*****************************/
+
+void ResponseCache_t::_DropVariant (Entry_t &e, map<string, Response_t>::iterator v)
+{
+	nBytes -= v->second.Bytes.length();
+	Lru.erase (v->second.Lru);
+	e.Variants.erase (v);
+}
+
+
+/****************************
+ResponseCache_t::_VariantKey
+****************************/
+
+string ResponseCache_t::_VariantKey (const vector<string> &vary, const char *headers, int headerslen)
+{
+	/* The values of the named request headers, in order. The header block
+	 * holds one null-terminated header per line, and a header that appears
+	 * more than once contributes all its values.
+	 */
+	string key;
+	for (size_t i=0; i < vary.size(); i++) {
+		if (i > 0)
+			key += '\n';
+		const string &name = vary[i];
+		const char *h = headers;
+		const char *end = headers + headerslen;
+		while (h < end) {
+			size_t len = strlen (h);
+			if ((len > name.length()) && (h[name.length()] == ':') && !strncasecmp (h, name.c_str(), name.length())) {
+				const char *v = h + name.length() + 1;
+				while ((*v == ' ') || (*v == '\t'))
+					v++;
+				key += v;
+				key += ',';
+			}
+			h += len + 1;
+		}
+	}
+	return key;
+}
+
+
+/*********************
+ResponseCache_t::_Now
+*********************/
+
+long long ResponseCache_t::_Now()
+{
+	return chrono::duration_cast<chrono::microseconds> (chrono::steady_clock::now().time_since_epoch()).count();
+}
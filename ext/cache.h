@@ -0,0 +1,150 @@
+/*****************************************************************************
+
+File:     cache.h
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#ifndef __ResponseCache__H_
+#define __ResponseCache__H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <deque>
+
+class HttpConnection_t;
+
+/***********************
+class ResponseCache_t
+***********************/
+
+class ResponseCache_t
+{
+	/* Complete serialized responses, kept for a few seconds so that
+	 * identical requests can be answered before they reach user code.
+	 * Entries are keyed on method and target, and within that on the
+	 * values of the request headers named by the response's Vary.
+	 *
+	 * When an entry expires, the first request for it goes through to
+	 * user code to refresh it, and identical requests that arrive in the
+	 * meantime wait for that response instead of all computing their own.
+	 * Keys that have never been cached aren't coalesced, so responses
+	 * that aren't cacheable never make anyone wait.
+	 *
+	 * When storing a response would take us over the byte or response
+	 * limit, expired responses are dropped first, then the ones least
+	 * recently used.
+	 *
+	 * Reactor thread only.
+	 */
+
+	public:
+		ResponseCache_t (long long max_bytes, size_t max_responses);
+		virtual ~ResponseCache_t();
+
+		// Entry and variant key of each stored response, least recently
+		// used first.
+		typedef std::list< std::pair<std::string, std::string> > LruList_t;
+
+		struct Response_t {
+			std::string Bytes;
+			bool bClose;
+			long long Expires;
+			LruList_t::iterator Lru;
+		};
+
+		enum {
+			Miss,
+			Hit,
+			Wait
+		};
+
+		int Lookup (const std::string &key, const char *headers, int headerslen, HttpConnection_t*, const Response_t **hit);
+		bool Store (HttpConnection_t*, const std::string &key, const char *headers, int headerslen, const std::vector<std::string> &vary, double ttl, const std::string &bytes, bool close);
+		void Abandon (HttpConnection_t*);
+		void Forget (HttpConnection_t*);
+		void Unlink (HttpConnection_t*);
+		bool ReleaseNext();
+		void ReleasePending();
+		bool HasPending() const {return !Released.empty();}
+		void Clear();
+
+		static bool IsCacheable (const std::string &response);
+
+		unsigned long long GetHits() const {return nHits;}
+		unsigned long long GetMisses() const {return nMisses;}
+		unsigned long long GetCoalesced() const {return nCoalesced;}
+		unsigned long long GetEvicted() const {return nEvicted;}
+		long long GetBytes() const {return nBytes;}
+		size_t GetEntries() const {return Entries.size();}
+		size_t GetResponses() const {return Lru.size();}
+
+		// The cache connections use, if any.
+		static ResponseCache_t *Current;
+
+		// If set, called instead of ReleasePending when a refresh ends,
+		// for bindings that need to guard the user code it runs.
+		static void (*Releaser) (ResponseCache_t*);
+
+	private:
+		struct Entry_t {
+			std::vector<std::string> Vary;
+			std::map<std::string, Response_t> Variants;
+		};
+
+		// A refresh in progress: its leader is computing the response
+		// the waiters will get.
+		struct Refresh_t {
+			HttpConnection_t *Leader;
+			std::vector<HttpConnection_t*> Waiters;
+		};
+
+		std::map<std::string, Entry_t> Entries;
+		std::map<std::string, Refresh_t> Refreshes;
+		std::map<HttpConnection_t*, std::string> Leaders;
+		LruList_t Lru;
+
+		// Waiters whose refresh has finished, handed back one at a time
+		// so that a connection can be forgotten while others are served.
+		std::deque< std::pair<HttpConnection_t*, bool> > Released;
+
+		long long nMaxBytes;
+		size_t nMaxResponses;
+		long long nBytes;
+		unsigned long long nHits;
+		unsigned long long nMisses;
+		unsigned long long nCoalesced;
+		unsigned long long nEvicted;
+
+	private:
+		ResponseCache_t (const ResponseCache_t&);
+		ResponseCache_t &operator= (const ResponseCache_t&);
+
+		static std::string _VariantKey (const std::vector<std::string>&, const char*, int);
+		static long long _Now();
+		void _Purge();
+		void _MakeRoom (long long bytes);
+		void _Release (HttpConnection_t *leader, bool stored);
+		void _EndRefresh (HttpConnection_t *leader, bool stored);
+		void _RemoveWaiter (HttpConnection_t*);
+		void _DropVariant (Entry_t&, std::map<std::string, Response_t>::iterator);
+};
+
+#endif // __ResponseCache__H_
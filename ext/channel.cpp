@@ -0,0 +1,247 @@
+/*****************************************************************************
+
+File:     channel.cpp
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+
+#include <string>
+#include <cstring>
+
+using namespace std;
+
+#include "channel.h"
+#include "http.h"
+
+
+set<EventChannel_t*> EventChannel_t::Channels;
+
+
+/******************************
+EventChannel_t::EventChannel_t
+******************************/
+
+EventChannel_t::EventChannel_t (size_t max_queued_bytes, size_t high_water):
+	nMaxQueuedBytes (max_queued_bytes),
+	nHighWater (high_water),
+	nPublished (0),
+	nDropped (0)
+{
+	Channels.insert (this);
+}
+
+
+/*******************************
+EventChannel_t::~EventChannel_t
+*******************************/
+
+EventChannel_t::~EventChannel_t()
+{
+	// Subscribers keep their connections. They just stop getting events.
+	Channels.erase (this);
+}
+
+
+/*************************
+EventChannel_t::Subscribe
+*************************/
+
+void EventChannel_t::Subscribe (HttpConnection_t *conn)
+{
+	Subscribers [conn];
+}
+
+
+/***************************
+EventChannel_t::Unsubscribe
+***************************/
+
+bool EventChannel_t::Unsubscribe (HttpConnection_t *conn)
+{
+	return Subscribers.erase (conn) > 0;
+}
+
+
+/***********************
+EventChannel_t::Publish
+***********************/
+
+size_t EventChannel_t::Publish (const string &framed)
+{
+	/* Queue an event (already framed) for every subscriber, and send what
+	 * each of them can take. Return how many subscribers it was queued for.
+	 * Sending runs user code, which can subscribe or unsubscribe anyone,
+	 * so we work from a list and look each connection up again.
+	 */
+	nPublished++;
+	if (Subscribers.empty())
+		return 0;
+
+	Buffer_t buffer = make_shared<const string> (framed);
+	vector<HttpConnection_t*> conns;
+	conns.reserve (Subscribers.size());
+	map<HttpConnection_t*, Subscriber_t>::iterator i;
+	for (i = Subscribers.begin(); i != Subscribers.end(); i++) {
+		i->second.Queue.push_back (buffer);
+		i->second.QueuedBytes += buffer->length();
+		conns.push_back (i->first);
+	}
+
+	for (size_t n=0; n < conns.size(); n++)
+		_Flush (conns[n]);
+	return conns.size();
+}
+
+
+/********************
+EventChannel_t::Pump
+********************/
+
+void EventChannel_t::Pump()
+{
+	// Send what we can of every backlog. Call this now and then, as
+	// nothing tells us when a connection's outbound data has drained.
+	vector<HttpConnection_t*> conns;
+	map<HttpConnection_t*, Subscriber_t>::iterator i;
+	for (i = Subscribers.begin(); i != Subscribers.end(); i++) {
+		if (!i->second.Queue.empty())
+			conns.push_back (i->first);
+	}
+	for (size_t n=0; n < conns.size(); n++)
+		_Flush (conns[n]);
+}
+
+
+/******************************
+EventChannel_t::GetQueuedBytes
+******************************/
+
+size_t EventChannel_t::GetQueuedBytes() const
+{
+	size_t bytes = 0;
+	map<HttpConnection_t*, Subscriber_t>::const_iterator i;
+	for (i = Subscribers.begin(); i != Subscribers.end(); i++)
+		bytes += i->second.QueuedBytes;
+	return bytes;
+}
+
+
+/**********************
+EventChannel_t::_Flush
+**********************/
+
+void EventChannel_t::_Flush (HttpConnection_t *conn)
+{
+	/* Send queued events while the connection is under the high-water
+	 * mark, counting what we send ourselves so we only have to ask how
+	 * much it has waiting once. Drop it if it's too far behind.
+	 */
+	map<HttpConnection_t*, Subscriber_t>::iterator i = Subscribers.find (conn);
+	if (i == Subscribers.end())
+		return;
+
+	size_t outbound = conn->GetOutboundSize();
+	while (outbound < nHighWater) {
+		Subscriber_t &s = i->second;
+		if (s.Queue.empty())
+			return;
+		Buffer_t buffer = s.Queue.front();
+		s.Queue.pop_front();
+		s.QueuedBytes -= buffer->length();
+		outbound += buffer->length();
+
+		conn->SendShared (buffer);
+		i = Subscribers.find (conn);
+		if (i == Subscribers.end())
+			return;
+	}
+
+	if (i->second.QueuedBytes > nMaxQueuedBytes)
+		_Drop (conn);
+}
+
+
+/*********************
+EventChannel_t::_Drop
+*********************/
+
+void EventChannel_t::_Drop (HttpConnection_t *conn)
+{
+	// A slow consumer. Whatever it has queued is let go with it.
+	Subscribers.erase (conn);
+	nDropped++;
+	conn->CloseConnection (false);
+}
+
+
+/**************************
+EventChannel_t::FrameEvent
+**************************/
+
+bool EventChannel_t::FrameEvent (string &out, const char *data, size_t len, const char *name, const char *id)
+{
+	/* Append an event in text/event-stream format: the event name and id,
+	 * if any, then a data field for each line of data, and a blank line.
+	 * Return false if the name or id would break the framing.
+	 */
+	if ((name && strpbrk (name, "\r\n")) || (id && strpbrk (id, "\r\n")))
+		return false;
+
+	if (name && *name) {
+		out += "event: ";
+		out += name;
+		out += '\n';
+	}
+	if (id) {
+		out += "id: ";
+		out += id;
+		out += '\n';
+	}
+
+	// Lines end with CRLF, LF or CR.
+	size_t start = 0;
+	while (true) {
+		size_t end = start;
+		while ((end < len) && (data[end] != '\r') && (data[end] != '\n'))
+			end++;
+		out += "data: ";
+		out.append (data + start, end - start);
+		out += '\n';
+		if (end >= len)
+			break;
+		if ((data[end] == '\r') && (end + 1 < len) && (data[end + 1] == '\n'))
+			end++;
+		start = end + 1;
+	}
+	out += '\n';
+	return true;
+}
+
+
+/********************************
+EventChannel_t::ForgetConnection
+********************************/
+
+void EventChannel_t::ForgetConnection (HttpConnection_t *conn)
+{
+	// The connection is closing. Take it out of every channel.
+	set<EventChannel_t*>::iterator c;
+	for (c = Channels.begin(); c != Channels.end(); c++)
+		(*c)->Subscribers.erase (conn);
+}
@@ -0,0 +1,109 @@
+/*****************************************************************************
+
+File:     channel.h
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+
+
+#ifndef __EventChannel__H_
+#define __EventChannel__H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+
+class HttpConnection_t;
+
+/**********************
+class EventChannel_t
+**********************/
+
+class EventChannel_t
+{
+	/* Fans Server-Sent Events out to the connections subscribed to it.
+	 * Each event is framed once into a reference-counted buffer, which
+	 * every subscriber's backlog points to. Sending it goes through
+	 * SendShared, which copies it into that connection's outbound buffer,
+	 * so each subscriber still gets its own copy; only the queued events
+	 * are shared.
+	 * Queued events are sent while the connection has less than HighWater
+	 * bytes waiting to go out, so the kernel sets the pace. Nothing tells
+	 * us when that drains, so a backlog only moves on the next Publish or
+	 * when the owner calls Pump, which it should do on a timer.
+	 * A subscriber that falls more than MaxQueuedBytes behind is dropped
+	 * and its connection closed; SSE clients reconnect (with
+	 * Last-Event-ID) on their own.
+	 *
+	 * Reactor thread only.
+	 */
+
+	public:
+		typedef std::shared_ptr<const std::string> Buffer_t;
+
+		EventChannel_t (size_t max_queued_bytes, size_t high_water);
+		virtual ~EventChannel_t();
+
+		enum {
+			DefaultMaxQueuedBytes = 1024 * 1024,
+			DefaultHighWater = 64 * 1024
+		};
+
+		void Subscribe (HttpConnection_t*);
+		bool Unsubscribe (HttpConnection_t*);
+		size_t Publish (const std::string &framed);
+		void Pump();
+		void SetLimits (size_t max_queued_bytes, size_t high_water) {nMaxQueuedBytes = max_queued_bytes; nHighWater = high_water;}
+
+		size_t GetSubscribers() const {return Subscribers.size();}
+		size_t GetQueuedBytes() const;
+		unsigned long long GetPublished() const {return nPublished;}
+		unsigned long long GetDropped() const {return nDropped;}
+
+		static bool FrameEvent (std::string &out, const char *data, size_t len, const char *name, const char *id);
+		static void ForgetConnection (HttpConnection_t*);
+
+	private:
+		struct Subscriber_t {
+			Subscriber_t(): QueuedBytes (0) {}
+			std::deque<Buffer_t> Queue;
+			size_t QueuedBytes;
+		};
+
+		std::map<HttpConnection_t*, Subscriber_t> Subscribers;
+		size_t nMaxQueuedBytes;
+		size_t nHighWater;
+		unsigned long long nPublished;
+		unsigned long long nDropped;
+
+		// Every channel, so a closing connection can leave them all.
+		static std::set<EventChannel_t*> Channels;
+
+	private:
+		EventChannel_t (const EventChannel_t&);
+		EventChannel_t &operator= (const EventChannel_t&);
+
+		void _Flush (HttpConnection_t*);
+		void _Drop (HttpConnection_t*);
+};
+
+#endif // __EventChannel__H_
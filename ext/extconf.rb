@@ -123,6 +123,16 @@ else
   # LINK_SO = linkso + "; strip $@"
 end
 
+# zlib is optional. Without it, request bodies can't be inflated natively.
+if have_header('zlib.h') and have_library('z', 'inflate')
+  flags << '-DWITH_ZLIB'
+end
+
+# Ruby 3.3 replaced rb_postponed_job_register_one with preregistered jobs.
+if have_func('rb_postponed_job_preregister', 'ruby/debug.h')
+  flags << '-DWITH_POSTPONED_JOB_HANDLE'
+end
+
 if $CPPFLAGS
   $CPPFLAGS += ' ' + flags.join(' ')
 else
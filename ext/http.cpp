@@ -25,19 +25,32 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <iostream>
 #include <string>
+#include <vector>
 #include <cstdlib>
 #include <cstring>
+#include <cctype>
 #include <sstream>
 #include <stdexcept>
 #include <stdio.h>
+#include <time.h>
+#include <chrono>
 
 #ifdef OS_WIN32
 #include <windows.h>
 #endif
 
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
 using namespace std;
 
 #include "http.h"
+#include "websocket.h"
+#include "accesslog.h"
+#include "cache.h"
+#include "workers.h"
+#include "channel.h"
 
 
 #ifdef OS_WIN32
@@ -54,6 +67,9 @@ void unsetenv (const char *str)
 #endif
 
 
+unsigned long long HttpConnection_t::RequestCount = 0;
+
+
 /**********************************
 HttpConnection_t::HttpConnection_t
 **********************************/
@@ -75,6 +91,33 @@ HttpConnection_t::HttpConnection_t()
 	// instead of buffering it here. To get the latter behavior, user code must call
 	// dont_accumulate_post.
 	bAccumulatePost = true;
+
+	// Requests declaring more content than this are refused before we read
+	// any of the body. User code can lower (or raise) it with max_content_length.
+	nMaxContentLength = MaxContentLength;
+
+	bPaused = false;
+	bAcceptWebSockets = false;
+	WebSocket = NULL;
+	bLogPending = false;
+	for (int i=0; i < NumPhases; i++)
+		Phases[i] = 0;
+	ContentLength = 0;
+	ContentPos = 0;
+	bCapturing = false;
+	bCaptureClose = false;
+	bCacheWaiting = false;
+	bSkipCache = false;
+	bBodyWaiting = false;
+	BodyResults = NULL;
+	bInflateBodies = false;
+	bBodyEncoded = false;
+	bInflating = false;
+	bInflateDone = false;
+	nMaxInflatedLength = MaxContentLength;
+	InflatedLength = 0;
+	InflatedCapacity = 0;
+	Inflater = NULL;
 }
 
 
@@ -86,6 +129,21 @@ HttpConnection_t::~HttpConnection_t()
 {
 	if (_Content)
 		free (_Content);
+	delete WebSocket;
+	// Only unlink from the cache: handing our waiters back runs user
+	// code, which can't happen here (we may be in the GC). Unbind does
+	// it, or the binding does once we're gone.
+	if (ResponseCache_t::Current)
+		ResponseCache_t::Current->Unlink (this);
+	CancelBodyJob();
+	EventChannel_t::ForgetConnection (this);
+	delete BodyResults;
+	#ifdef WITH_ZLIB
+	if (Inflater) {
+		inflateEnd (Inflater);
+		delete Inflater;
+	}
+	#endif
 }
 
 
@@ -131,6 +189,96 @@ void HttpConnection_t::ProcessRequest (const char *method,
 }
 
 
+/********************************
+HttpConnection_t::ExpectContinue
+********************************/
+
+int HttpConnection_t::ExpectContinue (const char *method,
+		const char *cookie,
+		const char *ifnonematch,
+		const char *contenttype,
+		const char *query_string,
+		const char *path_info,
+		const char *request_uri,
+		const char *protocol,
+		int content_length,
+		const char *hdrblock,
+		int hdrblocksize)
+{
+	/* Called when a client sends Expect: 100-continue, after all the headers
+	 * have been read and the content length has passed the native limit.
+	 * Return 0 to send 100 Continue and read the body, or an HTTP status
+	 * code (401, 403, 413, 417) to refuse the request without reading it.
+	 */
+	return 0;
+}
+
+
+/**************************************
+HttpConnection_t::ProcessWebSocketOpen
+**************************************/
+
+void HttpConnection_t::ProcessWebSocketOpen (const char *method,
+		const char *cookie,
+		const char *ifnonematch,
+		const char *contenttype,
+		const char *query_string,
+		const char *path_info,
+		const char *request_uri,
+		const char *protocol,
+		const char *hdrblock,
+		int hdrblocksize)
+{
+	// Called once the handshake has been sent. It takes the place of
+	// ProcessRequest for the request that asked for the upgrade.
+}
+
+
+/*****************************************
+HttpConnection_t::ReceiveWebSocketMessage
+*****************************************/
+
+void HttpConnection_t::ReceiveWebSocketMessage (const char *data, int len, bool binary)
+{
+	cerr << "UNIMPLEMENTED ReceiveWebSocketMessage" << endl;
+}
+
+
+/*********************************
+HttpConnection_t::WebSocketClosed
+*********************************/
+
+void HttpConnection_t::WebSocketClosed (int code, const char *reason, int len)
+{
+}
+
+
+/**************************************
+HttpConnection_t::SendWebSocketMessage
+**************************************/
+
+void HttpConnection_t::SendWebSocketMessage (const char *data, int len, bool binary)
+{
+	if (!WebSocket)
+		throw std::runtime_error ("not a websocket connection");
+	WebSocket->SendMessage (data, len, binary);
+}
+
+
+/********************************
+HttpConnection_t::CloseWebSocket
+********************************/
+
+void HttpConnection_t::CloseWebSocket (int code, const char *reason, int len)
+{
+	// Start the closing handshake. The connection is dropped when
+	// the peer answers with its own close frame.
+	if (!WebSocket)
+		throw std::runtime_error ("not a websocket connection");
+	WebSocket->SendClose (code, reason, len);
+}
+
+
 /*********************************
 HttpConnection_t::ReceivePostData
 *********************************/
@@ -140,6 +288,608 @@ void HttpConnection_t::ReceivePostData (const char *data, int len)
 	cerr << "UNIMPLEMENTED ReceivePostData" << endl;
 }
 
+/********************************
+HttpConnection_t::CountBytesSent
+********************************/
+
+void HttpConnection_t::CountBytesSent (const char *data, int length)
+{
+	/* Callers route everything written to the connection through here, so
+	 * the access log can record the bytes sent for the current request. We
+	 * pick up the status from the status line at the start of the response,
+	 * whoever writes it.
+	 * A response being captured for the cache is copied as well. Anything
+	 * written outside a capture means the response isn't cacheable.
+	 */
+	if (bCapturing)
+		Captured.append (data, length);
+	else if (!CacheKey.empty()) {
+		if (ResponseCache_t::Current)
+			ResponseCache_t::Current->Abandon (this);
+		CacheKey.clear();
+	}
+
+	if (!bLogPending)
+		return;
+	long long now = _MonotonicMicros();
+	if (!Phases [FirstResponsePhase])
+		Phases [FirstResponsePhase] = now;
+	Phases [LastResponsePhase] = now;
+
+	if (!AccessLog_t::Current && !AccessLog_t::Slow)
+		return;
+	if ((BytesSent == 0) && (length >= 12) && !strncmp (data, "HTTP/1.", 7))
+		ResponseStatus = atoi (data + 9);
+	BytesSent += length;
+}
+
+
+/*********************************
+HttpConnection_t::RequestFinished
+*********************************/
+
+void HttpConnection_t::RequestFinished()
+{
+	/* The response to the current request is complete. We get called when
+	 * the next request starts, and by user code when the connection closes.
+	 * Safe to call more than once.
+	 * A request that finishes without storing its response in the cache
+	 * (which only happens during a capture) lets anyone waiting on it go.
+	 */
+	if (!bCapturing && !CacheKey.empty()) {
+		if (ResponseCache_t::Current)
+			ResponseCache_t::Current->Abandon (this);
+		CacheKey.clear();
+	}
+
+	if (bLogPending)
+		_LogRequest();
+	bLogPending = false;
+}
+
+
+/******************************
+HttpConnection_t::BeginCapture
+******************************/
+
+void HttpConnection_t::BeginCapture()
+{
+	// Start copying what we send, to store in the response cache.
+	bCapturing = true;
+	bCaptureClose = false;
+	Captured.clear();
+}
+
+
+/****************************
+HttpConnection_t::EndCapture
+****************************/
+
+bool HttpConnection_t::EndCapture (const vector<string> &vary, double ttl, bool complete)
+{
+	/* Store the response captured since BeginCapture, if it's complete
+	 * and a 200. The cached copy ends the connection if this one did.
+	 * Returns true if the response was stored.
+	 */
+	bCapturing = false;
+
+	bool stored = false;
+	ResponseCache_t *cache = ResponseCache_t::Current;
+	if (cache && !CacheKey.empty()) {
+		if (complete && ResponseCache_t::IsCacheable (Captured))
+			stored = cache->Store (this, CacheKey, CacheHeaders.data(), CacheHeaders.length(), vary, ttl, Captured, bCaptureClose);
+		else
+			cache->Abandon (this);
+	}
+	CacheKey.clear();
+	Captured.clear();
+	return stored;
+}
+
+
+/******************************
+HttpConnection_t::CaptureClose
+******************************/
+
+void HttpConnection_t::CaptureClose()
+{
+	if (bCapturing)
+		bCaptureClose = true;
+}
+
+
+/*******************************
+HttpConnection_t::CacheReleased
+*******************************/
+
+void HttpConnection_t::CacheReleased (bool bypass)
+{
+	/* The response we were waiting on has been stored (or, if bypass,
+	 * turned out not to be cacheable). Look again, or go through to user
+	 * code, and carry on with anything that arrived in the meantime.
+	 */
+	bCacheWaiting = false;
+	bSkipCache = bypass;
+	if (!_DispatchRequest())
+		return;
+	ProtocolState = BaseState;
+	ResumeConsuming();
+}
+
+
+/*******************************
+HttpConnection_t::BodyProcessed
+*******************************/
+
+void HttpConnection_t::BodyProcessed (BodyJob_t *job)
+{
+	/* The worker pool has run the body stages. Hand the request to user
+	 * code with the (possibly decoded) body and the results, and carry on
+	 * with anything that arrived in the meantime. The job is ours now.
+	 * If user code raises we don't get it back, and it's deleted with the
+	 * next request instead.
+	 */
+	bBodyWaiting = false;
+	if (_Content)
+		free (_Content);
+	_Content = job->Body;
+	job->Body = NULL;
+	ContentLength = (int) job->Length;
+
+	// What user code sends depends on the results, which the cache
+	// doesn't key on.
+	delete BodyResults;
+	BodyResults = job;
+	bSkipCache = true;
+	bool dispatched = _DispatchRequest();
+	delete BodyResults;
+	BodyResults = NULL;
+
+	if (dispatched) {
+		ProtocolState = BaseState;
+		ResumeConsuming();
+	}
+}
+
+
+/*******************************
+HttpConnection_t::_StartInflate
+*******************************/
+
+bool HttpConnection_t::_StartInflate()
+{
+	/* Get ready to inflate the body of this request. The zlib stream is
+	 * made on the first compressed request, and reused after that. If we
+	 * accumulate the body, _Content starts at a guess and grows as needed
+	 * up to the inflated limit. Without zlib the body is left as it came.
+	 */
+	#ifdef WITH_ZLIB
+	if (!Inflater) {
+		Inflater = new z_stream;
+		memset (Inflater, 0, sizeof(z_stream));
+		if (inflateInit2 (Inflater, 15 + 32) != Z_OK) {
+			delete Inflater;
+			Inflater = NULL;
+			return false;
+		}
+	}
+	else if (inflateReset (Inflater) != Z_OK)
+		return false;
+
+	bInflating = true;
+	bInflateDone = false;
+	InflatedLength = 0;
+	InflatedCapacity = 0;
+	if (bAccumulatePost) {
+		InflatedCapacity = (ContentLength < nMaxInflatedLength / 4) ? (ContentLength * 4) : nMaxInflatedLength;
+		if (InflatedCapacity < 1024)
+			InflatedCapacity = 1024;
+		_Content = (char*) malloc (InflatedCapacity + 1);
+		if (!_Content)
+			return false;
+	}
+	return true;
+
+	#else
+	if (bAccumulatePost) {
+		_Content = (char*) malloc (ContentLength + 1);
+		if (!_Content)
+			return false;
+	}
+	return true;
+	#endif
+}
+
+
+/*********************************
+HttpConnection_t::_InflateContent
+*********************************/
+
+int HttpConnection_t::_InflateContent (const char *data, int len, bool finish)
+{
+	/* Inflate some compressed body. Return how much of it we used, which
+	 * is less than len if user code paused us, or -1 after sending an error
+	 * response if the body is corrupt or inflates past the limit. Output
+	 * zlib still holds when we're paused comes out on the next call, or
+	 * regardless of the pause when we finish.
+	 * Concatenated gzip members are inflated one after the other.
+	 */
+	#ifdef WITH_ZLIB
+	char slice [16 * 1024];
+
+	Inflater->next_in = (Bytef*) data;
+	Inflater->avail_in = len;
+
+	bool more = true;
+	while (more && (finish || !bPaused)) {
+		if (bInflateDone) {
+			if (Inflater->avail_in == 0)
+				break;
+			if (inflateReset (Inflater) != Z_OK) {
+				_SendError (RESPONSE_CODE_400);
+				return -1;
+			}
+			bInflateDone = false;
+		}
+
+		char *out;
+		int room;
+		if (bAccumulatePost) {
+			if (InflatedLength == InflatedCapacity) {
+				if (InflatedCapacity >= nMaxInflatedLength) {
+					_SendError (RESPONSE_CODE_413);
+					return -1;
+				}
+				int cap = (InflatedCapacity > nMaxInflatedLength / 2) ? nMaxInflatedLength : (InflatedCapacity * 2);
+				char *c = (char*) realloc (_Content, cap + 1);
+				if (!c)
+					throw std::runtime_error ("resource exhaustion");
+				_Content = c;
+				InflatedCapacity = cap;
+			}
+			out = _Content + InflatedLength;
+			room = InflatedCapacity - InflatedLength;
+		}
+		else {
+			out = slice;
+			room = sizeof(slice);
+		}
+
+		Inflater->next_out = (Bytef*) out;
+		Inflater->avail_out = room;
+		int r = inflate (Inflater, Z_NO_FLUSH);
+		if (r == Z_BUF_ERROR)
+			break; // nothing to do until there's more input
+		if ((r != Z_OK) && (r != Z_STREAM_END)) {
+			_SendError (RESPONSE_CODE_400);
+			return -1;
+		}
+		if (r == Z_STREAM_END)
+			bInflateDone = true;
+
+		int n = room - Inflater->avail_out;
+		if (InflatedLength + n > nMaxInflatedLength) {
+			_SendError (RESPONSE_CODE_413);
+			return -1;
+		}
+		InflatedLength += n;
+		if (!bAccumulatePost && (n > 0))
+			ReceivePostData (slice, n);
+
+		// zlib may have more for us if it filled the buffer.
+		more = (Inflater->avail_in > 0) || (Inflater->avail_out == 0);
+	}
+
+	return len - Inflater->avail_in;
+
+	#else
+	// Not reached: without zlib, _StartInflate leaves bodies as they are.
+	return len;
+	#endif
+}
+
+
+/********************************
+HttpConnection_t::_FinishInflate
+********************************/
+
+bool HttpConnection_t::_FinishInflate()
+{
+	/* The whole compressed body has been read. Take whatever zlib still
+	 * holds, and make sure the stream was complete. Return false after
+	 * sending an error response if it wasn't. An accumulated body now has
+	 * its inflated length.
+	 */
+	#ifdef WITH_ZLIB
+	if (_InflateContent ("", 0, true) < 0)
+		return false;
+	if (!bInflateDone) {
+		_SendError (RESPONSE_CODE_400);
+		return false;
+	}
+	#endif
+	if (bAccumulatePost) {
+		ContentLength = ContentPos = InflatedLength;
+		_Content [InflatedLength] = 0;
+	}
+	_RewriteInflatedHeaders();
+	return true;
+}
+
+
+/*****************************************
+HttpConnection_t::_RewriteInflatedHeaders
+*****************************************/
+
+void HttpConnection_t::_RewriteInflatedHeaders()
+{
+	/* The header block still describes the compressed body. Drop its
+	 * Content-Encoding and give Content-Length the inflated length, so
+	 * user code sees the body it actually gets. Taking out the encoding
+	 * frees more room than the longer length can need.
+	 */
+	char block [HeaderBlockSize];
+	int pos = 0;
+	for (const char *h = HeaderBlock; h < HeaderBlock + HeaderBlockPos; h += strlen (h) + 1) {
+		char length [32];
+		const char *line = h;
+		if (!strncasecmp (h, "content-encoding:", 17))
+			continue;
+		if (!strncasecmp (h, "content-length:", 15)) {
+			snprintf (length, sizeof(length), "Content-Length: %d", InflatedLength);
+			line = length;
+		}
+		int len = strlen (line);
+		if (pos + len + 1 >= HeaderBlockSize)
+			return;
+		memcpy (block + pos, line, len + 1);
+		pos += len + 1;
+	}
+	memcpy (HeaderBlock, block, pos);
+	HeaderBlockPos = pos;
+}
+
+
+/*******************************
+HttpConnection_t::CancelBodyJob
+*******************************/
+
+void HttpConnection_t::CancelBodyJob()
+{
+	// The connection is closing, so its body job needn't come back.
+	if (bBodyWaiting && WorkerPool_t::Current)
+		WorkerPool_t::Current->Forget (this);
+	bBodyWaiting = false;
+}
+
+
+/****************************
+HttpConnection_t::LeaveCache
+****************************/
+
+void HttpConnection_t::LeaveCache()
+{
+	// The connection is closing. Stop waiting, or being waited on.
+	if (ResponseCache_t::Current)
+		ResponseCache_t::Current->Forget (this);
+	CacheKey.clear();
+	bCacheWaiting = false;
+}
+
+
+/**********************************
+HttpConnection_t::_DispatchRequest
+**********************************/
+
+bool HttpConnection_t::_DispatchRequest()
+{
+	/* Answer the request from the response cache if we can, or else
+	 * hand it to user code. Return false if it has to wait for another
+	 * connection to refresh the cached response, in which case we pause
+	 * until the cache calls CacheReleased, or if its body has gone to the
+	 * worker pool, in which case we pause until BodyProcessed.
+	 */
+	bLogPending = true;
+	ResponseStatus = 0;
+	BytesSent = 0;
+
+	bool skip = bSkipCache;
+	bSkipCache = false;
+	CacheKey.clear();
+
+	WorkerPool_t *pool = WorkerPool_t::Current;
+	if (pool && !pool->IsStopped() && !BodyStages.empty() && !BodyResults && _Content && (ContentLength > 0)) {
+		// The body goes to the workers as it is, without a copy.
+		BodyJob_t *job = new BodyJob_t;
+		job->Stages = BodyStages;
+		job->ContentType = ContentType;
+		job->Body = _Content;
+		job->Length = ContentLength;
+		job->MaxLength = nMaxContentLength;
+		_Content = NULL;
+		pool->Submit (job, this);
+		bBodyWaiting = true;
+		PauseConsuming();
+		return false;
+	}
+
+	ResponseCache_t *cache = ResponseCache_t::Current;
+	if (cache && !skip && (ContentLength == 0) && (!strcmp (RequestMethod, "GET") || !strcmp (RequestMethod, "HEAD"))) {
+		string key (RequestMethod);
+		key += ' ';
+		key += RequestUri;
+		if (!QueryString.empty()) {
+			key += '?';
+			key += QueryString;
+		}
+
+		const ResponseCache_t::Response_t *hit = NULL;
+		switch (cache->Lookup (key, HeaderBlock, HeaderBlockPos, this, &hit)) {
+			case ResponseCache_t::Hit: {
+				RequestCount++;
+				Phases [DispatchPhase] = _MonotonicMicros();
+				bool close = hit->bClose;
+				SendData (hit->Bytes.data(), hit->Bytes.length());
+				if (close)
+					CloseConnection (true);
+				return true;
+			}
+			case ResponseCache_t::Wait:
+				bCacheWaiting = true;
+				PauseConsuming();
+				return false;
+		}
+
+		CacheKey.swap (key);
+		CacheHeaders.assign (HeaderBlock, HeaderBlockPos);
+	}
+
+	RequestCount++;
+	Phases [DispatchPhase] = _MonotonicMicros();
+	ProcessRequest (RequestMethod, Cookie.c_str(), IfNoneMatch.c_str(), ContentType.c_str(), QueryString.c_str(), PathInfo.c_str(), RequestUri.c_str(), Protocol.c_str(), ContentLength, _Content, HeaderBlock, HeaderBlockPos);
+	return true;
+}
+
+
+/*****************************
+HttpConnection_t::_LogRequest
+*****************************/
+
+void HttpConnection_t::_LogRequest()
+{
+	// Both logs time the request up to its last response byte. One
+	// that never got a response counts until now.
+	long long end = Phases [LastResponsePhase] ? Phases [LastResponsePhase] : _MonotonicMicros();
+	if (AccessLog_t::Slow && (end - Phases [FirstBytePhase] >= AccessLog_t::SlowThreshold))
+		_LogSlowRequest (end - Phases [FirstBytePhase]);
+
+	AccessLog_t *log = AccessLog_t::Current;
+	if (!log)
+		return;
+
+	AccessLogEntry_t e;
+	e.Time = RequestTime;
+	e.Duration = end - Phases [FirstBytePhase];
+	e.Bytes = BytesSent;
+	e.Status = ResponseStatus;
+
+	e.Method[0] = 0;
+	if (RequestMethod)
+		strncat (e.Method, RequestMethod, sizeof(e.Method) - 1);
+	e.Protocol[0] = 0;
+	strncat (e.Protocol, Protocol.c_str(), sizeof(e.Protocol) - 1);
+	e.Target[0] = 0;
+	strncat (e.Target, RequestUri.c_str(), sizeof(e.Target) - 1);
+	if (!QueryString.empty() && (RequestUri.length() + 1 < sizeof(e.Target) - 1)) {
+		strcat (e.Target, "?");
+		strncat (e.Target, QueryString.c_str(), sizeof(e.Target) - RequestUri.length() - 2);
+	}
+
+	log->Push (e);
+}
+
+
+/*********************************
+HttpConnection_t::_LogSlowRequest
+*********************************/
+
+void HttpConnection_t::_LogSlowRequest (long long total)
+{
+	/* Write the request head and where its time went to the slow-request
+	 * log. The phases are each measured from the one before: reading the
+	 * headers, reading the body, waiting for the cache or the body workers,
+	 * user code up to the first byte of the response, and the rest of the
+	 * response. Phases the request didn't reach are shown as "-".
+	 */
+	static const char *names[] = {"headers", "body", "queued", "handler", "response"};
+	char tmp [128];
+
+	string text;
+	struct tm tm;
+	#ifdef OS_WIN32
+	localtime_s (&tm, &RequestTime);
+	#else
+	localtime_r (&RequestTime, &tm);
+	#endif
+	strftime (tmp, sizeof(tmp), "[%d/%b/%Y:%H:%M:%S %z] ", &tm);
+	text += tmp;
+	snprintf (tmp, sizeof(tmp), "%.1fms ", total / 1000.0);
+	text += tmp;
+	text += RequestMethod ? RequestMethod : "-";
+	text += ' ';
+	text += RequestUri;
+	if (!QueryString.empty()) {
+		text += '?';
+		text += QueryString;
+	}
+	text += ' ';
+	text += Protocol;
+	snprintf (tmp, sizeof(tmp), " %d %lld\n ", ResponseStatus, BytesSent);
+	text += tmp;
+
+	for (int i=HeadersPhase; i < NumPhases; i++) {
+		if (Phases[i] && Phases[i-1])
+			snprintf (tmp, sizeof(tmp), " %s %.1fms", names[i-1], (Phases[i] - Phases[i-1]) / 1000.0);
+		else
+			snprintf (tmp, sizeof(tmp), " %s -", names[i-1]);
+		text += tmp;
+	}
+	text += '\n';
+
+	// Credentials stay out of the log. The block ends with the blank line.
+	for (const char *h = HeaderBlock; h < HeaderBlock + HeaderBlockPos; h += strlen (h) + 1) {
+		if (!*h)
+			continue;
+		text += "  ";
+		if (!strncasecmp (h, "cookie:", 7) || !strncasecmp (h, "authorization:", 14) || !strncasecmp (h, "proxy-authorization:", 20)) {
+			text.append (h, strchr (h, ':') - h);
+			text += ": [filtered]";
+		}
+		else
+			text += h;
+		text += '\n';
+	}
+	text += '\n';
+
+	AccessLog_t::Slow->PushText (text);
+}
+
+
+/**********************************
+HttpConnection_t::_MonotonicMicros
+**********************************/
+
+long long HttpConnection_t::_MonotonicMicros()
+{
+	return chrono::duration_cast<chrono::microseconds> (chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*********************************
+HttpConnection_t::ResumeConsuming
+*********************************/
+
+void HttpConnection_t::ResumeConsuming()
+{
+	/* Undo PauseConsuming, and process whatever was held back while we were
+	 * paused. The source was paused along with us, so that's at most one
+	 * read's worth. It's only restarted if that data doesn't pause us again.
+	 * A request waiting on the response cache or the worker pool stays
+	 * paused until it's handed back.
+	 */
+	if (bCacheWaiting || bBodyWaiting || !bPaused)
+		return;
+	bPaused = false;
+	if (!PendingData.empty()) {
+		string data;
+		data.swap (PendingData);
+		ConsumeData (data.c_str(), data.length());
+	}
+	if (!bPaused)
+		ResumeSource();
+}
+
+
 /*****************************
 HttpConnection_t::ConsumeData
 *****************************/
@@ -153,10 +903,30 @@ void HttpConnection_t::ConsumeData (const char *data, int length)
 		throw std::runtime_error ("bad args consuming http data");
 
 	while (length > 0) {
+		// User code paused us from a callback (or before this data arrived).
+		// Hold on to the rest until ResumeConsuming. The copy keeps the null
+		// terminator the header parsing depends on.
+		if (bPaused) {
+			PendingData.append (data, length);
+			return;
+		}
+
+		//----------------------------------- WebSocketState
+		// After an upgrade everything belongs to the frame parser.
+		if (ProtocolState == WebSocketState) {
+			WebSocket->ConsumeData (data, length);
+			return;
+		}
+
 		//----------------------------------- BaseState
 		// Initialize for a new request. Don't consume any data.
 		// For anal-retentive security we may want to bzero the header block.
 		if (ProtocolState == BaseState) {
+			RequestFinished();
+			for (int i=0; i < NumPhases; i++)
+				Phases[i] = 0;
+			Phases [FirstBytePhase] = _MonotonicMicros();
+			RequestTime = time (NULL);
 			ProtocolState = PreheaderState;
 			nLeadingBlanks = 0;
 			HeaderLinePos = 0;
@@ -165,10 +935,19 @@ void HttpConnection_t::ConsumeData (const char *data, int length)
 			ContentPos = 0;
 			bRequestSeen = false;
 			bContentLengthSeen = false;
+			bExpectContinue = false;
+			bUnknownExpectation = false;
+			bUpgradeWebSocket = false;
+			bConnectionUpgrade = false;
+			WebSocketVersion = 0;
+			bBodyEncoded = false;
+			bInflating = false;
 			if (_Content) {
 				free ((void*)_Content);
 				_Content = NULL;
 			}
+			delete BodyResults;
+			BodyResults = NULL;
 			RequestMethod = NULL;
 			#ifdef OS_WIN32
 			Cookie.erase(Cookie.begin(),Cookie.end());
@@ -178,6 +957,9 @@ void HttpConnection_t::ConsumeData (const char *data, int length)
 			RequestUri.erase(RequestUri.begin(),RequestUri.end());
 			QueryString.erase(QueryString.begin(),QueryString.end());
 			Protocol.erase(Protocol.begin(),Protocol.end());
+			Range.erase(Range.begin(),Range.end());
+			IfRange.erase(IfRange.begin(),IfRange.end());
+			WebSocketKey.erase(WebSocketKey.begin(),WebSocketKey.end());
 			#else
 			Cookie.clear();
 			IfNoneMatch.clear();
@@ -186,6 +968,9 @@ void HttpConnection_t::ConsumeData (const char *data, int length)
 			RequestUri.clear();
 			QueryString.clear();
 			Protocol.clear();
+			Range.clear();
+			IfRange.clear();
+			WebSocketKey.clear();
 			#endif
 
 			if (bSetEnvironmentStrings) {
@@ -197,6 +982,8 @@ void HttpConnection_t::ConsumeData (const char *data, int length)
 				unsetenv ("REQUEST_URI");
 				unsetenv ("QUERY_STRING");
 				unsetenv ("PROTOCOL");
+				unsetenv ("HTTP_RANGE");
+				unsetenv ("HTTP_IF_RANGE");
 			}
 		}
 
@@ -228,11 +1015,18 @@ void HttpConnection_t::ConsumeData (const char *data, int length)
 				if (!_InterpretHeaderLine (HeaderLine))
 					goto send_error;
 				if (HeaderLinePos == 0) {
+					Phases [HeadersPhase] = _MonotonicMicros();
+					if (!_CheckRequestBody())
+						goto send_error;
 					if (ContentLength > 0) {
 						if (_Content)
 							free (_Content);
 						_Content = NULL;
-						if (bAccumulatePost) {
+						if (bInflateBodies && bBodyEncoded) {
+							if (!_StartInflate())
+								throw std::runtime_error ("resource exhaustion");
+						}
+						else if (bAccumulatePost) {
 							_Content = (char*) malloc (ContentLength + 1);
 							if (!_Content)
 								throw std::runtime_error ("resource exhaustion");
@@ -240,8 +1034,10 @@ void HttpConnection_t::ConsumeData (const char *data, int length)
 						ContentPos = 0;
 						ProtocolState = ReadingContentState;
 					}
-					else
+					else {
+						Phases [BodyPhase] = Phases [HeadersPhase];
 						ProtocolState = DispatchState;
+					}
 				}
 				HeaderLinePos = 0;
 				data++;
@@ -269,12 +1065,19 @@ void HttpConnection_t::ConsumeData (const char *data, int length)
 
 		//----------------------------------- ReadingContentState
 		// Read POST content.
-		while ((ProtocolState == ReadingContentState) && (length > 0)) {
+		while ((ProtocolState == ReadingContentState) && (length > 0) && !bPaused) {
 			int len = ContentLength - ContentPos;
 			if (len > length)
 				len = length;
 
-			if (bAccumulatePost)
+			if (bInflating) {
+				// User code may pause us between inflated slices, so
+				// this can stop short of len.
+				len = _InflateContent (data, len, false);
+				if (len < 0)
+					goto send_error;
+			}
+			else if (bAccumulatePost)
 				memcpy (_Content + ContentPos, data, len);
 			else
 				ReceivePostData (data, len);
@@ -283,17 +1086,32 @@ void HttpConnection_t::ConsumeData (const char *data, int length)
 			length -= len;
 			ContentPos += len;
 			if (ContentPos == ContentLength) {
-				if (bAccumulatePost)
+				if (bInflating) {
+					if (!_FinishInflate())
+						goto send_error;
+				}
+				else if (bAccumulatePost)
 					_Content[ContentPos] = 0;
+				Phases [BodyPhase] = _MonotonicMicros();
 				ProtocolState = DispatchState;
 			}
 		}
 
 
 		//----------------------------------- DispatchState
+		// A WebSocket upgrade (if user code accepts them) switches the
+		// connection over for good, and any data after the request head
+		// goes around the loop again to the frame parser.
 		if (ProtocolState == DispatchState) {
-			ProcessRequest (RequestMethod, Cookie.c_str(), IfNoneMatch.c_str(), ContentType.c_str(), QueryString.c_str(), PathInfo.c_str(), RequestUri.c_str(), Protocol.c_str(), ContentLength, _Content, HeaderBlock, HeaderBlockPos);
-			ProtocolState = BaseState;
+			if (bAcceptWebSockets && bUpgradeWebSocket && bConnectionUpgrade && !strcmp (RequestMethod, "GET")) {
+				if (!_UpgradeToWebSocket())
+					goto send_error;
+				continue;
+			}
+			// A request parked on the response cache pauses us, so the
+			// rest of the data is held back until it's been answered.
+			if (_DispatchRequest())
+				ProtocolState = BaseState;
 		}
 	}
 
@@ -366,19 +1184,75 @@ bool HttpConnection_t::_InterpretHeaderLine (const char *header)
 		while (*s && ((*s==' ') || (*s=='\t')))
 			s++;
 		ContentLength = atoi (s);
-		if (ContentLength > MaxContentLength) {
-			// TODO, log this.
-			_SendError (RESPONSE_CODE_406);
-			return false;
-		}
+		// The limit is enforced in _CheckRequestBody, once we know
+		// whether the client is waiting on a 100 Continue.
 	}
 	else if (!strncasecmp (header, "cookie:", 7)) {
 		const char *s = header + 7;
 		while (*s && ((*s==' ') || (*s=='\t')))
 			s++;
-		Cookie = s;
+		// Clients may split their cookies over several headers
+		// (RFC 6265 says they shouldn't, but HTTP/2 proxies do).
+		if (!Cookie.empty())
+			Cookie += "; ";
+		Cookie += s;
 		if (bSetEnvironmentStrings)
-			setenv ("HTTP_COOKIE", s, true);
+			setenv ("HTTP_COOKIE", Cookie.c_str(), true);
+	}
+	else if (!strncasecmp (header, "expect:", 7)) {
+		const char *s = header + 7;
+		while (*s && ((*s==' ') || (*s=='\t')))
+			s++;
+		if (!strcasecmp (s, "100-continue"))
+			bExpectContinue = true;
+		else
+			bUnknownExpectation = true;
+	}
+	else if (!strncasecmp (header, "range:", 6)) {
+		const char *s = header + 6;
+		while (*s && ((*s==' ') || (*s=='\t')))
+			s++;
+		Range = s;
+		if (bSetEnvironmentStrings)
+			setenv ("HTTP_RANGE", s, true);
+	}
+	else if (!strncasecmp (header, "if-range:", 9)) {
+		const char *s = header + 9;
+		while (*s && ((*s==' ') || (*s=='\t')))
+			s++;
+		IfRange = s;
+		if (bSetEnvironmentStrings)
+			setenv ("HTTP_IF_RANGE", s, true);
+	}
+	else if (!strncasecmp (header, "upgrade:", 8)) {
+		const char *s = header + 8;
+		while (*s && ((*s==' ') || (*s=='\t')))
+			s++;
+		if (!strcasecmp (s, "websocket"))
+			bUpgradeWebSocket = true;
+	}
+	else if (!strncasecmp (header, "connection:", 11)) {
+		// A comma-separated list of tokens, one of which may be "upgrade".
+		const char *s = header + 11;
+		while (*s) {
+			while (*s && ((*s==' ') || (*s=='\t') || (*s==',')))
+				s++;
+			const char *e = s;
+			while (*e && (*e != ',') && (*e != ' ') && (*e != '\t'))
+				e++;
+			if (((e - s) == 7) && !strncasecmp (s, "upgrade", 7))
+				bConnectionUpgrade = true;
+			s = e;
+		}
+	}
+	else if (!strncasecmp (header, "sec-websocket-key:", 18)) {
+		const char *s = header + 18;
+		while (*s && ((*s==' ') || (*s=='\t')))
+			s++;
+		WebSocketKey = s;
+	}
+	else if (!strncasecmp (header, "sec-websocket-version:", 22)) {
+		WebSocketVersion = atoi (header + 22);
 	}
 	else if (!strncasecmp (header, "If-none-match:", 14)) {
 		const char *s = header + 14;
@@ -388,6 +1262,14 @@ bool HttpConnection_t::_InterpretHeaderLine (const char *header)
 		if (bSetEnvironmentStrings)
 			setenv ("IF_NONE_MATCH", s, true);
 	}
+	else if (!strncasecmp (header, "content-encoding:", 17)) {
+		// zlib tells gzip and zlib-wrapped deflate apart by their headers.
+		const char *s = header + 17;
+		while (*s && ((*s==' ') || (*s=='\t')))
+			s++;
+		if (!strcasecmp (s, "gzip") || !strcasecmp (s, "x-gzip") || !strcasecmp (s, "deflate"))
+			bBodyEncoded = true;
+	}
 	else if (!strncasecmp (header, "Content-type:", 13)) {
 		const char *s = header + 13;
 		while (*s && ((*s==' ') || (*s=='\t')))
@@ -569,17 +1451,403 @@ bool HttpConnection_t::_DetectVerbAndSetEnvString (const char *request, int verb
 
 
 
+/*********************************
+HttpConnection_t::ParseByteRanges
+*********************************/
+
+bool HttpConnection_t::ParseByteRanges (const char *spec, long long length, vector< pair<long long, long long> > &ranges)
+{
+	/* Resolve a Range header (RFC 7233) against a representation of the
+	 * given length. On return, ranges holds the satisfiable [first,last]
+	 * byte positions in the order requested.
+	 * Return false if the header is malformed or asks for an unreasonable
+	 * number of ranges, in which case the caller should ignore it and send
+	 * the whole thing. An empty result means nothing was satisfiable (416).
+	 */
+
+	const int MaxByteRanges = 16;
+
+	ranges.clear();
+	if (!spec)
+		return false;
+
+	while ((*spec == ' ') || (*spec == '\t'))
+		spec++;
+	if (strncasecmp (spec, "bytes=", 6))
+		return false;
+	spec += 6;
+
+	int n = 0;
+	while (true) {
+		while ((*spec == ' ') || (*spec == '\t'))
+			spec++;
+
+		long long first = -1, last = -1;
+		if (isdigit ((unsigned char)*spec)) {
+			first = 0;
+			while (isdigit ((unsigned char)*spec)) {
+				if (first > (0x7fffffffffffffffLL - 9) / 10)
+					return false;
+				first = (first * 10) + (*spec++ - '0');
+			}
+		}
+		if (*spec++ != '-')
+			return false;
+		if (isdigit ((unsigned char)*spec)) {
+			last = 0;
+			while (isdigit ((unsigned char)*spec)) {
+				if (last > (0x7fffffffffffffffLL - 9) / 10)
+					return false;
+				last = (last * 10) + (*spec++ - '0');
+			}
+		}
+
+		if ((first < 0) && (last < 0))
+			return false;
+		if ((first >= 0) && (last >= 0) && (last < first))
+			return false;
+		if (++n > MaxByteRanges)
+			return false;
+
+		if (first < 0) {
+			// suffix range: the final "last" bytes.
+			if ((last > 0) && (length > 0))
+				ranges.push_back (make_pair ((last < length) ? (length - last) : 0, length - 1));
+		}
+		else if (first < length)
+			ranges.push_back (make_pair (first, ((last < 0) || (last >= length)) ? (length - 1) : last));
+
+		while ((*spec == ' ') || (*spec == '\t'))
+			spec++;
+		if (!*spec)
+			break;
+		if (*spec++ != ',')
+			return false;
+	}
+
+	return true;
+}
+
+
+/**********
+_NextCookie
+**********/
+
+static bool _NextCookie (const char *&s, const char *&name, size_t &namelen, const char *&value, size_t &valuelen)
+{
+	/* Step over one name=value pair of a Cookie header, leaving s at the
+	 * start of the next one. Pairs without a name or an = are skipped.
+	 * The value is returned raw, less any whitespace and double quotes
+	 * around it.
+	 */
+	while (*s) {
+		while ((*s == ' ') || (*s == '\t') || (*s == ';'))
+			s++;
+		const char *pair = s;
+		while (*s && (*s != ';'))
+			s++;
+		const char *end = s;
+
+		const char *eq = (const char*) memchr (pair, '=', end - pair);
+		if (!eq)
+			continue;
+		const char *ne = eq;
+		while ((ne > pair) && ((ne[-1] == ' ') || (ne[-1] == '\t')))
+			ne--;
+		if (ne == pair)
+			continue;
+
+		const char *v = eq + 1;
+		while ((v < end) && ((*v == ' ') || (*v == '\t')))
+			v++;
+		const char *ve = end;
+		while ((ve > v) && ((ve[-1] == ' ') || (ve[-1] == '\t')))
+			ve--;
+		if (((ve - v) >= 2) && (*v == '"') && (ve[-1] == '"')) {
+			v++;
+			ve--;
+		}
+
+		name = pair;
+		namelen = ne - pair;
+		value = v;
+		valuelen = ve - v;
+		return true;
+	}
+	return false;
+}
+
+
+/*************
+_UnescapeInto
+*************/
+
+static void _UnescapeInto (const char *s, size_t len, string &out)
+{
+	// Cookie values are commonly percent-encoded. A % that isn't
+	// followed by two hex digits is taken literally.
+	out.clear();
+	out.reserve (len);
+	for (size_t i=0; i < len; i++) {
+		if ((s[i] == '%') && (i + 2 < len) && isxdigit ((unsigned char)s[i+1]) && isxdigit ((unsigned char)s[i+2])) {
+			char hex[3] = {s[i+1], s[i+2], 0};
+			out += (char) strtol (hex, NULL, 16);
+			i += 2;
+		}
+		else
+			out += s[i];
+	}
+}
+
+
+/******************************
+HttpConnection_t::ParseCookies
+******************************/
+
+void HttpConnection_t::ParseCookies (const char *header, vector< pair<string, string> > &cookies)
+{
+	/* Split a (merged) Cookie header into unescaped name/value pairs, in
+	 * the order sent. A name can appear more than once: browsers send the
+	 * cookie with the most specific path first.
+	 */
+	cookies.clear();
+	if (!header)
+		return;
+
+	const char *name, *value;
+	size_t namelen, valuelen;
+	string v;
+	while (_NextCookie (header, name, namelen, value, valuelen)) {
+		_UnescapeInto (value, valuelen, v);
+		cookies.push_back (make_pair (string (name, namelen), v));
+	}
+}
+
+
+/****************************
+HttpConnection_t::FindCookie
+****************************/
+
+bool HttpConnection_t::FindCookie (const char *header, const char *name, string &value)
+{
+	/* Look up the first cookie with the given name, without splitting
+	 * out (or unescaping) the others.
+	 */
+	if (!header || !name)
+		return false;
+
+	size_t len = strlen (name);
+	const char *n, *v;
+	size_t nlen, vlen;
+	while (_NextCookie (header, n, nlen, v, vlen)) {
+		if ((nlen == len) && !memcmp (n, name, len)) {
+			_UnescapeInto (v, vlen, value);
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/***********************************
+HttpConnection_t::_CheckRequestBody
+***********************************/
+
+bool HttpConnection_t::_CheckRequestBody()
+{
+	/* Called when we reach the end of the headers, before any of the body
+	 * is read. Return false after sending an error response if the request
+	 * should be refused.
+	 * Expect: 100-continue only means something to HTTP/1.1 clients with
+	 * a body to send. Anything else in an Expect header gets a 417.
+	 */
+
+	if (bUnknownExpectation) {
+		_SendError (RESPONSE_CODE_417);
+		return false;
+	}
+
+	bool expecting = bExpectContinue && (ContentLength > 0) && !strcasecmp (Protocol.c_str(), "HTTP/1.1");
+
+	if ((ContentLength < 0) || (ContentLength > nMaxContentLength)) {
+		// TODO, log this.
+		// A client that's waiting gets a proper 413. Others get the
+		// 406 we have always sent.
+		_SendError (expecting ? RESPONSE_CODE_413 : RESPONSE_CODE_406);
+		return false;
+	}
+
+	if (!expecting)
+		return true;
+
+	int status = ExpectContinue (RequestMethod, Cookie.c_str(), IfNoneMatch.c_str(), ContentType.c_str(), QueryString.c_str(), PathInfo.c_str(), RequestUri.c_str(), Protocol.c_str(), ContentLength, HeaderBlock, HeaderBlockPos);
+	switch (status) {
+		case 0:
+		case 100:
+			SendData ("HTTP/1.1 " RESPONSE_CODE_100 "\r\n\r\n", strlen ("HTTP/1.1 " RESPONSE_CODE_100 "\r\n\r\n"));
+			return true;
+		case 401:
+			_SendError (RESPONSE_CODE_401);
+			return false;
+		case 403:
+			_SendError (RESPONSE_CODE_403);
+			return false;
+		case 413:
+			_SendError (RESPONSE_CODE_413);
+			return false;
+		default:
+			_SendError (RESPONSE_CODE_417);
+			return false;
+	}
+}
+
+
+/*************************************
+HttpConnection_t::_UpgradeToWebSocket
+*************************************/
+
+bool HttpConnection_t::_UpgradeToWebSocket()
+{
+	/* Perform the server side of the RFC 6455 opening handshake and switch
+	 * to WebSocketState. We only speak version 13; clients asking for
+	 * anything else are told so with a 426 and the connection is closed.
+	 * We don't negotiate subprotocols or extensions.
+	 */
+
+	if ((WebSocketVersion != 13) || WebSocketKey.empty()) {
+		_SendError (RESPONSE_CODE_426);
+		return false;
+	}
+
+	string resp = "HTTP/1.1 " RESPONSE_CODE_101 "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+	resp += WebSocket_t::AcceptKey (WebSocketKey.c_str());
+	resp += "\r\n\r\n";
+	bLogPending = true;
+	ResponseStatus = 0;
+	BytesSent = 0;
+	SendData (resp.c_str(), resp.length());
+
+	delete WebSocket;
+	WebSocket = new WebSocket_t (this, nMaxContentLength);
+	ProtocolState = WebSocketState;
+
+	ProcessWebSocketOpen (RequestMethod, Cookie.c_str(), IfNoneMatch.c_str(), ContentType.c_str(), QueryString.c_str(), PathInfo.c_str(), RequestUri.c_str(), Protocol.c_str(), HeaderBlock, HeaderBlockPos);
+	return true;
+}
+
+
+/*******************************************
+Cached Date header and prebuilt error responses
+*******************************************/
+
+/* The Date header only changes once a second, so we format it once a
+ * second. The error responses we send from here are built once, with a
+ * slot for the date (which is always 29 bytes long) that we rewrite when
+ * the date changes. Sending one is then just a copy of a static buffer.
+ * All of this is only touched from the reactor thread.
+ */
+
+static char HttpDate [32];
+static time_t HttpDateTime = (time_t)-1;
+
+struct ErrorResponse_t
+{
+	const char *Status;
+	const char *Extra;
+	const char *Body;
+	string Data;
+	size_t DateOffset;
+};
+
+static ErrorResponse_t ErrorResponses[] = {
+	{RESPONSE_CODE_400, "", "Bad Request\n", "", 0},
+	{RESPONSE_CODE_401, "", "Unauthorized\n", "", 0},
+	{RESPONSE_CODE_403, "", "Forbidden\n", "", 0},
+	{RESPONSE_CODE_405, "", "Method Not Allowed\n", "", 0},
+	{RESPONSE_CODE_406, "", "Not Acceptable\n", "", 0},
+	{RESPONSE_CODE_413, "", "Request Entity Too Large\n", "", 0},
+	{RESPONSE_CODE_417, "", "Expectation Failed\n", "", 0},
+	{RESPONSE_CODE_426, "Sec-WebSocket-Version: 13\r\n", "Upgrade Required\n", "", 0},
+	{RESPONSE_CODE_431, "", "Request Header Fields Too Large\n", "", 0},
+	{RESPONSE_CODE_505, "", "HTTP Version Not Supported\n", "", 0}
+};
+
+static const int nErrorResponses = sizeof(ErrorResponses) / sizeof(ErrorResponse_t);
+
+
+/*****************************
+HttpConnection_t::GetHttpDate
+*****************************/
+
+const char *HttpConnection_t::GetHttpDate()
+{
+	// RFC 7231 IMF-fixdate. We don't use strftime because the day
+	// and month names must not follow the locale.
+	static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+	time_t now = time (NULL);
+	if (now == HttpDateTime)
+		return HttpDate;
+
+	struct tm tm;
+	#ifdef OS_WIN32
+	gmtime_s (&tm, &now);
+	#else
+	gmtime_r (&now, &tm);
+	#endif
+	snprintf (HttpDate, sizeof(HttpDate), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+			days [tm.tm_wday], tm.tm_mday, months [tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+	HttpDateTime = now;
+
+	for (int i=0; i < nErrorResponses; i++) {
+		ErrorResponse_t &r = ErrorResponses[i];
+		if (!r.Data.empty())
+			r.Data.replace (r.DateOffset, 29, HttpDate, 29);
+	}
+	return HttpDate;
+}
+
+
 /****************************
 HttpConnection_t::_SendError
 ****************************/
 
 void HttpConnection_t::_SendError (const char *header)
 {
+	// Errors are logged like any other response.
+	bLogPending = true;
+	ResponseStatus = 0;
+	BytesSent = 0;
+
+	const char *date = GetHttpDate();
+
+	for (int i=0; i < nErrorResponses; i++) {
+		ErrorResponse_t &r = ErrorResponses[i];
+		if (strcmp (r.Status, header))
+			continue;
+
+		if (r.Data.empty()) {
+			char len [16];
+			snprintf (len, sizeof(len), "%d", (int)strlen (r.Body));
+			r.Data = string ("HTTP/1.1 ") + r.Status + "\r\nDate: ";
+			r.DateOffset = r.Data.length();
+			r.Data += date;
+			r.Data += string ("\r\nConnection: close\r\nContent-Type: text/plain\r\n") + r.Extra + "Content-Length: " + len + "\r\n\r\n" + r.Body;
+		}
+		SendData (r.Data.data(), r.Data.length());
+		return;
+	}
+
+	// Not one of ours.
 	stringstream ss;
 	ss << "HTTP/1.1 " << header << "\r\n";
+	ss << "Date: " << date << "\r\n";
 	ss << "Connection: close\r\n";
 	ss << "Content-Type: text/plain\r\n";
+	ss << "Content-Length: 0\r\n";
 	ss << "\r\n";
 
-	SendData (ss.str().c_str(), ss.str().length());
+	string s = ss.str();
+	SendData (s.c_str(), s.length());
 }
@@ -26,10 +26,28 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #ifndef __HttpPersonality__H_
 #define __HttpPersonality__H_
 
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define RESPONSE_CODE_100  "100 Continue"
+#define RESPONSE_CODE_101  "101 Switching Protocols"
+#define RESPONSE_CODE_400  "400 Bad Request"
+#define RESPONSE_CODE_401  "401 Unauthorized"
+#define RESPONSE_CODE_403  "403 Forbidden"
 #define RESPONSE_CODE_405  "405 Method Not Allowed"
 #define RESPONSE_CODE_406  "406 Not Acceptable"
+#define RESPONSE_CODE_413  "413 Request Entity Too Large"
+#define RESPONSE_CODE_417  "417 Expectation Failed"
+#define RESPONSE_CODE_426  "426 Upgrade Required"
+#define RESPONSE_CODE_431  "431 Request Header Fields Too Large"
 #define RESPONSE_CODE_505  "505 HTTP Version Not Supported"
 
+class WebSocket_t;
+struct BodyJob_t;
+struct z_stream_s;
+
 /**********************
 class HttpConnection_t
 **********************/
@@ -40,10 +58,34 @@ class HttpConnection_t
 		HttpConnection_t();
 		virtual ~HttpConnection_t();
 
+		// Points in the life of a request, timed from the monotonic clock.
+		enum Phase_t {
+			FirstBytePhase,
+			HeadersPhase,
+			BodyPhase,
+			DispatchPhase,
+			FirstResponsePhase,
+			LastResponsePhase,
+			NumPhases
+		};
+
 		void ConsumeData (const char*, int);
 
 		virtual void SendData (const char*, int);
 		virtual void CloseConnection (bool after_writing);
+
+		// For event channels: send a buffer that goes to many connections,
+		// and say how much we've sent that hasn't gone out yet. Whatever
+		// is sent is copied into the connection's own outbound buffer, so
+		// a channel only shares events that are still queued.
+		virtual void SendShared (const std::shared_ptr<const std::string> &b) {SendData (b->data(), b->length());}
+		virtual size_t GetOutboundSize() {return 0;}
+
+		// Stop and restart reading from the socket, so that data doesn't
+		// pile up in PendingData while we're paused.
+		virtual void PauseSource() {}
+		virtual void ResumeSource() {}
+
 		virtual void ProcessRequest (const char *method,
 				const char *cookie,
 				const char *ifnonematch,
@@ -57,9 +99,72 @@ class HttpConnection_t
 				const char* hdrblock,
 				int hdrblksize);
 
+		virtual int ExpectContinue (const char *method,
+				const char *cookie,
+				const char *ifnonematch,
+				const char *content_type,
+				const char *query_string,
+				const char *path_info,
+				const char *request_uri,
+				const char *protocol,
+				int content_length,
+				const char* hdrblock,
+				int hdrblksize);
+
+		virtual void ProcessWebSocketOpen (const char *method,
+				const char *cookie,
+				const char *ifnonematch,
+				const char *content_type,
+				const char *query_string,
+				const char *path_info,
+				const char *request_uri,
+				const char *protocol,
+				const char* hdrblock,
+				int hdrblksize);
+		virtual void ReceiveWebSocketMessage (const char *data, int len, bool binary);
+		virtual void WebSocketClosed (int code, const char *reason, int len);
+
+		void SendWebSocketMessage (const char*, int, bool binary);
+		void CloseWebSocket (int code, const char *reason, int len);
+		bool IsWebSocket() const {return ProtocolState == WebSocketState;}
+
 		virtual void ReceivePostData(const char *data, int len);
 		virtual void SetNoEnvironmentStrings() {bSetEnvironmentStrings = false;}
 		virtual void SetDontAccumulatePost() {bAccumulatePost = false;}
+		virtual void SetMaxContentLength (int n) {nMaxContentLength = n;}
+		void SetInflateBodies (int max_inflated) {bInflateBodies = true; nMaxInflatedLength = max_inflated;}
+		virtual void SetAcceptWebSockets() {bAcceptWebSockets = true;}
+
+		void PauseConsuming() {if (!bPaused) {bPaused = true; PauseSource();}}
+		void ResumeConsuming();
+		bool IsPaused() const {return bPaused;}
+		void CountBytesSent (const char*, int);
+		void RequestFinished();
+
+		void BeginCapture();
+		bool EndCapture (const std::vector<std::string> &vary, double ttl, bool complete);
+		void CacheReleased (bool bypass);
+		void LeaveCache();
+		void CaptureClose();
+
+		void SetBodyStages (const std::vector<std::string> &stages) {BodyStages = stages;}
+		void BodyProcessed (BodyJob_t*);
+		void CancelBodyJob();
+
+		int GetContentLength() const {return ContentLength;}
+		int GetContentPos() const {return ContentPos;}
+		long long GetPhaseTime (Phase_t p) const {return Phases[p];}
+
+		static const char *GetHttpDate();
+		static unsigned long long RequestCount;
+		static bool ParseByteRanges (const char*, long long, std::vector< std::pair<long long, long long> >&);
+		static void ParseCookies (const char*, std::vector< std::pair<std::string, std::string> >&);
+		static bool FindCookie (const char*, const char *name, std::string&);
+
+	protected:
+		const BodyJob_t *GetBodyResults() const {return BodyResults;}
+		const std::string &GetRange() const {return Range;}
+		const std::string &GetIfRange() const {return IfRange;}
 
   private:
 
@@ -69,6 +174,7 @@ class HttpConnection_t
 			HeaderState,
 			ReadingContentState,
 			DispatchState,
+			WebSocketState,
 			EndState
 		} ProtocolState;
 
@@ -89,11 +195,62 @@ class HttpConnection_t
 		int ContentLength;
 		int ContentPos;
 		char *_Content;
+		int nMaxContentLength;
+
+		// Bodies sent with Content-Encoding gzip or deflate are inflated as
+		// they arrive, if user code asked for it, through one zlib stream
+		// that is reset for each request. ContentPos counts what we've read
+		// off the wire, and InflatedLength what we've made of it.
+		bool bInflateBodies;
+		bool bBodyEncoded;
+		bool bInflating;
+		bool bInflateDone;
+		int nMaxInflatedLength;
+		int InflatedLength;
+		int InflatedCapacity;
+		struct z_stream_s *Inflater;
+
+		// Data received while paused, not yet consumed.
+		std::string PendingData;
+
+		// For the response cache. CacheKey is set while we're answering a
+		// request the cache could hold, and CacheHeaders keeps its headers
+		// until we know which of them the response varies on.
+		std::string CacheKey;
+		std::string CacheHeaders;
+		std::string Captured;
+		bool bCapturing;
+		bool bCaptureClose;
+		bool bCacheWaiting;
+		bool bSkipCache;
+
+		// Stages the body goes through on the worker pool before user code
+		// sees it, and the results while user code is looking at them.
+		std::vector<std::string> BodyStages;
+		bool bBodyWaiting;
+		BodyJob_t *BodyResults;
+
+		// For the access log. A request is pending from the time we start
+		// responding to it until RequestFinished. Phases are in microseconds,
+		// and zero until the request gets there.
+		bool bLogPending;
+		int ResponseStatus;
+		long long BytesSent;
+		long long Phases [NumPhases];
+		time_t RequestTime;
 
 		bool bSetEnvironmentStrings;
 		bool bAccumulatePost;
 		bool bRequestSeen;
 		bool bContentLengthSeen;
+		bool bExpectContinue;
+		bool bPaused;
+		bool bAcceptWebSockets;
+		bool bUpgradeWebSocket;
+		bool bConnectionUpgrade;
+		int WebSocketVersion;
+		WebSocket_t *WebSocket;
+		bool bUnknownExpectation;
 
 		const char *RequestMethod;
 		std::string Cookie;
@@ -103,11 +260,24 @@ class HttpConnection_t
 		std::string RequestUri;
 		std::string QueryString;
 		std::string Protocol;
+		std::string Range;
+		std::string IfRange;
+		std::string WebSocketKey;
 
 	private:
 		bool _InterpretHeaderLine (const char*);
 		bool _InterpretRequest (const char*);
 		bool _DetectVerbAndSetEnvString (const char*, int);
+		bool _CheckRequestBody();
+		bool _UpgradeToWebSocket();
+		bool _DispatchRequest();
+		bool _StartInflate();
+		int _InflateContent (const char*, int, bool finish);
+		bool _FinishInflate();
+		void _RewriteInflatedHeaders();
+		void _LogRequest();
+		void _LogSlowRequest (long long total);
+		static long long _MonotonicMicros();
 		void _SendError (const char*);
 };
 
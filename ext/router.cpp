@@ -0,0 +1,274 @@
+/*****************************************************************************
+
+File:     router.cpp
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#include <string>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+#include "router.h"
+
+
+/***************************
+HttpRouter_t::Node_t::~Node_t
+***************************/
+
+HttpRouter_t::Node_t::~Node_t()
+{
+	for (size_t i=0; i < Children.size(); i++)
+		delete Children[i];
+	delete Param;
+	delete Splat;
+}
+
+
+/**************************
+HttpRouter_t::HttpRouter_t
+**************************/
+
+HttpRouter_t::HttpRouter_t():
+	nRoutes (0)
+{
+}
+
+
+/***************************
+HttpRouter_t::~HttpRouter_t
+***************************/
+
+HttpRouter_t::~HttpRouter_t()
+{
+	for (map<string, Node_t*>::iterator i = Roots.begin(); i != Roots.end(); i++)
+		delete i->second;
+}
+
+
+/*****************
+HttpRouter_t::Add
+*****************/
+
+void HttpRouter_t::Add (const char *method, const char *pattern, int handler)
+{
+	/* Patterns are literal paths in which a segment may be replaced by
+	 * :name (matches up to the next slash) or, as the final segment,
+	 * *name (matches the rest of the path, including slashes).
+	 * A method of "*" matches any request method, but routes registered
+	 * for the specific method are always preferred.
+	 * We throw on malformed or conflicting patterns; the caller is
+	 * expected to register routes at startup and surface the error.
+	 */
+
+	if (!method || !pattern || (*pattern != '/'))
+		throw std::runtime_error ("route pattern must begin with /");
+
+	Node_t *&root = Roots [method];
+	if (!root)
+		root = new Node_t;
+
+	Node_t *node = root;
+	string path (pattern);
+	size_t pos = 0;
+
+	while (pos < path.length()) {
+		if ((path[pos] == ':') || (path[pos] == '*')) {
+			bool splat = (path[pos] == '*');
+			size_t end = splat ? path.length() : path.find ('/', pos);
+			if (end == string::npos)
+				end = path.length();
+			string name = path.substr (pos + 1, end - (pos + 1));
+			if (name.empty())
+				throw std::runtime_error ("unnamed route parameter");
+			if (splat && (name.find ('/') != string::npos))
+				throw std::runtime_error ("splat must be the last route segment");
+
+			Node_t *&child = splat ? node->Splat : node->Param;
+			if (!child) {
+				child = new Node_t;
+				child->Name = name;
+			}
+			else if (child->Name != name)
+				throw std::runtime_error ("conflicting route parameter names");
+
+			node = child;
+			pos = end;
+		}
+		else {
+			size_t end = path.find_first_of (":*", pos);
+			if (end == string::npos)
+				end = path.length();
+			if ((path[end-1] != '/') && (end < path.length()))
+				throw std::runtime_error ("route parameter must start a segment");
+			node = _InsertStatic (node, path.substr (pos, end - pos));
+			pos = end;
+		}
+	}
+
+	if (node->Handler >= 0)
+		throw std::runtime_error ("duplicate route");
+	node->Handler = handler;
+	nRoutes++;
+}
+
+
+/***************************
+HttpRouter_t::_InsertStatic
+***************************/
+
+HttpRouter_t::Node_t *HttpRouter_t::_InsertStatic (Node_t *node, const string &s)
+{
+	/* Descend through (and split where necessary) the static children of
+	 * node so that the returned node is reached by consuming exactly s.
+	 */
+
+	for (size_t i=0; i < node->Children.size(); i++) {
+		Node_t *child = node->Children[i];
+		if (child->Prefix[0] != s[0])
+			continue;
+
+		size_t common = 0;
+		while ((common < s.length()) && (common < child->Prefix.length()) && (s[common] == child->Prefix[common]))
+			common++;
+
+		if (common < child->Prefix.length()) {
+			Node_t *mid = new Node_t;
+			mid->Prefix = child->Prefix.substr (0, common);
+			child->Prefix.erase (0, common);
+			mid->Children.push_back (child);
+			node->Children[i] = mid;
+			child = mid;
+		}
+
+		if (common == s.length())
+			return child;
+		return _InsertStatic (child, s.substr (common));
+	}
+
+	Node_t *child = new Node_t;
+	child->Prefix = s;
+	node->Children.push_back (child);
+	return child;
+}
+
+
+/*******************
+HttpRouter_t::Match
+*******************/
+
+int HttpRouter_t::Match (const char *method, const char *path, Params_t &params) const
+{
+	/* Returns the handler index registered for the route, or -1.
+	 * On success, params holds the :param and *splat captures in the order
+	 * they appear in the pattern. The captured values are NOT unescaped.
+	 */
+
+	params.clear();
+	if (!path)
+		return -1;
+
+	if (method) {
+		map<string, Node_t*>::const_iterator i = Roots.find (method);
+		if (i != Roots.end()) {
+			int h = _Match (i->second, path, params);
+			if (h >= 0)
+				return h;
+		}
+	}
+
+	map<string, Node_t*>::const_iterator i = Roots.find ("*");
+	if (i != Roots.end())
+		return _Match (i->second, path, params);
+
+	return -1;
+}
+
+
+/****************************
+HttpRouter_t::AllowedMethods
+****************************/
+
+void HttpRouter_t::AllowedMethods (const char *path, vector<string> &methods) const
+{
+	// The methods with a route for path, so a request that matched none
+	// can be told apart as 405 rather than 404.
+	methods.clear();
+	if (!path)
+		return;
+	Params_t params;
+	map<string, Node_t*>::const_iterator i;
+	for (i = Roots.begin(); i != Roots.end(); i++) {
+		if ((i->first != "*") && (_Match (i->second, path, params) >= 0))
+			methods.push_back (i->first);
+		params.clear();
+	}
+}
+
+
+/********************
+HttpRouter_t::_Match
+********************/
+
+int HttpRouter_t::_Match (const Node_t *node, const char *path, Params_t &params) const
+{
+	// Static segments beat :params, which beat *splats. We backtrack
+	// if a more specific branch fails further down.
+
+	if (!*path) {
+		if (node->Handler >= 0)
+			return node->Handler;
+		if (node->Splat && (node->Splat->Handler >= 0)) {
+			params.push_back (make_pair (node->Splat->Name, string()));
+			return node->Splat->Handler;
+		}
+		return -1;
+	}
+
+	for (size_t i=0; i < node->Children.size(); i++) {
+		const Node_t *child = node->Children[i];
+		if (child->Prefix[0] != *path)
+			continue;
+		if (!strncmp (path, child->Prefix.c_str(), child->Prefix.length())) {
+			int h = _Match (child, path + child->Prefix.length(), params);
+			if (h >= 0)
+				return h;
+		}
+		break;
+	}
+
+	if (node->Param && (*path != '/')) {
+		const char *end = strchr (path, '/');
+		if (!end)
+			end = path + strlen (path);
+		params.push_back (make_pair (node->Param->Name, string (path, end - path)));
+		int h = _Match (node->Param, end, params);
+		if (h >= 0)
+			return h;
+		params.pop_back();
+	}
+
+	if (node->Splat && (node->Splat->Handler >= 0)) {
+		params.push_back (make_pair (node->Splat->Name, string (path)));
+		return node->Splat->Handler;
+	}
+
+	return -1;
+}
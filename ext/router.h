@@ -0,0 +1,76 @@
+/*****************************************************************************
+
+File:     router.h
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#ifndef __HttpRouter__H_
+#define __HttpRouter__H_
+
+#include <string>
+#include <vector>
+#include <map>
+
+/******************
+class HttpRouter_t
+******************/
+
+class HttpRouter_t
+{
+	public:
+		typedef std::vector< std::pair<std::string, std::string> > Params_t;
+
+		HttpRouter_t();
+		virtual ~HttpRouter_t();
+
+		void Add (const char *method, const char *pattern, int handler);
+		int Match (const char *method, const char *path, Params_t &params) const;
+		void AllowedMethods (const char *path, std::vector<std::string> &methods) const;
+		int Size() const {return nRoutes;}
+
+	private:
+		/* A node in the radix tree. Static children are keyed by the first
+		 * byte of their prefix, which is unique among siblings. A node has
+		 * at most one :param child and one *splat child, and the name of
+		 * that parameter is stored on the child itself.
+		 */
+		struct Node_t {
+			Node_t(): Param(NULL), Splat(NULL), Handler(-1) {}
+			~Node_t();
+
+			std::string Prefix;
+			std::string Name;
+			std::vector<Node_t*> Children;
+			Node_t *Param;
+			Node_t *Splat;
+			int Handler;
+		};
+
+		std::map<std::string, Node_t*> Roots;
+		int nRoutes;
+
+	private:
+		HttpRouter_t (const HttpRouter_t&);
+		HttpRouter_t &operator= (const HttpRouter_t&);
+
+		Node_t *_InsertStatic (Node_t*, const std::string&);
+		int _Match (const Node_t*, const char*, Params_t&) const;
+};
+
+#endif // __HttpRouter__H_
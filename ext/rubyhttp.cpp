@@ -24,12 +24,65 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <iostream>
 #include <string>
+#include <vector>
 #include <stdexcept>
 
 using namespace std;
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
 #include <ruby.h>
+#include <ruby/encoding.h>
+#include <ruby/debug.h>
 #include "http.h"
+#include "router.h"
+#include "accesslog.h"
+#include "cache.h"
+#include "workers.h"
+#include "channel.h"
+
+
+/*********************
+struct RubyHttpRouter_t
+*********************/
+
+struct RubyHttpRouter_t
+{
+	// The native tree maps routes to indices into Handlers, which holds
+	// the Ruby callables and is marked for the garbage collector.
+	HttpRouter_t Router;
+	VALUE Handlers;
+};
+
+
+
+/****************
+_BodyResultsHash
+****************/
+
+static VALUE _BodyResultsHash (const BodyJob_t *job)
+{
+	/* What the body stages found: each digest under its stage name,
+	 * "multipart" => [[headers, body], ...], "json" => true, and
+	 * "error" => message if a stage failed.
+	 */
+	VALUE h = rb_hash_new();
+	for (size_t i=0; i < job->Digests.size(); i++)
+		rb_hash_aset (h, rb_str_new (job->Digests[i].first.c_str(), job->Digests[i].first.length()), rb_str_new (job->Digests[i].second.c_str(), job->Digests[i].second.length()));
+	if (!job->Parts.empty()) {
+		VALUE parts = rb_ary_new();
+		for (size_t i=0; i < job->Parts.size(); i++)
+			rb_ary_push (parts, rb_assoc_new (rb_str_new (job->Parts[i].first.c_str(), job->Parts[i].first.length()), rb_str_new (job->Parts[i].second.c_str(), job->Parts[i].second.length())));
+		rb_hash_aset (h, rb_str_new2 ("multipart"), parts);
+	}
+	if (job->bJsonValid)
+		rb_hash_aset (h, rb_str_new2 ("json"), Qtrue);
+	if (!job->Error.empty())
+		rb_hash_aset (h, rb_str_new2 ("error"), rb_str_new (job->Error.c_str(), job->Error.length()));
+	return h;
+}
 
 
 
@@ -40,11 +93,15 @@ class RubyHttpConnection_t
 class RubyHttpConnection_t: public HttpConnection_t
 {
 	public:
-		RubyHttpConnection_t (VALUE v): Myself(v) {}
+		RubyHttpConnection_t (VALUE v): Myself(v), Router(NULL), bReusePostBuffer(false), bHeadOnly(false), nHeadEnd(0) {}
 		virtual ~RubyHttpConnection_t() {}
 
 		virtual void SendData (const char*, int);
 		virtual void CloseConnection (bool after_writing);
+		virtual void SendShared (const std::shared_ptr<const std::string>&);
+		virtual size_t GetOutboundSize();
+		virtual void PauseSource();
+		virtual void ResumeSource();
 		virtual void ProcessRequest (const char *request_method,
 				const char *cookie,
 				const char *ifnonematch,
@@ -57,10 +114,59 @@ class RubyHttpConnection_t: public HttpConnection_t
 				const char *postdata,
 				const char *hdrblock,
 				int hdrblocksize);
+		virtual int ExpectContinue (const char *request_method,
+				const char *cookie,
+				const char *ifnonematch,
+				const char *contenttype,
+				const char *query_string,
+				const char *path_info,
+				const char *request_uri,
+				const char *protocol,
+				int content_length,
+				const char *hdrblock,
+				int hdrblocksize);
+		virtual void ProcessWebSocketOpen (const char *request_method,
+				const char *cookie,
+				const char *ifnonematch,
+				const char *contenttype,
+				const char *query_string,
+				const char *path_info,
+				const char *request_uri,
+				const char *protocol,
+				const char *hdrblock,
+				int hdrblocksize);
+		virtual void ReceiveWebSocketMessage (const char *data, int len, bool binary);
+		virtual void WebSocketClosed (int code, const char *reason, int len);
 		virtual void ReceivePostData (const char *data, int len);
 
+		void SetRouter (RubyHttpRouter_t *r) {Router = r;}
+		void SetReusePostBuffer() {bReusePostBuffer = true;}
+		long HeadLength (const char*, long);
+
 	private:
 		VALUE Myself;
+		RubyHttpRouter_t *Router;
+		bool bReusePostBuffer;
+
+		// A HEAD request routed to a GET handler is sent only the head of
+		// its response. nHeadEnd counts how much of the blank line ending
+		// the head we've seen, and is 4 once it's all gone out.
+		bool bHeadOnly;
+		int nHeadEnd;
+
+	private:
+		void _SetRequestVariables (const char *request_method,
+				const char *cookie,
+				const char *ifnonematch,
+				const char *contenttype,
+				const char *query_string,
+				const char *path_info,
+				const char *request_uri,
+				const char *protocol,
+				int postlength,
+				const char *postdata,
+				const char *hdrblock,
+				int hdrblocksize);
 };
 
 
@@ -74,6 +180,81 @@ void RubyHttpConnection_t::SendData (const char *data, int length)
 }
 
 
+/********************************
+RubyHttpConnection_t::SendShared
+********************************/
+
+static std::shared_ptr<const std::string> SharedBuffer;
+static VALUE SharedString = Qnil;
+
+void RubyHttpConnection_t::SendShared (const std::shared_ptr<const std::string> &b)
+{
+	// A channel sends the same buffer to each of its subscribers in turn,
+	// so they can all be given the same frozen String. send_data still
+	// copies it into each connection's own outbound buffer.
+	if (b != SharedBuffer) {
+		SharedBuffer = b;
+		SharedString = rb_obj_freeze (rb_str_new (b->data(), b->length()));
+	}
+	rb_funcall (Myself, rb_intern ("send_data"), 1, SharedString);
+}
+
+
+/********************************
+RubyHttpConnection_t::HeadLength
+********************************/
+
+long RubyHttpConnection_t::HeadLength (const char *data, long length)
+{
+	/* How much of data, which user code is sending, should go out. That's
+	 * all of it unless we're answering a HEAD request with a GET handler,
+	 * in which case everything after the end of the head is dropped.
+	 * The blank line that ends it may be split across sends.
+	 */
+	if (!bHeadOnly)
+		return length;
+	for (long i=0; (i < length) && (nHeadEnd < 4); i++) {
+		if (data[i] == "\r\n\r\n" [nHeadEnd])
+			nHeadEnd++;
+		else
+			nHeadEnd = (data[i] == '\r') ? 1 : 0;
+		if (nHeadEnd == 4)
+			return i + 1;
+	}
+	return (nHeadEnd == 4) ? 0 : length;
+}
+
+
+/*************************************
+RubyHttpConnection_t::GetOutboundSize
+*************************************/
+
+size_t RubyHttpConnection_t::GetOutboundSize()
+{
+	return NUM2SIZET (rb_funcall (Myself, rb_intern ("get_outbound_data_size"), 0));
+}
+
+
+/*********************************
+RubyHttpConnection_t::PauseSource
+*********************************/
+
+void RubyHttpConnection_t::PauseSource()
+{
+	rb_funcall (Myself, rb_intern ("pause"), 0);
+}
+
+
+/**********************************
+RubyHttpConnection_t::ResumeSource
+**********************************/
+
+void RubyHttpConnection_t::ResumeSource()
+{
+	rb_funcall (Myself, rb_intern ("resume"), 0);
+}
+
+
 /*************************************
 RubyHttpConnection_t::CloseConnection
 *************************************/
@@ -85,6 +266,77 @@ void RubyHttpConnection_t::CloseConnection (bool after_writing)
 }
 
 
+/************************************
+RubyHttpConnection_t::ExpectContinue
+************************************/
+
+int RubyHttpConnection_t::ExpectContinue (const char *request_method,
+		const char *cookie,
+		const char *ifnonematch,
+		const char *contenttype,
+		const char *query_string,
+		const char *path_info,
+		const char *request_uri,
+		const char *protocol,
+		int content_length,
+		const char *hdr_block,
+		int hdr_block_size)
+{
+	// The request variables are set up as they will be for
+	// process_http_request, except there's no post content yet.
+	_SetRequestVariables (request_method, cookie, ifnonematch, contenttype, query_string, path_info, request_uri, protocol, 0, NULL, hdr_block, hdr_block_size);
+
+	VALUE v = rb_funcall (Myself, rb_intern ("expect_continue"), 1, INT2NUM (content_length));
+	if (v == Qtrue)
+		return 0;
+	if (FIXNUM_P (v))
+		return FIX2INT (v);
+	return 417;
+}
+
+
+/******************************************
+RubyHttpConnection_t::ProcessWebSocketOpen
+******************************************/
+
+void RubyHttpConnection_t::ProcessWebSocketOpen (const char *request_method,
+		const char *cookie,
+		const char *ifnonematch,
+		const char *contenttype,
+		const char *query_string,
+		const char *path_info,
+		const char *request_uri,
+		const char *protocol,
+		const char *hdr_block,
+		int hdr_block_size)
+{
+	_SetRequestVariables (request_method, cookie, ifnonematch, contenttype, query_string, path_info, request_uri, protocol, 0, NULL, hdr_block, hdr_block_size);
+	rb_funcall (Myself, rb_intern ("process_websocket_open"), 0);
+}
+
+
+/*********************************************
+RubyHttpConnection_t::ReceiveWebSocketMessage
+*********************************************/
+
+void RubyHttpConnection_t::ReceiveWebSocketMessage (const char *data, int len, bool binary)
+{
+	// Text messages are UTF-8 by definition, binary ones have no encoding.
+	VALUE msg = binary ? rb_str_new (data, len) : rb_enc_str_new (data, len, rb_utf8_encoding());
+	rb_funcall (Myself, rb_intern ("receive_websocket_message"), 1, msg);
+}
+
+
+/*************************************
+RubyHttpConnection_t::WebSocketClosed
+*************************************/
+
+void RubyHttpConnection_t::WebSocketClosed (int code, const char *reason, int len)
+{
+	rb_funcall (Myself, rb_intern ("process_websocket_close"), 2, INT2NUM (code), rb_enc_str_new (reason, len, rb_utf8_encoding()));
+}
+
+
 /*************************************
 RubyHttpConnection_t::ReceivePostData
 *************************************/
@@ -94,16 +346,31 @@ void RubyHttpConnection_t::ReceivePostData (const char *data, int len)
 	VALUE data_val = Qnil;
 	
 	if ((len > 0) && data) {
-		data_val = rb_str_new(data,len);
+		if (bReusePostBuffer) {
+			// Refill the same String for every slice instead of allocating
+			// one each time. It's kept in a hidden ivar so the GC sees it.
+			data_val = rb_ivar_get (Myself, rb_intern ("http_post_buffer"));
+			if (NIL_P (data_val) || OBJ_FROZEN (data_val)) {
+				data_val = rb_str_buf_new (len);
+				rb_ivar_set (Myself, rb_intern ("http_post_buffer"), data_val);
+			}
+			// A copy made with dup may still share our bytes: unshare
+			// them before we write over them.
+			rb_str_modify (data_val);
+			rb_str_resize (data_val, len);
+			memcpy (RSTRING_PTR (data_val), data, len);
+		}
+		else
+			data_val = rb_str_new(data,len);
 		rb_funcall (Myself, rb_intern ("receive_post_data"), 1, data_val);
 	}
 }
 	
-/************************************
-RubyHttpConnection_t::ProcessRequest
-************************************/
+/*******************************************
+RubyHttpConnection_t::_SetRequestVariables
+*******************************************/
 
-void RubyHttpConnection_t::ProcessRequest (const char *request_method,
+void RubyHttpConnection_t::_SetRequestVariables (const char *request_method,
 		const char *cookie,
 		const char *ifnonematch,
 		const char *contenttype,
@@ -162,6 +429,73 @@ void RubyHttpConnection_t::ProcessRequest (const char *request_method,
 	rb_ivar_set (Myself, rb_intern ("@http_post_content"), post);
 	rb_ivar_set (Myself, rb_intern ("@http_headers"), headers);
 	rb_ivar_set (Myself, rb_intern ("@http_protocol"), protocol_val);
+	rb_ivar_set (Myself, rb_intern ("@http_range"), GetRange().empty() ? Qnil : rb_str_new (GetRange().c_str(), GetRange().length()));
+	rb_ivar_set (Myself, rb_intern ("@http_if_range"), GetIfRange().empty() ? Qnil : rb_str_new (GetIfRange().c_str(), GetIfRange().length()));
+	rb_ivar_set (Myself, rb_intern ("@http_cookies"), Qnil);
+	rb_ivar_set (Myself, rb_intern ("@http_body_results"), GetBodyResults() ? _BodyResultsHash (GetBodyResults()) : Qnil);
+}
+
+
+/************************************
+RubyHttpConnection_t::ProcessRequest
+************************************/
+
+void RubyHttpConnection_t::ProcessRequest (const char *request_method,
+		const char *cookie,
+		const char *ifnonematch,
+		const char *contenttype,
+		const char *query_string,
+		const char *path_info,
+		const char *request_uri,
+		const char *protocol,
+		int post_length,
+		const char *post_content,
+		const char *hdr_block,
+		int hdr_block_size)
+{
+	_SetRequestVariables (request_method, cookie, ifnonematch, contenttype, query_string, path_info, request_uri, protocol, post_length, post_content, hdr_block, hdr_block_size);
+
+	// Resolve the route natively if the connection has a router. We fall
+	// back to process_http_request when nothing matches. A HEAD request
+	// with no route of its own goes to the GET route, and its response
+	// loses its body on the way out.
+	bHeadOnly = false;
+	nHeadEnd = 0;
+	if (Router) {
+		HttpRouter_t::Params_t params;
+		int h = Router->Router.Match (request_method, path_info, params);
+		if ((h < 0) && !strcmp (request_method, "HEAD")) {
+			h = Router->Router.Match ("GET", path_info, params);
+			bHeadOnly = (h >= 0);
+		}
+		if (h >= 0) {
+			VALUE params_val = rb_hash_new();
+			for (size_t i=0; i < params.size(); i++)
+				rb_hash_aset (params_val, rb_str_new (params[i].first.c_str(), params[i].first.length()), rb_str_new (params[i].second.c_str(), params[i].second.length()));
+			rb_ivar_set (Myself, rb_intern ("@http_route_params"), params_val);
+			rb_ivar_set (Myself, rb_intern ("@http_route_status"), Qnil);
+			rb_ivar_set (Myself, rb_intern ("@http_route_allow"), Qnil);
+
+			VALUE handler = rb_ary_entry (Router->Handlers, h);
+			if (SYMBOL_P (handler))
+				rb_funcall (Myself, SYM2ID (handler), 1, params_val);
+			else
+				rb_funcall (handler, rb_intern ("call"), 2, Myself, params_val);
+			return;
+		}
+
+		// Say why nothing matched: no route for the path at all (404), or
+		// none for this method (405, with the methods that would do).
+		vector<string> allowed;
+		Router->Router.AllowedMethods (path_info, allowed);
+		string allow;
+		for (size_t i=0; i < allowed.size(); i++)
+			allow += (i ? ", " : "") + allowed[i];
+		rb_ivar_set (Myself, rb_intern ("@http_route_params"), Qnil);
+		rb_ivar_set (Myself, rb_intern ("@http_route_status"), INT2FIX (allowed.empty() ? 404 : 405));
+		rb_ivar_set (Myself, rb_intern ("@http_route_allow"), allowed.empty() ? Qnil : rb_str_new (allow.c_str(), allow.length()));
+	}
+
 	rb_funcall (Myself, rb_intern ("process_http_request"), 0);
 }
 
@@ -171,6 +505,9 @@ Statics
 *******/
 
 VALUE Intern_http_conn;
+VALUE Intern_http_router;
+VALUE Intern_http_unbind_callbacks;
+VALUE HttpRouterClass;
 
 /********************
 t_get_http_connection
@@ -187,6 +524,59 @@ static RubyHttpConnection_t *t_get_http_connection(VALUE self)
         return hc;
 }
 
+/********************
+_ReleaseCacheWaiters
+********************/
+
+static VALUE _ReleaseNext (VALUE cache)
+{
+	((ResponseCache_t*) cache)->ReleaseNext();
+	return Qnil;
+}
+
+static void _ReleaseCacheWaiters (ResponseCache_t *cache)
+{
+	/* The cache's Releaser. Waiters are handed back from inside whatever
+	 * ended the refresh, usually the leader's own handler. If one raises
+	 * we carry on with the rest and raise the first error at the end, so
+	 * none is left waiting.
+	 */
+	int first = 0;
+	while (cache->HasPending()) {
+		int state = 0;
+		rb_protect (_ReleaseNext, (VALUE) cache, &state);
+		if (state && !first)
+			first = state;
+	}
+	if (first)
+		rb_jump_tag (first);
+}
+
+static void _ReleaseCacheWaitersJob (void *unused)
+{
+	/* A postponed job: requests that were waiting on a refresh led by a
+	 * connection the GC has freed go on from here, where user code can
+	 * run.
+	 */
+	if (ResponseCache_t::Current)
+		_ReleaseCacheWaiters (ResponseCache_t::Current);
+}
+
+#ifdef WITH_POSTPONED_JOB_HANDLE
+static rb_postponed_job_handle_t ReleaseCacheWaitersJob = POSTPONED_JOB_HANDLE_INVALID;
+#endif
+
+static void _ScheduleCacheRelease()
+{
+	#ifdef WITH_POSTPONED_JOB_HANDLE
+	if (ReleaseCacheWaitersJob != POSTPONED_JOB_HANDLE_INVALID)
+		rb_postponed_job_trigger (ReleaseCacheWaitersJob);
+	#else
+	rb_postponed_job_register_one (0, _ReleaseCacheWaitersJob, NULL);
+	#endif
+}
+
+
 /********************
 t_delete_http_connection
 ********************/
@@ -194,6 +584,9 @@ t_delete_http_connection
 void t_delete_http_connection(RubyHttpConnection_t *hc)
 {
         delete hc;
+        // The connection may have been leading a cache refresh.
+        if (ResponseCache_t::Current && ResponseCache_t::Current->HasPending())
+                _ScheduleCacheRelease();
 }
 
 /***********
@@ -216,6 +609,29 @@ static VALUE t_post_init (VALUE self)
 }
 
 
+/**********************
+t_free_http_connection
+**********************/
+
+static VALUE t_free_http_connection (VALUE self)
+{
+	/* Private. Free the native connection now, as the GC does when a
+	 * connection is collected without an unbind, but without scheduling
+	 * the release of its cache waiters. The tests use this to follow
+	 * that path without depending on the GC.
+	 */
+	VALUE ivar = rb_ivar_get (self, Intern_http_conn);
+	if (ivar != Qnil) {
+		RubyHttpConnection_t *hc;
+		Data_Get_Struct (ivar, RubyHttpConnection_t, hc);
+		DATA_PTR (ivar) = NULL;
+		rb_ivar_set (self, Intern_http_conn, Qnil);
+		delete hc;
+	}
+	return Qnil;
+}
+
+
 /**************
 t_receive_data
 **************/
@@ -245,10 +661,99 @@ t_unbind
 
 static VALUE t_unbind (VALUE self)
 {
+	// If you override unbind, call super so the last request on a
+	// kept-alive connection makes it into the access log.
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc) {
+		hc->RequestFinished();
+		hc->LeaveCache();
+		hc->CancelBodyJob();
+		EventChannel_t::ForgetConnection (hc);
+	}
+
+	VALUE callbacks = rb_ivar_get (self, Intern_http_unbind_callbacks);
+	if (!NIL_P (callbacks)) {
+		rb_ivar_set (self, Intern_http_unbind_callbacks, Qnil);
+		for (long i=0; i < RARRAY_LEN (callbacks); i++)
+			rb_funcall (rb_ary_entry (callbacks, i), rb_intern ("call"), 0);
+	}
+	return Qnil;
+}
+
+
+/*********************
+t_add_unbind_callback
+*********************/
+
+static VALUE t_add_unbind_callback (VALUE self)
+{
+	/* Call the block when the connection unbinds, and return it. Responses
+	 * use this to stop sending. It only works if you call super when you
+	 * override unbind.
+	 */
+	VALUE block = rb_block_proc();
+	VALUE callbacks = rb_ivar_get (self, Intern_http_unbind_callbacks);
+	if (NIL_P (callbacks)) {
+		callbacks = rb_ary_new();
+		rb_ivar_set (self, Intern_http_unbind_callbacks, callbacks);
+	}
+	rb_ary_push (callbacks, block);
+	return block;
+}
+
+
+/************************
+t_remove_unbind_callback
+************************/
+
+static VALUE t_remove_unbind_callback (VALUE self, VALUE block)
+{
+	VALUE callbacks = rb_ivar_get (self, Intern_http_unbind_callbacks);
+	if (!NIL_P (callbacks))
+		rb_ary_delete (callbacks, block);
 	return Qnil;
 }
 
 
+/***********
+t_send_data
+***********/
+
+static VALUE t_send_data (VALUE self, VALUE data)
+{
+	// Count what we send for the access log, then pass it on to
+	// EventMachine::Connection#send_data. The body of a response to a
+	// HEAD request that went to a GET route isn't sent at all.
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc && (TYPE (data) == T_STRING)) {
+		long n = hc->HeadLength (RSTRING_PTR (data), RSTRING_LEN (data));
+		if (n == 0)
+			return INT2FIX (0);
+		if (n < RSTRING_LEN (data))
+			data = rb_str_substr (data, 0, n);
+		hc->CountBytesSent (RSTRING_PTR (data), RSTRING_LEN (data));
+	}
+	return rb_call_super (1, &data);
+}
+
+
+/******************
+t_close_connection
+******************/
+
+static VALUE t_close_connection (int argc, VALUE *argv, VALUE self)
+{
+	// Covers close_connection_after_writing too, they both end the
+	// request we're responding to.
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc) {
+		hc->CaptureClose();
+		hc->RequestFinished();
+	}
+	return rb_call_super (argc, argv);
+}
+
+
 /**********************
 t_process_http_request
 **********************/
@@ -260,46 +765,1359 @@ static VALUE t_process_http_request (VALUE self)
 	return Qnil;
 }
 
+/*****************
+t_expect_continue
+*****************/
+
+static VALUE t_expect_continue (VALUE self, VALUE content_length)
+{
+	/* Called when the client sends Expect: 100-continue. Override it to
+	 * look at the request head (the usual @http_ variables are set) and
+	 * return true to accept the body, or a status code such as 401 or 413
+	 * to refuse it. False or nil refuse the request with a 417.
+	 */
+	return Qtrue;
+}
+
+
 /************************
-t_no_environment_strings
+t_process_websocket_open
 ************************/
 
-static VALUE t_no_environment_strings (VALUE self)
+static VALUE t_process_websocket_open (VALUE self)
 {
-	RubyHttpConnection_t *hc = t_get_http_connection (self);
-	if (hc)
-		hc->SetNoEnvironmentStrings();
+	/** This is a NOOP.  It should be overridden.  **/
 	return Qnil;
 }
 
-/**********************
-t_dont_accumulate_post
-**********************/
 
-static VALUE t_dont_accumulate_post (VALUE self)
+/***************************
+t_receive_websocket_message
+***************************/
+
+static VALUE t_receive_websocket_message (VALUE self, VALUE msg)
+{
+	/** This is a NOOP.  It should be overridden.  **/
+	return Qnil;
+}
+
+
+/*************************
+t_process_websocket_close
+*************************/
+
+static VALUE t_process_websocket_close (VALUE self, VALUE code, VALUE reason)
+{
+	/** This is a NOOP.  It should be overridden.  **/
+	return Qnil;
+}
+
+
+/*******************
+t_accept_websockets
+*******************/
+
+static VALUE t_accept_websockets (VALUE self)
 {
 	RubyHttpConnection_t *hc = t_get_http_connection (self);
 	if (hc)
-		hc->SetDontAccumulatePost();
+		hc->SetAcceptWebSockets();
 	return Qnil;
 }
 
 
-/****************************
-Init_eventmachine_httpserver
-****************************/
+/*************
+t_websocket_p
+*************/
 
-extern "C" void Init_eventmachine_httpserver()
+static VALUE t_websocket_p (VALUE self)
 {
-	Intern_http_conn = rb_intern ("http_conn");
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	return (hc && hc->IsWebSocket()) ? Qtrue : Qfalse;
+}
 
-	VALUE EmModule = rb_define_module ("EventMachine");
-	VALUE HttpServer = rb_define_module_under (EmModule, "HttpServer");
-	rb_define_method (HttpServer, "post_init", (VALUE(*)(...))t_post_init, 0);
-	rb_define_method (HttpServer, "receive_data", (VALUE(*)(...))t_receive_data, 1);
-	rb_define_method (HttpServer, "receive_post_data", (VALUE(*)(...))t_receive_post_data, 1);
-	rb_define_method (HttpServer, "unbind", (VALUE(*)(...))t_unbind, 0);
+
+/************************
+t_send_websocket_message
+************************/
+
+static VALUE t_send_websocket_message (int argc, VALUE *argv, VALUE self)
+{
+	VALUE data, binary;
+	rb_scan_args (argc, argv, "11", &data, &binary);
+	StringValue (data);
+
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (!hc || !hc->IsWebSocket())
+		rb_raise (rb_eRuntimeError, "not a websocket connection");
+	hc->SendWebSocketMessage (RSTRING_PTR (data), RSTRING_LEN (data), RTEST (binary));
+	return Qnil;
+}
+
+
+/*****************
+t_close_websocket
+*****************/
+
+static VALUE t_close_websocket (int argc, VALUE *argv, VALUE self)
+{
+	VALUE code, reason;
+	rb_scan_args (argc, argv, "02", &code, &reason);
+	if (!NIL_P (reason))
+		StringValue (reason);
+
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (!hc || !hc->IsWebSocket())
+		rb_raise (rb_eRuntimeError, "not a websocket connection");
+	hc->CloseWebSocket (NIL_P (code) ? 1000 : NUM2INT (code), NIL_P (reason) ? NULL : RSTRING_PTR (reason), NIL_P (reason) ? 0 : RSTRING_LEN (reason));
+	return Qnil;
+}
+
+
+/************************
+t_no_environment_strings
+************************/
+
+static VALUE t_no_environment_strings (VALUE self)
+{
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc)
+		hc->SetNoEnvironmentStrings();
+	return Qnil;
+}
+
+/**********************
+t_dont_accumulate_post
+**********************/
+
+static VALUE t_dont_accumulate_post (VALUE self)
+{
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc)
+		hc->SetDontAccumulatePost();
+	return Qnil;
+}
+
+
+/************************
+t_reuse_post_data_buffer
+************************/
+
+static VALUE t_reuse_post_data_buffer (VALUE self)
+{
+	/* With dont_accumulate_post, pass the same String to receive_post_data
+	 * for every slice of the body. User code must copy (or finish with) the
+	 * data before returning, since the next slice overwrites it.
+	 */
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc)
+		hc->SetReusePostBuffer();
+	return Qnil;
+}
+
+
+/*****************
+t_pause_post_data
+*****************/
+
+static VALUE t_pause_post_data (VALUE self)
+{
+	/* Stop delivering post data (and parsing further requests), and stop
+	 * reading from the socket until resume_post_data. Safe to call from
+	 * inside receive_post_data. Whatever remains of the current read is
+	 * held until we resume.
+	 */
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc)
+		hc->PauseConsuming();
+	return Qnil;
+}
+
+
+/******************
+t_resume_post_data
+******************/
+
+static VALUE t_resume_post_data (VALUE self)
+{
+	// Delivering the held-back data may pause us again, in which
+	// case the socket stays paused too.
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc)
+		hc->ResumeConsuming();
+	return Qnil;
+}
+
+
+/*******************
+t_post_data_paused
+*******************/
+
+static VALUE t_post_data_paused (VALUE self)
+{
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	return (hc && hc->IsPaused()) ? Qtrue : Qfalse;
+}
+
+
+/********************
+t_post_data_progress
+********************/
+
+static VALUE t_post_data_progress (VALUE self)
+{
+	// [bytes of the body received so far, declared content length]
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (!hc)
+		return Qnil;
+	return rb_ary_new3 (2, INT2NUM (hc->GetContentPos()), INT2NUM (hc->GetContentLength()));
+}
+
+
+/********************
+t_max_content_length
+********************/
+
+static VALUE t_max_content_length (VALUE self, VALUE length)
+{
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc)
+		hc->SetMaxContentLength (NUM2INT (length));
+	return Qnil;
+}
+
+
+/************************
+t_inflate_request_bodies
+************************/
+
+static VALUE t_inflate_request_bodies (int argc, VALUE *argv, VALUE self)
+{
+	/* inflate_request_bodies (max_inflated_length = 20MB)
+	 * Inflate request bodies sent with Content-Encoding gzip or deflate as
+	 * they arrive, so user code gets them plain: accumulated in
+	 * @http_post_content, or a slice at a time in receive_post_data. A body
+	 * that inflates past the limit gets a 413, and a corrupt one a 400.
+	 */
+	VALUE max;
+	rb_scan_args (argc, argv, "01", &max);
+	#ifdef WITH_ZLIB
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc)
+		hc->SetInflateBodies (NIL_P (max) ? 20 * 1024 * 1024 : NUM2INT (max));
+	return Qnil;
+	#else
+	rb_raise (rb_eNotImpError, "built without zlib");
+	#endif
+}
+
+
+/*******************
+t_parse_byte_ranges
+*******************/
+
+static VALUE t_parse_byte_ranges (VALUE self, VALUE spec, VALUE length)
+{
+	/* EventMachine::HttpServer.parse_byte_ranges (range_header, length).
+	 * Returns nil if the header should be ignored, an empty array if no
+	 * range is satisfiable, or an array of [first, last] byte positions.
+	 */
+	if (NIL_P (spec))
+		return Qnil;
+
+	vector< pair<long long, long long> > ranges;
+	if (!HttpConnection_t::ParseByteRanges (StringValueCStr (spec), NUM2LL (length), ranges))
+		return Qnil;
+
+	VALUE ary = rb_ary_new2 (ranges.size());
+	for (size_t i=0; i < ranges.size(); i++)
+		rb_ary_push (ary, rb_ary_new3 (2, LL2NUM (ranges[i].first), LL2NUM (ranges[i].second)));
+	return ary;
+}
+
+
+/***********
+_CookieHash
+***********/
+
+static VALUE _CookieHash (const char *header)
+{
+	// Where a name appears more than once, the first value wins.
+	vector< pair<string, string> > cookies;
+	HttpConnection_t::ParseCookies (header, cookies);
+
+	VALUE h = rb_hash_new();
+	for (size_t i=0; i < cookies.size(); i++) {
+		VALUE name = rb_str_new (cookies[i].first.data(), cookies[i].first.length());
+		if (NIL_P (rb_hash_lookup (h, name)))
+			rb_hash_aset (h, name, rb_str_new (cookies[i].second.data(), cookies[i].second.length()));
+	}
+	return h;
+}
+
+
+/***************
+t_parse_cookies
+***************/
+
+static VALUE t_parse_cookies (VALUE self, VALUE header)
+{
+	// EventMachine::HttpServer.parse_cookies (cookie_header) => Hash
+	if (NIL_P (header))
+		return rb_hash_new();
+	return _CookieHash (StringValueCStr (header));
+}
+
+
+/*********
+t_cookies
+*********/
+
+static VALUE t_cookies (VALUE self)
+{
+	/* The request's cookies as a Hash, built on first use and kept
+	 * until the next request.
+	 */
+	VALUE h = rb_ivar_get (self, rb_intern ("@http_cookies"));
+	if (NIL_P (h)) {
+		VALUE raw = rb_ivar_get (self, rb_intern ("@http_cookie"));
+		h = _CookieHash (NIL_P (raw) ? "" : StringValueCStr (raw));
+		rb_ivar_set (self, rb_intern ("@http_cookies"), h);
+	}
+	return h;
+}
+
+
+/********
+t_cookie
+********/
+
+static VALUE t_cookie (VALUE self, VALUE name)
+{
+	/* The value of a single cookie, or nil. If the Hash hasn't been
+	 * built, this scans the header without building it.
+	 */
+	VALUE h = rb_ivar_get (self, rb_intern ("@http_cookies"));
+	if (!NIL_P (h))
+		return rb_hash_lookup (h, name);
+
+	VALUE raw = rb_ivar_get (self, rb_intern ("@http_cookie"));
+	if (NIL_P (raw))
+		return Qnil;
+
+	string value;
+	if (!HttpConnection_t::FindCookie (StringValueCStr (raw), StringValueCStr (name), value))
+		return Qnil;
+	return rb_str_new (value.data(), value.length());
+}
+
+
+/************
+_CheckHeader
+************/
+
+static void _CheckHeader (VALUE s)
+{
+	// A CR or LF in a trailer would let the caller forge the rest of the stream.
+	const char *p = RSTRING_PTR (s);
+	for (long i=0; i < RSTRING_LEN (s); i++) {
+		if ((p[i] == '\r') || (p[i] == '\n') || (p[i] == 0))
+			rb_raise (rb_eArgError, "bad character in trailer");
+	}
+}
+
+
+/***************
+t_encode_chunks
+***************/
+
+static VALUE t_encode_chunks (int argc, VALUE *argv, VALUE self)
+{
+	/* EventMachine::HttpServer.encode_chunks (strings, trailers = nil)
+	 * Encode a run of chunks (RFC 7230 4.1) into a single String, so
+	 * they can go out in one write. Sizes are in bytes. An empty string
+	 * is the last chunk: it must come last, and is followed by the
+	 * trailers (a Hash of field names to values) if any.
+	 */
+	VALUE chunks, trailers;
+	rb_scan_args (argc, argv, "11", &chunks, &trailers);
+	Check_Type (chunks, T_ARRAY);
+
+	long n = RARRAY_LEN (chunks);
+	long size = 0;
+	for (long i=0; i < n; i++) {
+		VALUE c = rb_ary_entry (chunks, i);
+		StringValue (c);
+		if ((RSTRING_LEN (c) == 0) && (i < n - 1))
+			rb_raise (rb_eArgError, "last chunk already sent");
+		size += RSTRING_LEN (c) + 20;
+	}
+
+	VALUE out = rb_str_buf_new (size + 2);
+	char hex [20];
+	for (long i=0; i < n; i++) {
+		VALUE c = rb_ary_entry (chunks, i);
+		long len = RSTRING_LEN (c);
+		int m = snprintf (hex, sizeof(hex), "%lX\r\n", len);
+		rb_str_buf_cat (out, hex, m);
+		if (len == 0)
+			break;
+		rb_str_buf_cat (out, RSTRING_PTR (c), len);
+		rb_str_buf_cat (out, "\r\n", 2);
+	}
+
+	if ((n > 0) && (RSTRING_LEN (rb_ary_entry (chunks, n - 1)) == 0)) {
+		if (!NIL_P (trailers)) {
+			VALUE keys = rb_funcall (rb_Hash (trailers), rb_intern ("to_a"), 0);
+			for (long i=0; i < RARRAY_LEN (keys); i++) {
+				VALUE kv = rb_ary_entry (keys, i);
+				VALUE k = rb_obj_as_string (rb_ary_entry (kv, 0));
+				VALUE v = rb_obj_as_string (rb_ary_entry (kv, 1));
+				_CheckHeader (k);
+				_CheckHeader (v);
+				rb_str_buf_cat (out, RSTRING_PTR (k), RSTRING_LEN (k));
+				rb_str_buf_cat (out, ": ", 2);
+				rb_str_buf_cat (out, RSTRING_PTR (v), RSTRING_LEN (v));
+				rb_str_buf_cat (out, "\r\n", 2);
+			}
+		}
+		rb_str_buf_cat (out, "\r\n", 2);
+	}
+	return out;
+}
+
+
+/************
+t_use_router
+************/
+
+static VALUE t_use_router (VALUE self, VALUE router)
+{
+	RubyHttpRouter_t *r = NULL;
+	if (router != Qnil) {
+		if (!rb_obj_is_kind_of (router, HttpRouterClass))
+			rb_raise (rb_eTypeError, "expected an EventMachine::HttpRouter");
+		Data_Get_Struct (router, RubyHttpRouter_t, r);
+	}
+
+	// The native connection is made in post_init, so there's nothing to
+	// attach the router to until HttpServer's post_init has run.
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (!hc)
+		rb_raise (rb_eRuntimeError, "use_router called before super in post_init");
+
+	// Keep a reference so the router outlives the connection's use of it.
+	rb_ivar_set (self, Intern_http_router, router);
+	hc->SetRouter (r);
+	return Qnil;
+}
+
+
+/**********************
+t_router_mark/t_router_free
+**********************/
+
+static void t_router_mark (RubyHttpRouter_t *r)
+{
+	rb_gc_mark (r->Handlers);
+}
+
+static void t_router_free (RubyHttpRouter_t *r)
+{
+	delete r;
+}
+
+
+/**************
+t_router_alloc
+**************/
+
+static VALUE t_router_alloc (VALUE klass)
+{
+	RubyHttpRouter_t *r = new RubyHttpRouter_t;
+	r->Handlers = rb_ary_new();
+	return Data_Wrap_Struct (klass, t_router_mark, t_router_free, r);
+}
+
+
+/************
+t_router_add
+************/
+
+static VALUE t_router_add (int argc, VALUE *argv, VALUE self)
+{
+	VALUE method, pattern, handler;
+	rb_scan_args (argc, argv, "21", &method, &pattern, &handler);
+	if (NIL_P (handler) && rb_block_given_p())
+		handler = rb_block_proc();
+	if (NIL_P (handler))
+		rb_raise (rb_eArgError, "no handler given for route");
+
+	RubyHttpRouter_t *r;
+	Data_Get_Struct (self, RubyHttpRouter_t, r);
+
+	method = rb_funcall (rb_obj_as_string (method), rb_intern ("upcase"), 0);
+	pattern = rb_obj_as_string (pattern);
+
+	// Don't rb_raise from inside the catch block, it would longjmp past
+	// the exception's destructor.
+	string err;
+	try {
+		r->Router.Add (StringValueCStr (method), StringValueCStr (pattern), RARRAY_LEN (r->Handlers));
+	}
+	catch (std::runtime_error &e) {
+		err = e.what();
+	}
+	if (!err.empty())
+		rb_raise (rb_eArgError, "%s", err.c_str());
+
+	rb_ary_push (r->Handlers, handler);
+	return self;
+}
+
+
+/**************
+t_router_match
+**************/
+
+static VALUE t_router_match (VALUE self, VALUE method, VALUE path)
+{
+	RubyHttpRouter_t *r;
+	Data_Get_Struct (self, RubyHttpRouter_t, r);
+
+	HttpRouter_t::Params_t params;
+	int h = r->Router.Match (StringValueCStr (method), StringValueCStr (path), params);
+	if (h < 0)
+		return Qnil;
+
+	VALUE params_val = rb_hash_new();
+	for (size_t i=0; i < params.size(); i++)
+		rb_hash_aset (params_val, rb_str_new (params[i].first.c_str(), params[i].first.length()), rb_str_new (params[i].second.c_str(), params[i].second.length()));
+	return rb_ary_new3 (2, rb_ary_entry (r->Handlers, h), params_val);
+}
+
+
+/*************
+t_router_size
+*************/
+
+static VALUE t_router_size (VALUE self)
+{
+	RubyHttpRouter_t *r;
+	Data_Get_Struct (self, RubyHttpRouter_t, r);
+	return INT2NUM (r->Router.Size());
+}
+
+
+/**************
+t_encode_event
+**************/
+
+static VALUE t_encode_event (int argc, VALUE *argv, VALUE self)
+{
+	/* EventMachine::HttpServer.encode_event (data, event = nil, id = nil)
+	 * Frame data as a Server-Sent Event, with a data field for each of its
+	 * lines. Raises ArgumentError if the event name or id has a line break.
+	 */
+	VALUE data, event, id;
+	rb_scan_args (argc, argv, "12", &data, &event, &id);
+	data = rb_obj_as_string (data);
+
+	string out;
+	if (!EventChannel_t::FrameEvent (out, RSTRING_PTR (data), RSTRING_LEN (data), NIL_P (event) ? NULL : StringValueCStr (event), NIL_P (id) ? NULL : StringValueCStr (id)))
+		rb_raise (rb_eArgError, "line break in event name or id");
+	return rb_str_new (out.data(), out.length());
+}
+
+
+/********************
+t_channel_free/alloc
+********************/
+
+static void t_channel_free (EventChannel_t *c)
+{
+	delete c;
+}
+
+static VALUE t_channel_alloc (VALUE klass)
+{
+	EventChannel_t *c = new EventChannel_t (EventChannel_t::DefaultMaxQueuedBytes, EventChannel_t::DefaultHighWater);
+	return Data_Wrap_Struct (klass, 0, t_channel_free, c);
+}
+
+static EventChannel_t *_GetChannel (VALUE self)
+{
+	EventChannel_t *c;
+	Data_Get_Struct (self, EventChannel_t, c);
+	return c;
+}
+
+static RubyHttpConnection_t *_GetSubscriber (VALUE conn)
+{
+	RubyHttpConnection_t *hc = t_get_http_connection (conn);
+	if (!hc)
+		rb_raise (rb_eArgError, "not an HttpServer connection");
+	return hc;
+}
+
+
+/********************
+t_channel_initialize
+********************/
+
+static VALUE t_channel_initialize (int argc, VALUE *argv, VALUE self)
+{
+	/* EventMachine::HttpEventChannel.new (max_queued_bytes = 1MB, high_water = 64KB)
+	 * A subscriber is sent events while it has less than high_water bytes
+	 * waiting to go out, and dropped if more than max_queued_bytes of
+	 * events back up behind that.
+	 */
+	VALUE max, high;
+	rb_scan_args (argc, argv, "02", &max, &high);
+	_GetChannel (self)->SetLimits (NIL_P (max) ? (size_t)EventChannel_t::DefaultMaxQueuedBytes : NUM2SIZET (max), NIL_P (high) ? (size_t)EventChannel_t::DefaultHighWater : NUM2SIZET (high));
+	return self;
+}
+
+
+/*******************
+t_channel_subscribe
+*******************/
+
+static VALUE t_channel_subscribe (VALUE self, VALUE conn)
+{
+	_GetChannel (self)->Subscribe (_GetSubscriber (conn));
+	return self;
+}
+
+
+/*********************
+t_channel_unsubscribe
+*********************/
+
+static VALUE t_channel_unsubscribe (VALUE self, VALUE conn)
+{
+	return _GetChannel (self)->Unsubscribe (_GetSubscriber (conn)) ? Qtrue : Qfalse;
+}
+
+
+/*****************
+t_channel_publish
+*****************/
+
+static VALUE t_channel_publish (int argc, VALUE *argv, VALUE self)
+{
+	/* publish (data, event = nil, id = nil)
+	 * Frame the event once and send it to every subscriber. Returns the
+	 * number of subscribers it was queued for.
+	 */
+	VALUE framed = t_encode_event (argc, argv, self);
+	string s (RSTRING_PTR (framed), RSTRING_LEN (framed));
+	return SIZET2NUM (_GetChannel (self)->Publish (s));
+}
+
+
+/*******************
+t_channel_keepalive
+*******************/
+
+static VALUE t_channel_keepalive (VALUE self)
+{
+	// A comment line, which keeps idle streams (and proxies) from timing out.
+	return SIZET2NUM (_GetChannel (self)->Publish (":\n\n"));
+}
+
+
+/**************
+t_channel_pump
+**************/
+
+static VALUE t_channel_pump (VALUE self)
+{
+	/* Send what each subscriber can now take of its backlog. Nothing
+	 * else does that between publishes, so subscribe (in Ruby) runs this
+	 * from a periodic timer while the channel has subscribers.
+	 */
+	_GetChannel (self)->Pump();
+	return Qnil;
+}
+
+
+/**************
+t_channel_size
+**************/
+
+static VALUE t_channel_size (VALUE self)
+{
+	return SIZET2NUM (_GetChannel (self)->GetSubscribers());
+}
+
+
+/***************
+t_channel_stats
+***************/
+
+static VALUE t_channel_stats (VALUE self)
+{
+	EventChannel_t *c = _GetChannel (self);
+	VALUE h = rb_hash_new();
+	rb_hash_aset (h, ID2SYM (rb_intern ("subscribers")), SIZET2NUM (c->GetSubscribers()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("published")), ULL2NUM (c->GetPublished()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("dropped")), ULL2NUM (c->GetDropped()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("queued_bytes")), SIZET2NUM (c->GetQueuedBytes()));
+	return h;
+}
+
+
+/****************
+t_cache_response
+****************/
+
+static VALUE t_cache_response (int argc, VALUE *argv, VALUE self)
+{
+	/* cache_response (ttl, vary = nil) { send the response }
+	 * Everything the block sends is stored in the response cache, if one
+	 * is enabled, and used to answer requests for the same method and
+	 * target (and the same values of the request headers named in vary)
+	 * for the next ttl seconds. Nothing is stored if the block raises.
+	 * Returns whatever the block returns.
+	 */
+	VALUE ttl, vary;
+	rb_scan_args (argc, argv, "11", &ttl, &vary);
+
+	vector<string> names;
+	if (!NIL_P (vary)) {
+		VALUE ary = rb_Array (vary);
+		for (long i=0; i < RARRAY_LEN (ary); i++) {
+			VALUE name = rb_obj_as_string (rb_ary_entry (ary, i));
+			names.push_back (string (RSTRING_PTR (name), RSTRING_LEN (name)));
+		}
+	}
+	double seconds = NUM2DBL (ttl);
+
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (!hc)
+		return rb_yield (Qnil);
+
+	hc->BeginCapture();
+	int state = 0;
+	VALUE result = rb_protect (rb_yield, Qnil, &state);
+	hc->EndCapture (names, seconds, state == 0);
+	if (state)
+		rb_jump_tag (state);
+	return result;
+}
+
+
+/*************
+t_body_stages
+*************/
+
+static VALUE _StageList (VALUE stages, vector<string> &list)
+{
+	// Check the stage names before anything is queued.
+	stages = rb_Array (stages);
+	for (long i=0; i < RARRAY_LEN (stages); i++) {
+		VALUE stage = rb_obj_as_string (rb_ary_entry (stages, i));
+		string name (RSTRING_PTR (stage), RSTRING_LEN (stage));
+		if (!WorkerPool_t::CheckStage (name))
+			rb_raise (rb_eArgError, "unknown body stage: %s", name.c_str());
+		list.push_back (name);
+	}
+	return Qnil;
+}
+
+static VALUE t_body_stages (int argc, VALUE *argv, VALUE self)
+{
+	/* body_stages (*stages)
+	 * Run these stages over each request body on the body workers (see
+	 * start_body_workers) before the request reaches user code, and put
+	 * what they find in @http_body_results. With no workers running,
+	 * requests go straight through as usual.
+	 */
+	vector<string> list;
+	_StageList (rb_ary_new4 (argc, argv), list);
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (hc)
+		hc->SetBodyStages (list);
+	return Qnil;
+}
+
+
+/********************
+t_start_body_workers
+********************/
+
+static VALUE BodyCallbacks = Qnil;
+
+static VALUE t_start_body_workers (VALUE self, VALUE nthreads)
+{
+	/* EventMachine::HttpServer.start_body_workers (nthreads)
+	 * Start the threads that run body stages. Returns a descriptor which
+	 * becomes readable when jobs finish: watch it, and call
+	 * run_body_completions when it fires. (body_workers does both.)
+	 */
+	int n = NUM2INT (nthreads);
+	if (n < 1)
+		rb_raise (rb_eArgError, "need at least one body worker");
+	if (WorkerPool_t::Current)
+		rb_raise (rb_eRuntimeError, "body workers are already running");
+	WorkerPool_t::Current = new WorkerPool_t (n);
+	return INT2NUM (WorkerPool_t::Current->GetNotifyFd());
+}
+
+
+/**********************
+t_run_body_completions
+**********************/
+
+static VALUE _RunBodyCallback (VALUE args)
+{
+	VALUE proc = rb_ary_entry (args, 0);
+	return rb_funcall (proc, rb_intern ("call"), 2, rb_ary_entry (args, 1), rb_ary_entry (args, 2));
+}
+
+struct BodyProcessed_t {
+	HttpConnection_t *Owner;
+	BodyJob_t *Job;
+};
+
+static VALUE _RunBodyProcessed (VALUE args)
+{
+	BodyProcessed_t *p = (BodyProcessed_t*) args;
+	p->Owner->BodyProcessed (p->Job);
+	return Qnil;
+}
+
+static VALUE _RunBodyCompletions (WorkerPool_t *pool)
+{
+	/* Hand each finished job to its connection or its callback. If user
+	 * code raises, we carry on with the rest and raise the first error at
+	 * the end, so no job is left behind.
+	 */
+	int first = 0;
+	while (BodyJob_t *job = pool->Completed()) {
+		HttpConnection_t *owner = pool->TakeOwner (job->Id);
+		if (owner) {
+			BodyProcessed_t p = {owner, job};
+			int state = 0;
+			rb_protect (_RunBodyProcessed, (VALUE) &p, &state);
+			if (state && !first)
+				first = state;
+			continue;
+		}
+		VALUE proc = rb_hash_delete (BodyCallbacks, ULONG2NUM (job->Id));
+		if (!NIL_P (proc)) {
+			VALUE body = job->Body ? rb_str_new (job->Body, job->Length) : rb_str_new ("", 0);
+			VALUE args = rb_ary_new3 (3, proc, body, _BodyResultsHash (job));
+			delete job;
+			int state = 0;
+			rb_protect (_RunBodyCallback, args, &state);
+			if (state && !first)
+				first = state;
+		}
+		else
+			delete job;
+	}
+	if (first)
+		rb_jump_tag (first);
+	return Qnil;
+}
+
+static VALUE _RunBodyCompletionsProtected (VALUE pool)
+{
+	return _RunBodyCompletions ((WorkerPool_t*) pool);
+}
+
+static VALUE t_run_body_completions (VALUE self)
+{
+	if (WorkerPool_t::Current)
+		_RunBodyCompletions (WorkerPool_t::Current);
+	return Qnil;
+}
+
+
+/*******************
+t_stop_body_workers
+*******************/
+
+static VALUE t_stop_body_workers (VALUE self)
+{
+	/* Finish the queued jobs, deliver them, and stop the threads. Nothing
+	 * new goes to the workers once they're stopping, so requests that
+	 * arrive in the meantime go straight through.
+	 */
+	WorkerPool_t *pool = WorkerPool_t::Current;
+	if (!pool)
+		return Qnil;
+	pool->Stop();
+	WorkerPool_t::Current = NULL;
+	int state = 0;
+	rb_protect (_RunBodyCompletionsProtected, (VALUE) pool, &state);
+	delete pool;
+	if (state)
+		rb_jump_tag (state);
+	return Qnil;
+}
+
+
+/**************
+t_process_body
+**************/
+
+static VALUE t_process_body (int argc, VALUE *argv, VALUE self)
+{
+	/* EventMachine::HttpServer.process_body (data, stages, content_type = nil) {|body, results| }
+	 * Run the stages over data on the body workers, and call the block
+	 * from run_body_completions with the (possibly decoded) body and the
+	 * results. For bodies that didn't arrive with a request.
+	 */
+	VALUE data, stages, content_type, block;
+	rb_scan_args (argc, argv, "21&", &data, &stages, &content_type, &block);
+	if (NIL_P (block))
+		rb_raise (rb_eArgError, "no block given");
+	if (!WorkerPool_t::Current || WorkerPool_t::Current->IsStopped())
+		rb_raise (rb_eRuntimeError, "body workers are not running");
+
+	vector<string> list;
+	_StageList (stages, list);
+	StringValue (data);
+
+	BodyJob_t *job = new BodyJob_t;
+	job->Stages = list;
+	if (!NIL_P (content_type))
+		job->ContentType = StringValueCStr (content_type);
+	job->Length = RSTRING_LEN (data);
+	job->Body = (char*) malloc (job->Length + 1);
+	if (!job->Body) {
+		delete job;
+		rb_raise (rb_eNoMemError, "no memory for body");
+	}
+	memcpy (job->Body, RSTRING_PTR (data), job->Length);
+	job->Body [job->Length] = 0;
+
+	unsigned long id = WorkerPool_t::Current->Submit (job, NULL);
+	rb_hash_aset (BodyCallbacks, ULONG2NUM (id), block);
+	return Qnil;
+}
+
+
+/***********************
+t_enable_response_cache
+***********************/
+
+static VALUE t_enable_response_cache (int argc, VALUE *argv, VALUE self)
+{
+	/* EventMachine::HttpServer.enable_response_cache (max_bytes = 64MB, max_responses = 10000)
+	 * Start answering requests from responses stored with cache_response.
+	 * Any existing cache is discarded.
+	 */
+	VALUE max_bytes, max_responses;
+	rb_scan_args (argc, argv, "02", &max_bytes, &max_responses);
+
+	long responses = NIL_P (max_responses) ? 10000 : NUM2LONG (max_responses);
+	if (responses < 1)
+		rb_raise (rb_eArgError, "max_responses must be at least 1");
+
+	ResponseCache_t *old = ResponseCache_t::Current;
+	ResponseCache_t::Current = NULL;
+	delete old;
+	ResponseCache_t::Current = new ResponseCache_t (NIL_P (max_bytes) ? 64 * 1024 * 1024 : NUM2LL (max_bytes), responses);
+	return Qnil;
+}
+
+
+/************************
+t_disable_response_cache
+************************/
+
+static VALUE t_disable_response_cache (VALUE self)
+{
+	// Requests waiting on a refresh go through to user code.
+	ResponseCache_t *old = ResponseCache_t::Current;
+	ResponseCache_t::Current = NULL;
+	delete old;
+	return Qnil;
+}
+
+
+/**********************
+t_clear_response_cache
+**********************/
+
+static VALUE t_clear_response_cache (VALUE self)
+{
+	if (ResponseCache_t::Current)
+		ResponseCache_t::Current->Clear();
+	return Qnil;
+}
+
+
+/***********************
+t_release_cache_waiters
+***********************/
+
+static VALUE t_release_cache_waiters (VALUE self)
+{
+	/* EventMachine::HttpServer.release_cache_waiters
+	 * Hand back the requests that were waiting on a refresh led by a
+	 * connection the GC has freed. This happens by itself at the next
+	 * safe point, so it's only needed to be sure it has.
+	 */
+	if (ResponseCache_t::Current)
+		_ReleaseCacheWaiters (ResponseCache_t::Current);
+	return Qnil;
+}
+
+
+/**********************
+t_response_cache_stats
+**********************/
+
+static VALUE t_response_cache_stats (VALUE self)
+{
+	ResponseCache_t *cache = ResponseCache_t::Current;
+	if (!cache)
+		return Qnil;
+
+	VALUE h = rb_hash_new();
+	rb_hash_aset (h, ID2SYM (rb_intern ("hits")), ULL2NUM (cache->GetHits()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("misses")), ULL2NUM (cache->GetMisses()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("coalesced")), ULL2NUM (cache->GetCoalesced()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("evicted")), ULL2NUM (cache->GetEvicted()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("entries")), ULL2NUM (cache->GetEntries()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("responses")), ULL2NUM (cache->GetResponses()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("bytes")), LL2NUM (cache->GetBytes()));
+	return h;
+}
+
+
+/******************
+t_set_cpu_affinity
+******************/
+
+static VALUE t_set_cpu_affinity (VALUE self, VALUE cpus)
+{
+	/* EventMachine::HttpServer.set_cpu_affinity (cpu_or_array_of_cpus)
+	 * Pin the calling process to the given CPUs. Linux only.
+	 */
+	#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	VALUE ary = rb_Array (cpus);
+	for (long i=0; i < RARRAY_LEN (ary); i++) {
+		int cpu = NUM2INT (rb_ary_entry (ary, i));
+		if ((cpu < 0) || (cpu >= CPU_SETSIZE))
+			rb_raise (rb_eArgError, "bad cpu number %d", cpu);
+		CPU_SET (cpu, &set);
+	}
+	if (sched_setaffinity (0, sizeof(set), &set))
+		rb_sys_fail ("sched_setaffinity");
+	return Qtrue;
+	#else
+	rb_notimplement();
+	return Qnil;
+	#endif
+}
+
+
+/***************
+t_request_count
+***************/
+
+static VALUE t_request_count (VALUE self)
+{
+	// Requests dispatched by every connection in this process.
+	return ULL2NUM (HttpConnection_t::RequestCount);
+}
+
+
+/***********
+t_http_date
+***********/
+
+static VALUE HttpDateValue = Qnil;
+
+static VALUE t_http_date (VALUE self)
+{
+	/* EventMachine::HttpServer.http_date
+	 * The current time as a Date header value. The same frozen String is
+	 * returned until the second changes.
+	 */
+	const char *date = HttpConnection_t::GetHttpDate();
+	if (NIL_P (HttpDateValue) || strcmp (RSTRING_PTR (HttpDateValue), date))
+		HttpDateValue = rb_obj_freeze (rb_str_new2 (date));
+	return HttpDateValue;
+}
+
+
+/*****************
+t_open_access_log
+*****************/
+
+static VALUE t_open_access_log (int argc, VALUE *argv, VALUE self)
+{
+	/* EventMachine::HttpServer.open_access_log (path, format=nil, capacity=nil)
+	 * Start logging every request on every HttpServer connection in this
+	 * process. Replaces (and flushes) any log that's already open.
+	 */
+	VALUE path, format, capacity;
+	rb_scan_args (argc, argv, "12", &path, &format, &capacity);
+
+	if (AccessLog_t::Current && !AccessLog_t::Current->IsInherited())
+		delete AccessLog_t::Current;
+	AccessLog_t::Current = NULL;
+
+	string err;
+	try {
+		AccessLog_t::Current = new AccessLog_t (StringValueCStr (path), NIL_P (format) ? NULL : StringValueCStr (format), NIL_P (capacity) ? 0 : NUM2INT (capacity));
+	}
+	catch (std::runtime_error &e) {
+		err = e.what();
+	}
+	if (!err.empty())
+		rb_raise (rb_eIOError, "%s", err.c_str());
+	return Qnil;
+}
+
+
+/*******************
+t_reopen_access_log
+*******************/
+
+static void _ReopenLog (AccessLog_t **current)
+{
+	AccessLog_t *log = *current;
+	if (log && log->IsInherited()) {
+		*current = NULL;
+		string err;
+		try {
+			*current = new AccessLog_t (log->GetPath().c_str(), log->GetFormat().c_str(), log->GetCapacity());
+		}
+		catch (std::runtime_error &e) {
+			err = e.what();
+		}
+		if (!err.empty())
+			rb_raise (rb_eIOError, "%s", err.c_str());
+	}
+	else if (log)
+		log->Reopen();
+}
+
+static VALUE t_reopen_access_log (VALUE self)
+{
+	/* Typically called from a signal trap, after the log has been rotated.
+	 * In a forked child, this starts a log of the child's own. The one
+	 * inherited from the parent is deliberately leaked, as its writer
+	 * thread only exists in the parent. The slow-request log, if any, is
+	 * reopened too.
+	 */
+	_ReopenLog (&AccessLog_t::Current);
+	_ReopenLog (&AccessLog_t::Slow);
+	return Qnil;
+}
+
+
+/******************
+t_close_access_log
+******************/
+
+static VALUE t_close_access_log (VALUE self)
+{
+	// Blocks until everything queued has been written.
+	if (AccessLog_t::Current && !AccessLog_t::Current->IsInherited())
+		delete AccessLog_t::Current;
+	AccessLog_t::Current = NULL;
+	return Qnil;
+}
+
+static VALUE t_close_slow_request_log (VALUE self);
+
+static void t_close_access_log_at_exit (VALUE unused)
+{
+	t_close_access_log (Qnil);
+	t_close_slow_request_log (Qnil);
+}
+
+
+/***********************
+t_open_slow_request_log
+***********************/
+
+static VALUE t_open_slow_request_log (VALUE self, VALUE path, VALUE threshold)
+{
+	/* EventMachine::HttpServer.open_slow_request_log (path, threshold)
+	 * Write the head and phase breakdown of every request that takes at
+	 * least threshold seconds, from its first byte to the last byte of its
+	 * response, to path. Replaces any slow-request log already open.
+	 */
+	long long micros = (long long)(NUM2DBL (threshold) * 1000000);
+	t_close_slow_request_log (self);
+
+	string err;
+	try {
+		AccessLog_t::Slow = new AccessLog_t (StringValueCStr (path), NULL, 1);
+	}
+	catch (std::runtime_error &e) {
+		err = e.what();
+	}
+	if (!err.empty())
+		rb_raise (rb_eIOError, "%s", err.c_str());
+	AccessLog_t::SlowThreshold = micros;
+	return Qnil;
+}
+
+
+/************************
+t_close_slow_request_log
+************************/
+
+static VALUE t_close_slow_request_log (VALUE self)
+{
+	if (AccessLog_t::Slow && !AccessLog_t::Slow->IsInherited())
+		delete AccessLog_t::Slow;
+	AccessLog_t::Slow = NULL;
+	return Qnil;
+}
+
+
+/****************
+t_request_phases
+****************/
+
+static VALUE t_request_phases (VALUE self)
+{
+	/* When the current request reached each phase, in microseconds after
+	 * its first byte arrived, or nil if it hasn't yet: :headers and :body
+	 * when they had been read, :dispatch when it was handed to user code
+	 * (or answered from the cache), and :first_response_byte and
+	 * :last_response_byte as the response was sent.
+	 */
+	static const char *names[] = {"first_byte", "headers", "body", "dispatch", "first_response_byte", "last_response_byte"};
+	RubyHttpConnection_t *hc = t_get_http_connection (self);
+	if (!hc)
+		return Qnil;
+	long long start = hc->GetPhaseTime (HttpConnection_t::FirstBytePhase);
+	if (!start)
+		return Qnil;
+
+	VALUE h = rb_hash_new();
+	for (int i=0; i < HttpConnection_t::NumPhases; i++) {
+		long long t = hc->GetPhaseTime ((HttpConnection_t::Phase_t)i);
+		rb_hash_aset (h, ID2SYM (rb_intern (names[i])), t ? LL2NUM (t - start) : Qnil);
+	}
+	return h;
+}
+
+
+/******************
+t_access_log_stats
+******************/
+
+static VALUE t_access_log_stats (VALUE self)
+{
+	if (!AccessLog_t::Current)
+		return Qnil;
+	VALUE h = rb_hash_new();
+	rb_hash_aset (h, ID2SYM (rb_intern ("written")), ULL2NUM (AccessLog_t::Current->GetWritten()));
+	rb_hash_aset (h, ID2SYM (rb_intern ("dropped")), ULL2NUM (AccessLog_t::Current->GetDropped()));
+	return h;
+}
+
+
+/****************************
+Init_eventmachine_httpserver
+****************************/
+
+extern "C" void Init_eventmachine_httpserver()
+{
+	#ifdef WITH_POSTPONED_JOB_HANDLE
+	ReleaseCacheWaitersJob = rb_postponed_job_preregister (0, _ReleaseCacheWaitersJob, NULL);
+	#endif
+	ResponseCache_t::Releaser = _ReleaseCacheWaiters;
+
+	Intern_http_conn = rb_intern ("http_conn");
+	Intern_http_router = rb_intern ("http_router");
+	Intern_http_unbind_callbacks = rb_intern ("http_unbind_callbacks");
+
+	VALUE EmModule = rb_define_module ("EventMachine");
+	VALUE HttpServer = rb_define_module_under (EmModule, "HttpServer");
+	rb_define_method (HttpServer, "post_init", (VALUE(*)(...))t_post_init, 0);
+	rb_define_method (HttpServer, "receive_data", (VALUE(*)(...))t_receive_data, 1);
+	rb_define_method (HttpServer, "receive_post_data", (VALUE(*)(...))t_receive_post_data, 1);
+	rb_define_method (HttpServer, "unbind", (VALUE(*)(...))t_unbind, 0);
+	rb_define_method (HttpServer, "add_unbind_callback", (VALUE(*)(...))t_add_unbind_callback, 0);
+	rb_define_method (HttpServer, "remove_unbind_callback", (VALUE(*)(...))t_remove_unbind_callback, 1);
+	rb_define_method (HttpServer, "send_data", (VALUE(*)(...))t_send_data, 1);
+	rb_define_method (HttpServer, "close_connection", (VALUE(*)(...))t_close_connection, -1);
+	rb_define_method (HttpServer, "close_connection_after_writing", (VALUE(*)(...))t_close_connection, -1);
 	rb_define_method (HttpServer, "process_http_request", (VALUE(*)(...))t_process_http_request, 0);
 	rb_define_method (HttpServer, "no_environment_strings", (VALUE(*)(...))t_no_environment_strings, 0);
 	rb_define_method (HttpServer, "dont_accumulate_post", (VALUE(*)(...))t_dont_accumulate_post, 0);
+	rb_define_method (HttpServer, "expect_continue", (VALUE(*)(...))t_expect_continue, 1);
+	rb_define_method (HttpServer, "max_content_length", (VALUE(*)(...))t_max_content_length, 1);
+	rb_define_method (HttpServer, "inflate_request_bodies", (VALUE(*)(...))t_inflate_request_bodies, -1);
+	rb_define_method (HttpServer, "reuse_post_data_buffer", (VALUE(*)(...))t_reuse_post_data_buffer, 0);
+	rb_define_method (HttpServer, "pause_post_data", (VALUE(*)(...))t_pause_post_data, 0);
+	rb_define_method (HttpServer, "resume_post_data", (VALUE(*)(...))t_resume_post_data, 0);
+	rb_define_method (HttpServer, "post_data_paused?", (VALUE(*)(...))t_post_data_paused, 0);
+	rb_define_method (HttpServer, "post_data_progress", (VALUE(*)(...))t_post_data_progress, 0);
+	rb_define_method (HttpServer, "accept_websockets", (VALUE(*)(...))t_accept_websockets, 0);
+	rb_define_method (HttpServer, "websocket?", (VALUE(*)(...))t_websocket_p, 0);
+	rb_define_method (HttpServer, "process_websocket_open", (VALUE(*)(...))t_process_websocket_open, 0);
+	rb_define_method (HttpServer, "receive_websocket_message", (VALUE(*)(...))t_receive_websocket_message, 1);
+	rb_define_method (HttpServer, "process_websocket_close", (VALUE(*)(...))t_process_websocket_close, 2);
+	rb_define_method (HttpServer, "send_websocket_message", (VALUE(*)(...))t_send_websocket_message, -1);
+	rb_define_method (HttpServer, "close_websocket", (VALUE(*)(...))t_close_websocket, -1);
+	rb_define_method (HttpServer, "use_router", (VALUE(*)(...))t_use_router, 1);
+	rb_define_method (HttpServer, "cookies", (VALUE(*)(...))t_cookies, 0);
+	rb_define_method (HttpServer, "cache_response", (VALUE(*)(...))t_cache_response, -1);
+	rb_define_method (HttpServer, "cookie", (VALUE(*)(...))t_cookie, 1);
+	rb_define_method (HttpServer, "body_stages", (VALUE(*)(...))t_body_stages, -1);
+	rb_define_method (HttpServer, "request_phases", (VALUE(*)(...))t_request_phases, 0);
+	rb_define_private_method (HttpServer, "free_http_connection", (VALUE(*)(...))t_free_http_connection, 0);
+
+	rb_define_singleton_method (HttpServer, "parse_byte_ranges", (VALUE(*)(...))t_parse_byte_ranges, 2);
+	rb_define_singleton_method (HttpServer, "parse_cookies", (VALUE(*)(...))t_parse_cookies, 1);
+	rb_define_singleton_method (HttpServer, "encode_chunks", (VALUE(*)(...))t_encode_chunks, -1);
+	rb_define_singleton_method (HttpServer, "encode_event", (VALUE(*)(...))t_encode_event, -1);
+	rb_define_singleton_method (HttpServer, "enable_response_cache", (VALUE(*)(...))t_enable_response_cache, -1);
+	rb_define_singleton_method (HttpServer, "disable_response_cache", (VALUE(*)(...))t_disable_response_cache, 0);
+	rb_define_singleton_method (HttpServer, "clear_response_cache", (VALUE(*)(...))t_clear_response_cache, 0);
+	rb_define_singleton_method (HttpServer, "response_cache_stats", (VALUE(*)(...))t_response_cache_stats, 0);
+	rb_define_singleton_method (HttpServer, "release_cache_waiters", (VALUE(*)(...))t_release_cache_waiters, 0);
+	rb_define_singleton_method (HttpServer, "start_body_workers", (VALUE(*)(...))t_start_body_workers, 1);
+	rb_define_singleton_method (HttpServer, "stop_body_workers", (VALUE(*)(...))t_stop_body_workers, 0);
+	rb_define_singleton_method (HttpServer, "run_body_completions", (VALUE(*)(...))t_run_body_completions, 0);
+	rb_define_singleton_method (HttpServer, "process_body", (VALUE(*)(...))t_process_body, -1);
+	BodyCallbacks = rb_hash_new();
+	rb_gc_register_address (&BodyCallbacks);
+	rb_define_singleton_method (HttpServer, "set_cpu_affinity", (VALUE(*)(...))t_set_cpu_affinity, 1);
+	rb_define_singleton_method (HttpServer, "request_count", (VALUE(*)(...))t_request_count, 0);
+	rb_define_singleton_method (HttpServer, "http_date", (VALUE(*)(...))t_http_date, 0);
+	rb_gc_register_address (&HttpDateValue);
+	rb_define_singleton_method (HttpServer, "open_access_log", (VALUE(*)(...))t_open_access_log, -1);
+	rb_define_singleton_method (HttpServer, "reopen_access_log", (VALUE(*)(...))t_reopen_access_log, 0);
+	rb_define_singleton_method (HttpServer, "close_access_log", (VALUE(*)(...))t_close_access_log, 0);
+	rb_define_singleton_method (HttpServer, "access_log_stats", (VALUE(*)(...))t_access_log_stats, 0);
+	rb_define_singleton_method (HttpServer, "open_slow_request_log", (VALUE(*)(...))t_open_slow_request_log, 2);
+	rb_define_singleton_method (HttpServer, "close_slow_request_log", (VALUE(*)(...))t_close_slow_request_log, 0);
+	rb_set_end_proc (t_close_access_log_at_exit, Qnil);
+
+	HttpRouterClass = rb_define_class_under (EmModule, "HttpRouter", rb_cObject);
+	rb_define_alloc_func (HttpRouterClass, t_router_alloc);
+	rb_define_method (HttpRouterClass, "add", (VALUE(*)(...))t_router_add, -1);
+	rb_define_method (HttpRouterClass, "match", (VALUE(*)(...))t_router_match, 2);
+	rb_define_method (HttpRouterClass, "size", (VALUE(*)(...))t_router_size, 0);
+
+	VALUE EventChannelClass = rb_define_class_under (EmModule, "HttpEventChannel", rb_cObject);
+	rb_define_alloc_func (EventChannelClass, t_channel_alloc);
+	rb_define_method (EventChannelClass, "initialize", (VALUE(*)(...))t_channel_initialize, -1);
+	rb_define_private_method (EventChannelClass, "subscribe_connection", (VALUE(*)(...))t_channel_subscribe, 1);
+	rb_define_method (EventChannelClass, "unsubscribe", (VALUE(*)(...))t_channel_unsubscribe, 1);
+	rb_define_method (EventChannelClass, "publish", (VALUE(*)(...))t_channel_publish, -1);
+	rb_define_method (EventChannelClass, "keepalive", (VALUE(*)(...))t_channel_keepalive, 0);
+	rb_define_method (EventChannelClass, "pump", (VALUE(*)(...))t_channel_pump, 0);
+	rb_define_method (EventChannelClass, "size", (VALUE(*)(...))t_channel_size, 0);
+	rb_define_method (EventChannelClass, "stats", (VALUE(*)(...))t_channel_stats, 0);
+	rb_gc_register_address (&SharedString);
 }
@@ -0,0 +1,534 @@
+/*****************************************************************************
+
+File:     websocket.cpp
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+#include <stdint.h>
+
+using namespace std;
+
+#include "http.h"
+#include "websocket.h"
+
+
+/****
+Sha1
+****/
+
+static void Sha1 (const unsigned char *data, size_t len, unsigned char digest[20])
+{
+	/* Plain FIPS 180-1. We only need it for the handshake, which hashes
+	 * a 60-byte string once per connection, so there's no point in
+	 * pulling in a crypto library for it.
+	 */
+
+	uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+	vector<unsigned char> msg (data, data + len);
+	msg.push_back (0x80);
+	while ((msg.size() % 64) != 56)
+		msg.push_back (0);
+	uint64_t bits = (uint64_t)len * 8;
+	for (int i=7; i >= 0; i--)
+		msg.push_back ((unsigned char)(bits >> (i * 8)));
+
+	for (size_t chunk=0; chunk < msg.size(); chunk += 64) {
+		uint32_t w[80];
+		for (int i=0; i < 16; i++)
+			w[i] = ((uint32_t)msg[chunk+i*4] << 24) | ((uint32_t)msg[chunk+i*4+1] << 16) | ((uint32_t)msg[chunk+i*4+2] << 8) | (uint32_t)msg[chunk+i*4+3];
+		for (int i=16; i < 80; i++) {
+			uint32_t t = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+			w[i] = (t << 1) | (t >> 31);
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i=0; i < 80; i++) {
+			uint32_t f, k;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			}
+			else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = (b << 30) | (b >> 2);
+			b = a;
+			a = t;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+
+	for (int i=0; i < 20; i++)
+		digest[i] = (unsigned char)(h[i/4] >> (24 - (i % 4) * 8));
+}
+
+
+/*********
+Base64
+*********/
+
+static string Base64 (const unsigned char *data, size_t len)
+{
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	string out;
+	for (size_t i=0; i < len; i += 3) {
+		uint32_t n = (uint32_t)data[i] << 16;
+		if (i+1 < len)
+			n |= (uint32_t)data[i+1] << 8;
+		if (i+2 < len)
+			n |= data[i+2];
+		out += chars [(n >> 18) & 63];
+		out += chars [(n >> 12) & 63];
+		out += (i+1 < len) ? chars [(n >> 6) & 63] : '=';
+		out += (i+2 < len) ? chars [n & 63] : '=';
+	}
+	return out;
+}
+
+
+/************************
+WebSocket_t::WebSocket_t
+************************/
+
+WebSocket_t::WebSocket_t (HttpConnection_t *owner, int max_message_size):
+	Owner (owner),
+	nMaxMessageSize (max_message_size),
+	State (HeaderState),
+	HeaderPos (0),
+	HeaderLength (2),
+	Opcode (0),
+	bFin (false),
+	PayloadLength (0),
+	PayloadPos (0),
+	MessageOpcode (0),
+	bCloseSent (false)
+{
+	if (!Owner)
+		throw std::runtime_error ("no owner for websocket");
+}
+
+
+/**********************
+WebSocket_t::AcceptKey
+**********************/
+
+string WebSocket_t::AcceptKey (const char *key)
+{
+	// Sec-WebSocket-Accept, RFC 6455 pgh 4.2.2.
+	string s (key ? key : "");
+	s += "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+	unsigned char digest [20];
+	Sha1 ((const unsigned char*)s.data(), s.length(), digest);
+	return Base64 (digest, sizeof(digest));
+}
+
+
+/************************
+WebSocket_t::ConsumeData
+************************/
+
+void WebSocket_t::ConsumeData (const char *data, int length)
+{
+	while ((length > 0) && (State != ClosedState)) {
+		if (State == HeaderState) {
+			int len = HeaderLength - HeaderPos;
+			if (len > length)
+				len = length;
+			memcpy (Header + HeaderPos, data, len);
+			HeaderPos += len;
+			data += len;
+			length -= len;
+			if (HeaderPos == HeaderLength) {
+				if (!_ReadHeader())
+					return;
+			}
+		}
+		else if (State == PayloadState) {
+			long long remaining = PayloadLength - PayloadPos;
+			int len = (remaining < length) ? (int)remaining : length;
+
+			// Unmask straight into the buffer the payload ends up in.
+			string &target = (Opcode >= CloseFrame) ? Control : Message;
+			size_t size = target.length();
+			target.resize (size + len);
+			_Unmask (&target[size], data, len, Mask, (size_t)PayloadPos);
+
+			PayloadPos += len;
+			data += len;
+			length -= len;
+			if (PayloadPos == PayloadLength)
+				_FrameComplete();
+		}
+	}
+}
+
+
+/************************
+WebSocket_t::_ReadHeader
+************************/
+
+bool WebSocket_t::_ReadHeader()
+{
+	/* Called each time HeaderPos reaches HeaderLength. The first two bytes
+	 * tell us how long the rest of the header is, so we may ask for more.
+	 * Returns false if the frame is bad and we've failed the connection.
+	 */
+
+	if (HeaderLength == 2) {
+		if (!(Header[1] & 0x80)) {
+			// Clients MUST mask, pgh 5.1.
+			_Fail (CloseProtocolError);
+			return false;
+		}
+		int len7 = Header[1] & 0x7F;
+		HeaderLength = 2 + ((len7 == 126) ? 2 : (len7 == 127) ? 8 : 0) + 4;
+		return true;
+	}
+
+	bFin = (Header[0] & 0x80) != 0;
+	Opcode = Header[0] & 0x0F;
+	if (Header[0] & 0x70) {
+		// No extensions are negotiated, so the RSV bits must be clear.
+		_Fail (CloseProtocolError);
+		return false;
+	}
+
+	int len7 = Header[1] & 0x7F;
+	int pos = 2;
+	if (len7 == 126) {
+		PayloadLength = ((long long)Header[2] << 8) | Header[3];
+		pos = 4;
+	}
+	else if (len7 == 127) {
+		if (Header[2] & 0x80) {
+			_Fail (CloseProtocolError);
+			return false;
+		}
+		PayloadLength = 0;
+		for (int i=2; i < 10; i++)
+			PayloadLength = (PayloadLength << 8) | Header[i];
+		pos = 10;
+	}
+	else
+		PayloadLength = len7;
+	memcpy (Mask, Header + pos, 4);
+	PayloadPos = 0;
+
+	if (Opcode >= CloseFrame) {
+		if (!bFin || (PayloadLength > 125) || ((Opcode != CloseFrame) && (Opcode != PingFrame) && (Opcode != PongFrame))) {
+			_Fail (CloseProtocolError);
+			return false;
+		}
+		Control.clear();
+	}
+	else {
+		if ((Opcode == ContinuationFrame) != (MessageOpcode != 0)) {
+			// A continuation with no message under way, or a new
+			// message in the middle of a fragmented one.
+			_Fail (CloseProtocolError);
+			return false;
+		}
+		if ((Opcode != ContinuationFrame) && (Opcode != TextFrame) && (Opcode != BinaryFrame)) {
+			_Fail (CloseProtocolError);
+			return false;
+		}
+		if ((long long)Message.length() + PayloadLength > nMaxMessageSize) {
+			_Fail (CloseMessageTooBig);
+			return false;
+		}
+		if (Opcode != ContinuationFrame)
+			MessageOpcode = Opcode;
+	}
+
+	HeaderPos = 0;
+	HeaderLength = 2;
+	State = PayloadState;
+	if (PayloadLength == 0)
+		_FrameComplete();
+	return true;
+}
+
+
+/***************************
+WebSocket_t::_FrameComplete
+***************************/
+
+void WebSocket_t::_FrameComplete()
+{
+	State = HeaderState;
+
+	switch (Opcode) {
+		case ContinuationFrame:
+		case TextFrame:
+		case BinaryFrame:
+			if (bFin) {
+				bool binary = (MessageOpcode == BinaryFrame);
+				MessageOpcode = 0;
+				// Swap the message out first, the owner may well call
+				// back into us to send something.
+				string msg;
+				msg.swap (Message);
+				if (!binary && !_ValidUtf8 (msg.data(), msg.length())) {
+					_Fail (CloseInvalidData);
+					return;
+				}
+				Owner->ReceiveWebSocketMessage (msg.data(), msg.length(), binary);
+			}
+			break;
+
+		case PingFrame:
+			_SendFrame (PongFrame, Control.data(), Control.length());
+			break;
+
+		case PongFrame:
+			break;
+
+		case CloseFrame: {
+			if (Control.length() == 1) {
+				_Fail (CloseProtocolError);
+				return;
+			}
+			int code = CloseNoStatus;
+			string reason;
+			if (Control.length() >= 2) {
+				code = ((unsigned char)Control[0] << 8) | (unsigned char)Control[1];
+				reason = Control.substr (2);
+				if (!_ValidCloseCode (code)) {
+					_Fail (CloseProtocolError);
+					return;
+				}
+				if (!_ValidUtf8 (reason.data(), reason.length())) {
+					_Fail (CloseInvalidData);
+					return;
+				}
+			}
+
+			// Echo the close if we didn't start it, then we're done.
+			if (!bCloseSent)
+				SendClose ((code == CloseNoStatus) ? CloseNormal : code, NULL, 0);
+			State = ClosedState;
+			Owner->WebSocketClosed (code, reason.data(), reason.length());
+			Owner->CloseConnection (true);
+			break;
+		}
+	}
+}
+
+
+/************************
+WebSocket_t::SendMessage
+************************/
+
+void WebSocket_t::SendMessage (const char *data, int length, bool binary)
+{
+	if ((State == ClosedState) || bCloseSent)
+		return;
+	_SendFrame (binary ? BinaryFrame : TextFrame, data, length);
+}
+
+
+/**********************
+WebSocket_t::SendClose
+**********************/
+
+void WebSocket_t::SendClose (int code, const char *reason, int len)
+{
+	if (bCloseSent || (State == ClosedState))
+		return;
+	bCloseSent = true;
+
+	if (len > 123)
+		len = 123;
+	char payload [125];
+	payload[0] = (char)((code >> 8) & 0xFF);
+	payload[1] = (char)(code & 0xFF);
+	if (reason && (len > 0))
+		memcpy (payload + 2, reason, len);
+	else
+		len = 0;
+	_SendFrame (CloseFrame, payload, len + 2);
+}
+
+
+/***********************
+WebSocket_t::_SendFrame
+***********************/
+
+void WebSocket_t::_SendFrame (int opcode, const char *data, int length)
+{
+	// Server frames are never masked. We send the header and payload
+	// as one buffer so they go out in a single write.
+	string frame;
+	frame.reserve (length + 10);
+	frame += (char)(0x80 | opcode);
+	if (length < 126)
+		frame += (char)length;
+	else if (length < 65536) {
+		frame += (char)126;
+		frame += (char)((length >> 8) & 0xFF);
+		frame += (char)(length & 0xFF);
+	}
+	else {
+		frame += (char)127;
+		for (int i=7; i >= 0; i--)
+			frame += (char)(((uint64_t)length >> (i * 8)) & 0xFF);
+	}
+	if (length > 0)
+		frame.append (data, length);
+	Owner->SendData (frame.data(), frame.length());
+}
+
+
+/******************
+WebSocket_t::_Fail
+******************/
+
+void WebSocket_t::_Fail (int code)
+{
+	// Fail the connection, pgh 7.1.7.
+	SendClose (code, NULL, 0);
+	State = ClosedState;
+	Owner->WebSocketClosed (code, "", 0);
+	Owner->CloseConnection (true);
+}
+
+
+/****************************
+WebSocket_t::_ValidCloseCode
+****************************/
+
+bool WebSocket_t::_ValidCloseCode (int code)
+{
+	/* RFC 6455 7.4: a peer may send the assigned codes and the ones
+	 * set aside for libraries and applications (3000-4999). 1005, 1006
+	 * and 1015 are only for reporting, never for the wire.
+	 */
+	if ((code >= 1000) && (code <= 1003))
+		return true;
+	if ((code >= 1007) && (code <= 1014))
+		return true;
+	return (code >= 3000) && (code <= 4999);
+}
+
+
+/***********************
+WebSocket_t::_ValidUtf8
+***********************/
+
+bool WebSocket_t::_ValidUtf8 (const char *data, size_t len)
+{
+	/* Strict UTF-8 (RFC 3629): no overlong forms, no surrogates,
+	 * nothing past U+10FFFF. Text messages and close reasons that
+	 * fail this get the connection closed with 1007.
+	 */
+	const unsigned char *p = (const unsigned char*) data;
+	const unsigned char *end = p + len;
+
+	while (p < end) {
+		unsigned char c = *p++;
+		if (c < 0x80)
+			continue;
+
+		int more;
+		unsigned char lo = 0x80, hi = 0xBF;
+		if ((c >= 0xC2) && (c <= 0xDF))
+			more = 1;
+		else if ((c >= 0xE0) && (c <= 0xEF)) {
+			more = 2;
+			if (c == 0xE0)
+				lo = 0xA0;
+			else if (c == 0xED)
+				hi = 0x9F;
+		}
+		else if ((c >= 0xF0) && (c <= 0xF4)) {
+			more = 3;
+			if (c == 0xF0)
+				lo = 0x90;
+			else if (c == 0xF4)
+				hi = 0x8F;
+		}
+		else
+			return false;
+
+		if (end - p < more)
+			return false;
+		if ((*p < lo) || (*p > hi))
+			return false;
+		p++;
+		while (--more > 0) {
+			if ((*p & 0xC0) != 0x80)
+				return false;
+			p++;
+		}
+	}
+	return true;
+}
+
+
+/********************
+WebSocket_t::_Unmask
+********************/
+
+void WebSocket_t::_Unmask (char *dst, const char *src, size_t len, const unsigned char *mask, size_t offset)
+{
+	/* XOR the payload with the masking key, where offset is the position
+	 * of src within the frame's payload. We work a 64-bit word at a time
+	 * (which the compiler is free to vectorize further) and finish the
+	 * tail bytewise. The memcpys keep unaligned access legal.
+	 */
+
+	unsigned char m [8];
+	for (int i=0; i < 8; i++)
+		m[i] = mask [(offset + i) % 4];
+	uint64_t m64;
+	memcpy (&m64, m, 8);
+
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy (&w, src + i, 8);
+		w ^= m64;
+		memcpy (dst + i, &w, 8);
+	}
+	for (; i < len; i++)
+		dst[i] = src[i] ^ m [i % 4];
+}
@@ -0,0 +1,105 @@
+/*****************************************************************************
+
+File:     websocket.h
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#ifndef __WebSocket__H_
+#define __WebSocket__H_
+
+#include <string>
+
+class HttpConnection_t;
+
+/*******************
+class WebSocket_t
+*******************/
+
+class WebSocket_t
+{
+	/* RFC 6455 framing for a connection that has been upgraded from HTTP.
+	 * We read (masked) client frames incrementally and hand complete
+	 * messages to the owning connection, answer pings and close frames
+	 * ourselves, and write unmasked server frames through the owner.
+	 */
+
+	public:
+		WebSocket_t (HttpConnection_t*, int max_message_size);
+		virtual ~WebSocket_t() {}
+
+		void ConsumeData (const char*, int);
+		void SendMessage (const char*, int, bool binary);
+		void SendClose (int code, const char *reason, int len);
+		bool IsClosed() const {return State == ClosedState;}
+
+		static std::string AcceptKey (const char *key);
+
+		enum {
+			ContinuationFrame = 0x0,
+			TextFrame = 0x1,
+			BinaryFrame = 0x2,
+			CloseFrame = 0x8,
+			PingFrame = 0x9,
+			PongFrame = 0xA
+		};
+
+		enum {
+			CloseNormal = 1000,
+			CloseProtocolError = 1002,
+			CloseNoStatus = 1005,
+			CloseInvalidData = 1007,
+			CloseMessageTooBig = 1009
+		};
+
+	private:
+		HttpConnection_t *Owner;
+		int nMaxMessageSize;
+
+		enum {
+			HeaderState,
+			PayloadState,
+			ClosedState
+		} State;
+
+		unsigned char Header [14];
+		int HeaderPos;
+		int HeaderLength;
+
+		int Opcode;
+		bool bFin;
+		unsigned char Mask [4];
+		long long PayloadLength;
+		long long PayloadPos;
+
+		int MessageOpcode;
+		std::string Message;
+		std::string Control;
+		bool bCloseSent;
+
+	private:
+		bool _ReadHeader();
+		void _FrameComplete();
+		void _SendFrame (int opcode, const char*, int);
+		void _Fail (int code);
+		static bool _ValidCloseCode (int code);
+		static bool _ValidUtf8 (const char*, size_t);
+		static void _Unmask (char *dst, const char *src, size_t len, const unsigned char *mask, size_t offset);
+};
+
+#endif // __WebSocket__H_
@@ -0,0 +1,675 @@
+/*****************************************************************************
+
+File:     workers.cpp
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#ifdef OS_WIN32
+#include <io.h>
+#define pipe(fds) _pipe (fds, 256, _O_BINARY)
+#define read _read
+#define write _write
+#define close _close
+#define strncasecmp _strnicmp
+#else
+#include <unistd.h>
+#endif
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace std;
+
+#include "workers.h"
+
+
+WorkerPool_t *WorkerPool_t::Current = NULL;
+
+
+/*********************
+BodyJob_t::~BodyJob_t
+*********************/
+
+BodyJob_t::~BodyJob_t()
+{
+	if (Body)
+		free (Body);
+}
+
+
+/**************************
+WorkerPool_t::WorkerPool_t
+**************************/
+
+WorkerPool_t::WorkerPool_t (int nthreads):
+	bStop (false),
+	LastId (0)
+{
+	if (pipe (NotifyPipe))
+		throw std::runtime_error ("unable to create worker pipe");
+	#ifndef OS_WIN32
+	fcntl (NotifyPipe[0], F_SETFL, fcntl (NotifyPipe[0], F_GETFL) | O_NONBLOCK);
+	fcntl (NotifyPipe[1], F_SETFL, fcntl (NotifyPipe[1], F_GETFL) | O_NONBLOCK);
+	#endif
+
+	if (nthreads < 1)
+		nthreads = 1;
+	for (int i=0; i < nthreads; i++)
+		Threads.push_back (thread (&WorkerPool_t::_Run, this));
+}
+
+
+/***************************
+WorkerPool_t::~WorkerPool_t
+***************************/
+
+WorkerPool_t::~WorkerPool_t()
+{
+	Stop();
+	while (BodyJob_t *job = Completed())
+		delete job;
+	close (NotifyPipe[0]);
+	close (NotifyPipe[1]);
+}
+
+
+/********************
+WorkerPool_t::Submit
+********************/
+
+unsigned long WorkerPool_t::Submit (BodyJob_t *job, HttpConnection_t *owner)
+{
+	/* Queue the job, which now belongs to us until it comes back from
+	 * Completed. The owner, if any, is who the caller will give it to
+	 * then, unless it has been forgotten in the meantime.
+	 */
+	job->Id = ++LastId;
+	if (owner)
+		Owners [job->Id] = owner;
+	{
+		lock_guard<mutex> lock (Lock);
+		Queue.push_back (job);
+	}
+	Ready.notify_one();
+	return job->Id;
+}
+
+
+/***********************
+WorkerPool_t::Completed
+***********************/
+
+BodyJob_t *WorkerPool_t::Completed()
+{
+	// The next finished job, or NULL. Clears the notification pipe, so
+	// call this until it returns NULL.
+	char buf [64];
+	while (read (NotifyPipe[0], buf, sizeof(buf)) == sizeof(buf))
+		;
+
+	lock_guard<mutex> lock (Lock);
+	if (Done.empty())
+		return NULL;
+	BodyJob_t *job = Done.front();
+	Done.pop_front();
+	return job;
+}
+
+
+/***********************
+WorkerPool_t::TakeOwner
+***********************/
+
+HttpConnection_t *WorkerPool_t::TakeOwner (unsigned long id)
+{
+	map<unsigned long, HttpConnection_t*>::iterator i = Owners.find (id);
+	if (i == Owners.end())
+		return NULL;
+	HttpConnection_t *owner = i->second;
+	Owners.erase (i);
+	return owner;
+}
+
+
+/********************
+WorkerPool_t::Forget
+********************/
+
+void WorkerPool_t::Forget (HttpConnection_t *owner)
+{
+	// The connection is going away. Its job still runs, but is dropped
+	// when it completes.
+	map<unsigned long, HttpConnection_t*>::iterator i = Owners.begin();
+	while (i != Owners.end()) {
+		if (i->second == owner)
+			Owners.erase (i++);
+		else
+			i++;
+	}
+}
+
+
+/******************
+WorkerPool_t::Stop
+******************/
+
+void WorkerPool_t::Stop()
+{
+	// Let the threads finish what's queued, and wait for them.
+	{
+		lock_guard<mutex> lock (Lock);
+		bStop = true;
+	}
+	Ready.notify_all();
+	for (size_t i=0; i < Threads.size(); i++) {
+		if (Threads[i].joinable())
+			Threads[i].join();
+	}
+}
+
+
+/******************
+WorkerPool_t::_Run
+******************/
+
+void WorkerPool_t::_Run()
+{
+	while (true) {
+		BodyJob_t *job;
+		{
+			unique_lock<mutex> lock (Lock);
+			while (Queue.empty() && !bStop)
+				Ready.wait (lock);
+			if (Queue.empty())
+				return;
+			job = Queue.front();
+			Queue.pop_front();
+		}
+
+		_RunStages (job);
+
+		{
+			lock_guard<mutex> lock (Lock);
+			Done.push_back (job);
+		}
+		// If the pipe is full, the reactor has a wakeup pending anyway.
+		char c = 0;
+		(void) !write (NotifyPipe[1], &c, 1);
+	}
+}
+
+
+/*****
+Crc32
+*****/
+
+static uint32_t Crc32 (const unsigned char *data, size_t len)
+{
+	static uint32_t table [256];
+	static bool bTable = [] {
+		for (uint32_t i=0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k=0; k < 8; k++)
+				c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+			table[i] = c;
+		}
+		return true;
+	}();
+	(void) bTable;
+
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i=0; i < len; i++)
+		crc = table [(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+
+/******
+Sha256
+******/
+
+static string Sha256 (const unsigned char *data, size_t len)
+{
+	// FIPS 180-4, over the body in place. Returns the digest in hex.
+	static const uint32_t k [64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+	uint32_t h [8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+	#define ROTR(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+	// Whole blocks straight from the body, then the padded tail.
+	unsigned char tail [128];
+	size_t whole = len & ~(size_t)63;
+	size_t rest = len - whole;
+	memcpy (tail, data + whole, rest);
+	tail [rest++] = 0x80;
+	size_t taillen = (rest <= 56) ? 64 : 128;
+	memset (tail + rest, 0, taillen - rest);
+	uint64_t bits = (uint64_t)len * 8;
+	for (int i=0; i < 8; i++)
+		tail [taillen - 1 - i] = (unsigned char)(bits >> (i * 8));
+
+	for (size_t off=0; off < whole + taillen; off += 64) {
+		const unsigned char *p = (off < whole) ? (data + off) : (tail + off - whole);
+		uint32_t w [64];
+		for (int i=0; i < 16; i++)
+			w[i] = ((uint32_t)p[i*4] << 24) | ((uint32_t)p[i*4+1] << 16) | ((uint32_t)p[i*4+2] << 8) | (uint32_t)p[i*4+3];
+		for (int i=16; i < 64; i++) {
+			uint32_t s0 = ROTR (w[i-15], 7) ^ ROTR (w[i-15], 18) ^ (w[i-15] >> 3);
+			uint32_t s1 = ROTR (w[i-2], 17) ^ ROTR (w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+		for (int i=0; i < 64; i++) {
+			uint32_t t1 = hh + (ROTR (e, 6) ^ ROTR (e, 11) ^ ROTR (e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+			uint32_t t2 = (ROTR (a, 2) ^ ROTR (a, 13) ^ ROTR (a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			hh = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+		h[5] += f;
+		h[6] += g;
+		h[7] += hh;
+	}
+	#undef ROTR
+
+	char hex [65];
+	for (int i=0; i < 8; i++)
+		snprintf (hex + i*8, 9, "%08x", h[i]);
+	return string (hex, 64);
+}
+
+
+/***********
+_Inflate
+***********/
+
+static bool _Inflate (BodyJob_t *job)
+{
+	/* Decode a gzip or zlib (deflate) body. The decoded body replaces the
+	 * original only if it's valid and no larger than MaxLength.
+	 */
+	#ifdef WITH_ZLIB
+	z_stream z;
+	memset (&z, 0, sizeof(z));
+	// 15 + 32: the largest window, and detect gzip or zlib from the header.
+	if (inflateInit2 (&z, 15 + 32) != Z_OK) {
+		job->Error = "inflate: unable to initialize";
+		return false;
+	}
+
+	size_t cap = (job->Length * 4) + 1024;
+	if (job->MaxLength && (cap > job->MaxLength + 1))
+		cap = job->MaxLength + 1;
+	char *out = (char*) malloc (cap + 1);
+	size_t outlen = 0;
+
+	z.next_in = (Bytef*) job->Body;
+	z.avail_in = job->Length;
+	int ret = Z_OK;
+	while (out && (ret == Z_OK)) {
+		if (outlen == cap) {
+			if (job->MaxLength && (outlen > job->MaxLength))
+				break;
+			cap *= 2;
+			if (job->MaxLength && (cap > job->MaxLength + 1))
+				cap = job->MaxLength + 1;
+			char *bigger = (char*) realloc (out, cap + 1);
+			if (!bigger) {
+				free (out);
+				out = NULL;
+				break;
+			}
+			out = bigger;
+		}
+		z.next_out = (Bytef*) (out + outlen);
+		z.avail_out = cap - outlen;
+		ret = inflate (&z, Z_NO_FLUSH);
+		outlen = cap - z.avail_out;
+		if ((ret == Z_BUF_ERROR) && (z.avail_out == 0))
+			ret = Z_OK;
+	}
+	inflateEnd (&z);
+
+	if (!out)
+		job->Error = "inflate: out of memory";
+	else if (job->MaxLength && (outlen > job->MaxLength))
+		job->Error = "inflate: body too large";
+	else if (ret != Z_STREAM_END)
+		job->Error = "inflate: bad or truncated data";
+	if (!job->Error.empty()) {
+		free (out);
+		return false;
+	}
+
+	out [outlen] = 0;
+	free (job->Body);
+	job->Body = out;
+	job->Length = outlen;
+	return true;
+	#else
+	job->Error = "inflate: built without zlib";
+	return false;
+	#endif
+}
+
+
+/*****
+_Find
+*****/
+
+static const void *_Find (const void *hay, size_t haylen, const void *needle, size_t len)
+{
+	// memmem, which not every platform has.
+	const char *h = (const char*) hay;
+	const char *end = h + haylen;
+	while ((size_t)(end - h) >= len) {
+		h = (const char*) memchr (h, *(const char*)needle, (end - h) - len + 1);
+		if (!h)
+			return NULL;
+		if (!memcmp (h, needle, len))
+			return h;
+		h++;
+	}
+	return NULL;
+}
+
+
+/**********
+_Multipart
+**********/
+
+static bool _Multipart (BodyJob_t *job, string boundary)
+{
+	/* Split a multipart body (RFC 2046 5.1) into the header block and
+	 * content of each part. The boundary comes from the stage or from
+	 * the request's Content-Type.
+	 */
+	if (boundary.empty()) {
+		const char *ct = job->ContentType.c_str();
+		const char *b = NULL;
+		for (const char *s = ct; *s; s++) {
+			if (!strncasecmp (s, "boundary=", 9)) {
+				b = s + 9;
+				break;
+			}
+		}
+		if (b) {
+			if (*b == '"') {
+				b++;
+				const char *e = strchr (b, '"');
+				boundary.assign (b, e ? (e - b) : strlen (b));
+			}
+			else
+				boundary.assign (b, strcspn (b, "; \t"));
+		}
+	}
+	if (boundary.empty()) {
+		job->Error = "multipart: no boundary";
+		return false;
+	}
+
+	string delim = "--" + boundary;
+	const char *body = job->Body;
+	const char *end = body + job->Length;
+
+	// The first delimiter needn't follow a CRLF. Later ones must.
+	const char *p = NULL;
+	if ((job->Length >= delim.length()) && !memcmp (body, delim.data(), delim.length()))
+		p = body;
+	else {
+		string first = "\r\n" + delim;
+		p = (const char*) _Find (body, job->Length, first.data(), first.length());
+		if (p)
+			p += 2;
+	}
+	if (!p) {
+		job->Error = "multipart: no parts";
+		return false;
+	}
+
+	string next = "\r\n" + delim;
+	while (true) {
+		p += delim.length();
+		if (((end - p) >= 2) && (p[0] == '-') && (p[1] == '-'))
+			return true;
+		const char *line = (const char*) _Find (p, end - p, "\r\n", 2);
+		if (!line)
+			break;
+		const char *part = line + 2;
+		const char *stop = (const char*) _Find (part, end - part, next.data(), next.length());
+		if (!stop)
+			break;
+
+		const char *hend = (const char*) _Find (part, stop - part, "\r\n\r\n", 4);
+		if (hend)
+			job->Parts.push_back (make_pair (string (part, hend - part), string (hend + 4, stop - hend - 4)));
+		else if ((stop - part >= 2) && !memcmp (part, "\r\n", 2))
+			job->Parts.push_back (make_pair (string(), string (part + 2, stop - part - 2)));
+		else {
+			job->Error = "multipart: bad part headers";
+			return false;
+		}
+		p = stop + 2;
+	}
+
+	job->Error = "multipart: missing close delimiter";
+	return false;
+}
+
+
+/*************
+_JsonValidate
+*************/
+
+static const char *_JsonSkip (const char *p, const char *end)
+{
+	while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n')))
+		p++;
+	return p;
+}
+
+static const char *_JsonValue (const char *p, const char *end, int depth)
+{
+	// Returns the position after the value, or NULL if it's malformed.
+	if (depth > 512)
+		return NULL;
+	p = _JsonSkip (p, end);
+	if (p >= end)
+		return NULL;
+
+	switch (*p) {
+		case '{':
+		case '[': {
+			char close = (*p == '{') ? '}' : ']';
+			bool object = (*p == '{');
+			p = _JsonSkip (p + 1, end);
+			if ((p < end) && (*p == close))
+				return p + 1;
+			while (true) {
+				if (object) {
+					p = _JsonSkip (p, end);
+					if ((p >= end) || (*p != '"'))
+						return NULL;
+					if (!(p = _JsonValue (p, end, depth + 1)))
+						return NULL;
+					p = _JsonSkip (p, end);
+					if ((p >= end) || (*p++ != ':'))
+						return NULL;
+				}
+				if (!(p = _JsonValue (p, end, depth + 1)))
+					return NULL;
+				p = _JsonSkip (p, end);
+				if (p >= end)
+					return NULL;
+				if (*p == close)
+					return p + 1;
+				if (*p++ != ',')
+					return NULL;
+			}
+		}
+		case '"':
+			for (p++; p < end; p++) {
+				if (*p == '"')
+					return p + 1;
+				if ((unsigned char)*p < 0x20)
+					return NULL;
+				if (*p == '\\') {
+					if (++p >= end)
+						return NULL;
+					if (*p == 'u') {
+						for (int i=0; i < 4; i++) {
+							if ((++p >= end) || !isxdigit ((unsigned char)*p))
+								return NULL;
+						}
+					}
+					else if (!strchr ("\"\\/bfnrt", *p))
+						return NULL;
+				}
+			}
+			return NULL;
+		case 't':
+			return ((end - p >= 4) && !memcmp (p, "true", 4)) ? p + 4 : NULL;
+		case 'f':
+			return ((end - p >= 5) && !memcmp (p, "false", 5)) ? p + 5 : NULL;
+		case 'n':
+			return ((end - p >= 4) && !memcmp (p, "null", 4)) ? p + 4 : NULL;
+		default: {
+			const char *start = p;
+			if ((p < end) && (*p == '-'))
+				p++;
+			if ((p < end) && (*p == '0'))
+				p++;
+			else if ((p < end) && isdigit ((unsigned char)*p)) {
+				while ((p < end) && isdigit ((unsigned char)*p))
+					p++;
+			}
+			else
+				return NULL;
+			if ((p < end) && (*p == '.')) {
+				if ((++p >= end) || !isdigit ((unsigned char)*p))
+					return NULL;
+				while ((p < end) && isdigit ((unsigned char)*p))
+					p++;
+			}
+			if ((p < end) && ((*p == 'e') || (*p == 'E'))) {
+				p++;
+				if ((p < end) && ((*p == '+') || (*p == '-')))
+					p++;
+				if ((p >= end) || !isdigit ((unsigned char)*p))
+					return NULL;
+				while ((p < end) && isdigit ((unsigned char)*p))
+					p++;
+			}
+			return (p > start) ? p : NULL;
+		}
+	}
+}
+
+static bool _JsonValidate (BodyJob_t *job)
+{
+	// Check the body is one well-formed JSON value (RFC 8259), so user
+	// code can refuse bad ones without parsing them on the reactor.
+	const char *end = job->Body + job->Length;
+	const char *p = _JsonValue (job->Body, end, 0);
+	if (!p || (_JsonSkip (p, end) != end)) {
+		job->Error = "json: malformed";
+		return false;
+	}
+	job->bJsonValid = true;
+	return true;
+}
+
+
+/************************
+WorkerPool_t::CheckStage
+************************/
+
+bool WorkerPool_t::CheckStage (const string &stage)
+{
+	string name = stage.substr (0, stage.find ('='));
+	#ifdef WITH_ZLIB
+	if (name == "inflate")
+		return true;
+	#endif
+	return (name == "crc32") || (name == "sha256") || (name == "multipart") || (name == "json");
+}
+
+
+/************************
+WorkerPool_t::_RunStages
+************************/
+
+void WorkerPool_t::_RunStages (BodyJob_t *job)
+{
+	char hex [16];
+	for (size_t i=0; i < job->Stages.size(); i++) {
+		const string &stage = job->Stages[i];
+		size_t eq = stage.find ('=');
+		string name = stage.substr (0, eq);
+		string arg = (eq == string::npos) ? string() : stage.substr (eq + 1);
+
+		bool ok = true;
+		if (name == "inflate")
+			ok = _Inflate (job);
+		else if (name == "crc32") {
+			snprintf (hex, sizeof(hex), "%08x", Crc32 ((const unsigned char*)job->Body, job->Length));
+			job->Digests.push_back (make_pair (name, string (hex)));
+		}
+		else if (name == "sha256")
+			job->Digests.push_back (make_pair (name, Sha256 ((const unsigned char*)job->Body, job->Length)));
+		else if (name == "multipart")
+			ok = _Multipart (job, arg);
+		else if (name == "json")
+			ok = _JsonValidate (job);
+		else {
+			job->Error = "unknown stage " + name;
+			ok = false;
+		}
+		if (!ok)
+			break;
+	}
+}
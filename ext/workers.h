@@ -0,0 +1,116 @@
+/*****************************************************************************
+
+File:     workers.h
+Date:     19Oct26
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+*****************************************************************************/
+
+
+#ifndef __WorkerPool__H_
+#define __WorkerPool__H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class HttpConnection_t;
+
+/****************
+struct BodyJob_t
+****************/
+
+struct BodyJob_t
+{
+	/* A request body and the stages to run over it. The body is malloc'd,
+	 * and belongs to the job. Stages that decode it (inflate) replace it,
+	 * and the others add to the results. If a stage fails, Error says why
+	 * and the rest are skipped.
+	 */
+	BodyJob_t(): Id (0), Body (NULL), Length (0), MaxLength (0), bJsonValid (false) {}
+	~BodyJob_t();
+
+	unsigned long Id;
+	std::vector<std::string> Stages;
+	std::string ContentType;
+	char *Body;
+	size_t Length;
+	size_t MaxLength;
+
+	std::string Error;
+	std::vector< std::pair<std::string, std::string> > Digests;
+	std::vector< std::pair<std::string, std::string> > Parts;
+	bool bJsonValid;
+};
+
+
+/********************
+class WorkerPool_t
+********************/
+
+class WorkerPool_t
+{
+	/* Native threads that run the CPU-heavy stages of request processing
+	 * (decompression, checksums, multipart splitting, JSON validation)
+	 * away from the reactor. They never touch Ruby, so they don't need
+	 * the GVL. Finished jobs are queued, and a byte is written to a pipe
+	 * the reactor watches, so it can collect them with Completed.
+	 *
+	 * Everything but the worker threads themselves runs on the reactor.
+	 */
+
+	public:
+		WorkerPool_t (int nthreads);
+		virtual ~WorkerPool_t();
+
+		unsigned long Submit (BodyJob_t*, HttpConnection_t *owner);
+		BodyJob_t *Completed();
+		HttpConnection_t *TakeOwner (unsigned long id);
+		void Forget (HttpConnection_t*);
+		void Stop();
+		int GetNotifyFd() const {return NotifyPipe[0];}
+		bool IsStopped() const {return bStop;}
+
+		static bool CheckStage (const std::string&);
+
+		// The pool connections use, if any.
+		static WorkerPool_t *Current;
+
+	private:
+		std::vector<std::thread> Threads;
+		std::mutex Lock;
+		std::condition_variable Ready;
+		std::deque<BodyJob_t*> Queue;
+		std::deque<BodyJob_t*> Done;
+		bool bStop;
+		int NotifyPipe[2];
+
+		unsigned long LastId;
+		std::map<unsigned long, HttpConnection_t*> Owners;
+
+	private:
+		WorkerPool_t (const WorkerPool_t&);
+		WorkerPool_t &operator= (const WorkerPool_t&);
+
+		void _Run();
+		static void _RunStages (BodyJob_t*);
+};
+
+#endif // __WorkerPool__H_
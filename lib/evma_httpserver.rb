@@ -32,4 +32,7 @@
 
 require 'eventmachine_httpserver'
 require 'evma_httpserver/response'
+require 'evma_httpserver/prefork'
+require 'evma_httpserver/workers'
+require 'evma_httpserver/channel'
 
@@ -0,0 +1,60 @@
+# EventMachine HTTP Server
+# Event channel backlogs
+#
+#----------------------------------------------------------------------------
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+#---------------------------------------------------------------------------
+#
+
+
+module EventMachine
+
+  # The channel itself is in the extension. Nothing tells it when a
+  # subscriber's outbound data has drained, so while it has subscribers
+  # we pump it from a periodic timer; otherwise a subscriber that hit
+  # high_water would stall until the next event is published. The timer
+  # stops when the last subscriber leaves, and starts again with the next.
+  #
+  class HttpEventChannel
+    PumpInterval = 0.1
+
+    # Seconds between pumps (default PumpInterval). Takes effect the next
+    # time the timer starts.
+    attr_writer :pump_interval
+
+    def subscribe conn
+      subscribe_connection conn
+      if !@pump_timer and EventMachine.reactor_running?
+        @pump_timer = EventMachine.add_periodic_timer(@pump_interval || PumpInterval) { pump_backlogs }
+      end
+      self
+    end
+
+    private
+
+    # Subscribers also leave when their connections close or are dropped,
+    # which the extension doesn't tell us about, so check on every tick.
+    def pump_backlogs
+      pump
+      if size == 0
+        @pump_timer.cancel
+        @pump_timer = nil
+      end
+    end
+  end
+
+end
@@ -0,0 +1,330 @@
+# EventMachine HTTP Server
+# Multi-process runner
+#
+#----------------------------------------------------------------------------
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+#---------------------------------------------------------------------------
+#
+
+require 'socket'
+require 'etc'
+
+module EventMachine
+  module HttpServer
+
+    # EventMachine runs one reactor per process, so to use every core we run
+    # one process per core. Prefork is a master process which forks a number
+    # of workers. Each worker runs its own reactor and binds its own listening
+    # socket with SO_REUSEPORT, so the kernel spreads incoming connections
+    # across the workers instead of waking all of them to race for each
+    # accept on a shared socket.
+    #
+    #   EM::HttpServer::Prefork.new("0.0.0.0", 8080, MyHttpServer,
+    #     :workers => 8, :cpu_affinity => true).run
+    #
+    # Options:
+    # :workers::          number of worker processes (default: one per CPU).
+    # :cpu_affinity::     pin worker N to CPU N (Linux only).
+    # :drain_timeout::    seconds a stopping worker waits for its open
+    #                     connections to finish (default 30).
+    # :backlog::          listen backlog of each worker's socket.
+    # :after_fork::       called in each worker, with its index, before its
+    #                     reactor starts. Reopen database connections here.
+    # :metrics_interval:: how often workers report to the master (seconds).
+    # :on_metrics::       called in the master with #metrics after each report.
+    #
+    # Signals to the master:
+    # TERM, INT:: stop accepting, let open connections finish, and exit.
+    # HUP::       start a fresh set of workers, and drain the old ones.
+    # USR1::      reopen the access and slow-request logs in every worker.
+    # USR2::      print #metrics to stderr.
+    #
+    # Access and slow-request logs opened before #run are reopened by each
+    # worker, since their writer threads don't survive the fork.
+    #
+    class Prefork
+      # A worker that dies sooner than StableTime after it was forked waits
+      # before its restart, starting at MinRestartDelay and doubling each
+      # time up to MaxRestartDelay, so one that can't start doesn't make us
+      # fork in a tight loop.
+      StableTime = 10
+      MinRestartDelay = 0.5
+      MaxRestartDelay = 60
+
+      def initialize host, port, handler, opts={}
+        unless Socket.const_defined?(:SO_REUSEPORT)
+          raise NotImplementedError, "SO_REUSEPORT is not available on this platform"
+        end
+
+        @host, @port, @handler = host, port, handler
+        @nworkers = opts[:workers] || Etc.nprocessors
+        @cpu_affinity = opts[:cpu_affinity]
+        @drain_timeout = opts[:drain_timeout] || 30
+        @backlog = opts[:backlog] || 1024
+        @after_fork = opts[:after_fork]
+        @metrics_interval = opts[:metrics_interval] || 1
+        @on_metrics = opts[:on_metrics]
+
+        @workers = {}   # pid => index
+        @retiring = {}  # pid => index, workers we've told to stop
+        @reports = {}   # pid => latest report
+        @spawned = {}   # index => when its worker was forked
+        @delays = {}    # index => how long its last restart waited
+        @restarts = {}  # index => when to restart it
+      end
+
+      # Requests, open connections and dropped access-log entries, summed over
+      # the workers that are running now. Workers that are draining after a
+      # HUP or TERM aren't counted.
+      def metrics
+        totals = {:workers => @workers.size, :requests => 0, :connections => 0, :access_log_dropped => 0}
+        @reports.each_value {|r|
+          totals[:requests] += r[:requests]
+          totals[:connections] += r[:connections]
+          totals[:access_log_dropped] += r[:access_log_dropped]
+        }
+        totals
+      end
+
+      # Fork the workers and supervise them until we're told to stop.
+      # Workers that die are replaced.
+      def run
+        # Bind once here, so a bad address or a port that's already taken
+        # is reported by the master instead of by every worker.
+        listen_socket.close
+
+        @sig_r, @sig_w = IO.pipe
+        @metrics_r, @metrics_w = IO.pipe
+        @signals = []
+        %w(TERM INT HUP USR1 USR2 CHLD).each {|sig|
+          trap(sig) {
+            @signals << sig
+            @sig_w.write_nonblock(".") rescue nil
+          }
+        }
+
+        @nworkers.times {|i| spawn_worker i }
+
+        buffer = ""
+        until @stopping and @workers.empty? and @retiring.empty?
+          timeout = @metrics_interval
+          unless @restarts.empty?
+            timeout = [timeout, @restarts.values.min - Time.now].min
+            timeout = 0 if timeout < 0
+          end
+          ready, = IO.select([@sig_r, @metrics_r], nil, nil, timeout)
+          if ready and ready.include?(@sig_r)
+            @sig_r.read_nonblock(1024) rescue nil
+          end
+          handle_signal(@signals.shift) until @signals.empty?
+
+          if ready and ready.include?(@metrics_r)
+            buffer << (@metrics_r.read_nonblock(64 * 1024) rescue "")
+            while line = buffer.slice!(/\A.*\n/)
+              record_report line
+            end
+            @on_metrics.call(metrics) if @on_metrics
+          end
+
+          reap
+          restart_due
+          if @stopping and Time.now > @kill_at
+            (@workers.keys + @retiring.keys).each {|pid| Process.kill(:KILL, pid) rescue nil }
+          end
+        end
+      ensure
+        %w(TERM INT HUP USR1 USR2 CHLD).each {|sig| trap(sig, "DEFAULT") }
+      end
+
+      #--
+      # Called from the connections in a worker.
+      def connection_opened; @active += 1; end
+      def connection_closed; @active -= 1; end
+
+      private
+
+      def handle_signal sig
+        case sig
+        when "TERM", "INT"
+          unless @stopping
+            @stopping = true
+            @kill_at = Time.now + @drain_timeout + 5
+            @retiring.update(@workers)
+            @workers.clear
+            @reports.clear
+            @restarts.clear
+            @retiring.each_key {|pid| Process.kill(:TERM, pid) rescue nil }
+          end
+        when "HUP"
+          unless @stopping
+            old = @workers.dup
+            @workers.clear
+            old.each {|pid, index|
+              spawn_worker index
+              @retiring[pid] = index
+              @reports.delete pid
+              Process.kill(:TERM, pid) rescue nil
+            }
+          end
+        when "USR1"
+          @workers.each_key {|pid| Process.kill(:USR1, pid) rescue nil }
+        when "USR2"
+          $stderr.puts "#{self.class.name} #{Process.pid}: #{metrics.inspect}"
+        end
+      end
+
+      def reap
+        while pid = (Process.wait(-1, Process::WNOHANG) rescue nil)
+          @reports.delete pid
+          if @retiring.delete(pid)
+            next
+          elsif index = @workers.delete(pid)
+            $stderr.puts "#{self.class.name} #{Process.pid}: worker #{index} died (#{$?.inspect})" unless $?.success?
+            schedule_restart index unless @stopping
+          end
+        end
+      end
+
+      def schedule_restart index
+        if Time.now - @spawned[index] >= StableTime
+          delay = 0
+        else
+          delay = [[(@delays[index] || 0) * 2, MinRestartDelay].max, MaxRestartDelay].min
+        end
+        @delays[index] = delay
+        @restarts[index] = Time.now + delay
+      end
+
+      def restart_due
+        now = Time.now
+        @restarts.select {|index, at| at <= now }.each_key {|index|
+          @restarts.delete index
+          spawn_worker index
+        }
+      end
+
+      def record_report line
+        pid, requests, connections, dropped = line.split.map {|v| v.to_i }
+        if @workers.has_key?(pid)
+          @reports[pid] = {:requests => requests, :connections => connections, :access_log_dropped => dropped}
+        end
+      end
+
+      def spawn_worker index
+        pid = fork {
+          @sig_r.close
+          @metrics_r.close
+          status = 0
+          begin
+            worker_main index
+          rescue Exception => e
+            $stderr.puts "worker #{index}: #{e.class}: #{e.message}"
+            status = 1
+          ensure
+            # exit! so we don't run the master's at_exit handlers.
+            HttpServer.close_access_log
+            HttpServer.close_slow_request_log
+            exit!(status)
+          end
+        }
+        @workers[pid] = index
+        @spawned[index] = Time.now
+      end
+
+      def worker_main index
+        @stop_requested = @reopen_requested = false
+        trap("TERM") { @stop_requested = true }
+        trap("INT") { @stop_requested = true }
+        trap("USR1") { @reopen_requested = true }
+        trap("HUP", "IGNORE")
+        %w(USR2 CHLD).each {|sig| trap(sig, "DEFAULT") }
+
+        HttpServer.set_cpu_affinity(index % Etc.nprocessors) if @cpu_affinity
+        HttpServer.reopen_access_log
+        @after_fork.call(index) if @after_fork
+
+        @active = 0
+        handler = tracked_handler
+        EventMachine.run {
+          sock = listen_socket
+          # The reactor owns the descriptor from here on.
+          sock.autoclose = false
+          signature = EventMachine.attach_server(sock, handler)
+
+          # Trap handlers can't safely touch the reactor, so they set
+          # flags which we poll here.
+          drain_until = nil
+          EventMachine.add_periodic_timer(0.1) {
+            if @reopen_requested
+              @reopen_requested = false
+              HttpServer.reopen_access_log
+            end
+            if @stop_requested and !drain_until
+              EventMachine.stop_server signature
+              drain_until = Time.now + @drain_timeout
+            end
+            if drain_until and (@active <= 0 or Time.now > drain_until)
+              report
+              EventMachine.stop
+            end
+          }
+          EventMachine.add_periodic_timer(@metrics_interval) { report }
+        }
+      end
+
+      def report
+        stats = HttpServer.access_log_stats
+        line = "#{Process.pid} #{HttpServer.request_count} #{@active} #{stats ? stats[:dropped] : 0}\n"
+        @metrics_w.write_nonblock(line)
+      rescue IO::WaitWritable, Errno::EPIPE
+        # The master is behind or gone. Metrics aren't worth blocking for.
+      end
+
+      # Subclass the handler so we can count open connections. A handler
+      # that's a module (as start_server allows) is mixed into a Connection.
+      def tracked_handler
+        runner = self
+        base = @handler
+        unless base.is_a?(Class)
+          mod = base
+          base = Class.new(EventMachine::Connection) { include mod }
+        end
+        Class.new(base) {
+          define_method(:post_init) {
+            super()
+            runner.connection_opened
+          }
+          define_method(:unbind) {|*args|
+            super(*args)
+            runner.connection_closed
+          }
+        }
+      end
+
+      def listen_socket
+        addr = Addrinfo.tcp(@host, @port)
+        sock = Socket.new(addr.afamily, Socket::SOCK_STREAM, 0)
+        sock.setsockopt(Socket::SOL_SOCKET, Socket::SO_REUSEADDR, true)
+        sock.setsockopt(Socket::SOL_SOCKET, Socket::SO_REUSEPORT, true)
+        sock.bind(addr)
+        sock.listen(@backlog)
+        sock
+      end
+    end
+
+  end
+end
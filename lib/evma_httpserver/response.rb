@@ -30,6 +30,8 @@
 #---------------------------------------------------------------------------
 #
 
+require 'securerandom'
+
 module EventMachine
 
   # This class provides a wide variety of features for generating and
@@ -94,14 +96,66 @@ module EventMachine
 
     attr_accessor :status, :headers, :chunks, :multiparts
 
-    def initialize
+    # The protocol of the request we're answering, as in @http_protocol.
+    # Chunks can't be sent to an HTTP/1.0 (or older) client.
+    attr_accessor :request_protocol
+
+    class << self
+      # Set this to true to give every response a Date header, unless it
+      # already has one. The value is formatted by the extension at most
+      # once a second.
+      attr_accessor :date_header
+    end
+
+    # The size of the reads we make when sending content from a file.
+    FileBlockSize = 64 * 1024
+    # We stop reading a file while EventMachine has this much queued on the
+    # connection, and look again after FileDrainInterval seconds. (The
+    # reactor's own stream_file_data can't send byte ranges.)
+    FileHighWater = 4 * FileBlockSize
+    FileDrainInterval = 0.01
+
+    # Pass the protocol of the request being answered (@http_protocol),
+    # so that #chunk knows whether the client can take chunks.
+    def initialize request_protocol=nil
       @headers = {}
+      @request_protocol = request_protocol
     end
 
     def content=(value) @content = value.to_s end
     def content()       @content || ''        end
     def content?()      !!@content            end
 
+    # Send the contents of the named file rather than a string. The file is
+    # read in blocks as the connection drains, and only the requested
+    # ranges are read. The trailer (and close) follow the last block.
+    def file=(path)     @file = path          end
+    def file()          @file                 end
+
+    # Honor the request's Range header (@http_range), and its If-Range
+    # header (@http_if_range) if any, when sending content or a file.
+    # Calling this also advertises "Accept-Ranges: bytes", so it can be
+    # called unconditionally by handlers that support ranges.
+    # If-Range is compared against the ETag or Last-Modified header, which
+    # must already be set on this response. The comparison is strong, so a
+    # weak ETag never matches. Ranges only apply to a 200 response.
+    def range spec, if_range=nil
+      @accept_ranges = true
+      @range = spec
+      @if_range = if_range
+    end
+
+    # Let the extension's response cache (see HttpServer.enable_response_cache)
+    # answer identical requests with this response for the next +ttl+
+    # seconds. If the response depends on request headers, name them: they
+    # become part of the cache key, and are sent in a Vary header. Only
+    # DelegatedHttpResponse can do this, since it needs the connection.
+    def cache_for ttl, *vary
+      @cache_ttl = ttl
+      @cache_vary = vary.flatten
+      @headers["Vary"] ||= @cache_vary.join(", ") unless @cache_vary.empty?
+    end
+
     def keep_connection_open arg=true
       @keep_connection_open = arg
     end
@@ -148,9 +202,53 @@ module EventMachine
     def send_response
       send_headers
       send_body
+      return if @event_stream or @cancelled
+      if @file_parts
+        @file_sent = proc { finish_response }
+      else
+        finish_response
+      end
+    end
+
+    def finish_response
       send_trailer
-      close_connection_after_writing unless (@keep_connection_open and (@status || "200 OK") == "200 OK")
+      close_connection_after_writing unless (@keep_connection_open and ["200 OK", "206 Partial Content"].include?(@status || "200 OK"))
+    end
+    private :finish_response
+
+    # The number of bytes queued to go out on the connection. Responses that
+    # have a connection underneath override this. See #send_file_parts.
+    def get_outbound_data_size
+      0
+    end
+
+    # Stop sending a file that's still going out, or chunks held back by
+    # #coalesce_chunks, because the connection has gone away.
+    # DelegatedHttpResponse does this when its connection unbinds. Other
+    # responses that send files or coalesce chunks should call it from the
+    # connection's unbind.
+    def cancel
+      @cancelled = true
+      cancel_chunk_timer
+      @chunk_buffer = nil
+      if @file_timer
+        EventMachine.cancel_timer @file_timer
+        @file_timer = nil
+      end
+      close_file
+      @file_sent = nil
+      unwatch_unbind
+    end
+
+    # Have #cancel called if the connection unbinds. Only a response that
+    # knows its connection can do this.
+    def watch_unbind
+    end
+    private :watch_unbind
+
+    def unwatch_unbind
     end
+    private :unwatch_unbind
 
     # Send the headers out in alpha-sorted order. This will degrade performance to some
     # degree, and is intended only to simplify the construction of unit tests.
@@ -192,10 +290,16 @@ module EventMachine
     # gets sent out, because the multipart boundary is created here.
     #
     def fixup_headers
-      if @content
-        @headers["Content-Length"] = @content.bytesize
+      @headers["Date"] ||= HttpServer.http_date if HttpResponse.date_header
+      if @event_stream
+        @headers["Content-Type"] ||= "text/event-stream"
+        @headers["Cache-Control"] ||= "no-cache"
+        # The stream ends when the connection closes, so it has no length.
+      elsif @content or @file
+        fixup_content_headers
       elsif @chunks
         @headers["Transfer-Encoding"] = "chunked"
+        @headers["Trailer"] = @trailers.keys.join(", ") if @trailers
         # Might be nice to ENSURE there is no content-length header,
         # but how to detect all the possible permutations of upper/lower case?
       elsif @multiparts
@@ -206,12 +310,74 @@ module EventMachine
       end
     end
 
+    # Work out the Content-Length, and the status and Content-Range in case
+    # of a range request, for a response whose body is a string or a file.
+    # A single range is sent as the body. Several ranges are sent as a
+    # multipart/byteranges body (RFC 7233 appendix A), whose part headers
+    # we build here so we can give an exact Content-Length.
+    #
+    def fixup_content_headers
+      @content_length = @file ? File.size(@file) : @content.bytesize
+      @headers["Accept-Ranges"] = "bytes" if @accept_ranges
+
+      ranges = nil
+      if @range and (@status || "200 OK") == "200 OK" and if_range_matches?
+        ranges = HttpServer.parse_byte_ranges(@range, @content_length)
+      end
+
+      if ranges.nil?
+        @headers["Content-Length"] = @content_length
+      elsif ranges.empty?
+        self.status = 416
+        @headers["Content-Range"] = "bytes */#{@content_length}"
+        @headers["Content-Length"] = 0
+        @byte_ranges = []
+      elsif ranges.length == 1
+        first, last = ranges.first
+        self.status = 206
+        @headers["Content-Range"] = "bytes #{first}-#{last}/#{@content_length}"
+        @headers["Content-Length"] = last - first + 1
+        @byte_ranges = ranges
+      else
+        boundary = self.class.concoct_multipart_boundary
+        part_type = @headers["Content-Type"]
+        @byte_ranges = ranges.map {|first, last|
+          head = "\r\n--#{boundary}\r\n"
+          head << "Content-Type: #{part_type}\r\n" if part_type
+          head << "Content-Range: bytes #{first}-#{last}/#{@content_length}\r\n\r\n"
+          [first, last, head]
+        }
+        @byte_ranges_epilog = "\r\n--#{boundary}--\r\n"
+        self.status = 206
+        @headers["Content-Type"] = "multipart/byteranges; boundary=#{boundary}"
+        @headers["Content-Length"] = @byte_ranges.inject(@byte_ranges_epilog.bytesize) {|n, (first, last, head)|
+          n + head.bytesize + (last - first + 1)
+        }
+      end
+    end
+    private :fixup_content_headers
+
+    # RFC 7233 3.2: If-Range needs a strong match, so weak validators
+    # on either side count as a mismatch and the whole entity is sent.
+    def if_range_matches?
+      return true if @if_range.nil?
+      return false if @if_range.start_with?("W/")
+      etag = @headers["ETag"]
+      (etag and !etag.start_with?("W/") and @if_range == etag) or @if_range == @headers["Last-Modified"]
+    end
+    private :if_range_matches?
+
     # we send either content, chunks, or multiparts. Content can only be sent once.
     # Chunks and multiparts can be sent any number of times.
     # DO NOT close the connection or send any goodbye kisses. This method can
     # be called multiple times to send out chunks or multiparts.
     def send_body
-      if @chunks
+      if @event_stream
+        if @event_retry
+          send_data "retry: #{@event_retry.to_i}\n\n"
+          @event_retry = nil
+        end
+      elsif @chunks
         send_chunks
       elsif @multiparts
         send_multiparts
@@ -243,7 +409,106 @@ module EventMachine
     def send_content
       raise "sent content already" if @sent_content
       @sent_content = true
-      send_data(content)
+      if @file
+        @file_parts = content_parts
+        send_file_parts
+      elsif @byte_ranges
+        content_parts.each {|part| part.is_a?(String) ? send_data(part) : send_content_range(*part) }
+      else
+        send_data(content)
+      end
+    end
+
+    # The body as a list of strings to send as they are and [first, last]
+    # byte ranges of the content or file.
+    def content_parts
+      if @byte_ranges.nil?
+        [[0, @content_length - 1]]
+      elsif @byte_ranges.length > 1
+        parts = []
+        @byte_ranges.each {|first, last, head| parts << head << [first, last] }
+        parts << @byte_ranges_epilog
+      else
+        @byte_ranges.map {|first, last| [first, last] }
+      end
+    end
+    private :content_parts
+
+    # Send the parts of a file response a block at a time, but only while
+    # less than FileHighWater is queued on the connection, so a big file
+    # is never read into memory at once. Otherwise we come back after
+    # FileDrainInterval, and #send_response waits for us to finish.
+    # If the file turns out shorter than the length we sent, the client
+    # can't tell where the response ends, so we close the connection.
+    def send_file_parts
+      @file_timer = nil
+      @file_io ||= File.open(@file, "rb")
+      while part = @file_parts.first
+        if part.is_a?(String)
+          send_data part
+        else
+          while part[0] <= part[1]
+            if get_outbound_data_size >= FileHighWater
+              watch_unbind
+              @file_timer = EventMachine.add_timer(FileDrainInterval) { send_file_parts }
+              return
+            end
+            @file_io.seek part[0]
+            unless data = @file_io.read([part[1] - part[0] + 1, FileBlockSize].min)
+              cancel
+              close_connection
+              return
+            end
+            send_data data
+            part[0] += data.bytesize
+          end
+        end
+        @file_parts.shift
+      end
+      close_file
+      unwatch_unbind
+      if done = @file_sent
+        @file_sent = nil
+        done.call
+      end
+    rescue
+      close_file
+      raise
+    end
+    private :send_file_parts
+
+    def close_file
+      @file_io.close if @file_io
+      @file_io = @file_parts = nil
+    end
+    private :close_file
+
+    # Send bytes first..last of the content, without copying any more of
+    # it than we have to.
+    def send_content_range first, last
+      if first == 0 and last == @content.bytesize - 1
+        send_data @content
+      else
+        send_data @content.byteslice(first, last - first + 1)
+      end
+    end
+    private :send_content_range
+
+    # Make this response a stream of Server-Sent Events. #send_response sends
+    # the headers (and the reconnection delay in milliseconds, if given) and
+    # leaves the connection open. Events then go out with #send_event, or
+    # through an EventMachine::HttpEventChannel the connection subscribes to,
+    # until the connection is closed.
+    def event_stream retry_ms=nil
+      @event_stream = true
+      @event_retry = retry_ms
+    end
+
+    # Send one event, framed by the extension. Multi-line data is sent as
+    # one data field per line.
+    def send_event data, event=nil, id=nil
+      send_headers unless @sent_headers
+      send_data HttpServer.encode_event(data, event, id)
     end
 
     # add a chunk to go to the output.
@@ -251,17 +516,36 @@ module EventMachine
     # Add the chunk to a list. Calling #send_chunks will send out the
     # available chunks and clear the chunk list WITHOUT closing the connection,
     # so it can be called any number of times.
-    # TODO!!! Per RFC2616, we may not send chunks to an HTTP/1.0 client.
-    # Raise an exception here if our user tries to do so.
+    # Per RFC2616, we may not send chunks to an HTTP/1.0 client, so this
+    # raises if #request_protocol says that's who we're talking to.
     # Chunked transfer coding is defined in RFC2616 pgh 3.6.1.
     # The argument can be a string or a hash. The latter allows for
     # sending chunks with extensions (someday).
     #
     def chunk text
+      if @request_protocol.to_s =~ /\AHTTP\/(0\.9|1\.0)\z/i
+        raise "can't send chunks to an #{@request_protocol} client"
+      end
       @chunks ||= []
       @chunks << text
     end
 
+    # Add a header to send after the last chunk. Trailers added before the
+    # headers are sent are announced in a Trailer header.
+    def trailer name, value
+      @trailers ||= {}
+      @trailers[name] = value
+    end
+
+    # Hold encoded chunks back until there are at least +bytes+ of them,
+    # or until +latency+ seconds after the first was held, and then send
+    # them in one write. Streams of many small chunks otherwise cost a
+    # write each. The last chunk is never held.
+    def coalesce_chunks bytes, latency=0.05
+      @coalesce_bytes = bytes
+      @coalesce_latency = latency
+    end
+
     # send the contents of the chunk list and clear it out.
     # ASSUMES that headers have been sent.
     # Does NOT close the connection.
@@ -271,19 +555,63 @@ module EventMachine
     # of the stream. If that should happen, raise an exception.
     # The reason for supporting chunks that are hashes instead of just strings
     # is to enable someday supporting chunk-extension codes (cf the RFC).
-    # TODO!!! We're not supporting the final entity-header that may be
-    # transmitted after the last (zero-length) chunk.
+    # The chunks are encoded by the extension (with byte, not character,
+    # lengths) into a single write, which the last chunk follows with any
+    # #trailer headers.
     #
     def send_chunks
       send_headers unless @sent_headers
-      while chunk = @chunks.shift
-        raise "last chunk already sent" if @last_chunk_sent
-        text = chunk.is_a?(Hash) ? chunk[:text] : chunk.to_s
-        send_data "#{format("%x", text.length).upcase}\r\n#{text}\r\n"
-        @last_chunk_sent = true if text.length == 0
+      return if @chunks.empty?
+      raise "last chunk already sent" if @last_chunk_sent
+
+      texts = @chunks.map {|chunk| chunk.is_a?(Hash) ? chunk[:text].to_s : chunk.to_s }
+      @chunks.clear
+      last = texts.index {|text| text.empty? }
+      raise "last chunk already sent" if last and last < texts.length - 1
+      data = HttpServer.encode_chunks(texts, @trailers)
+      @last_chunk_sent = texts.last.empty?
+
+      if @coalesce_bytes and !@last_chunk_sent
+        (@chunk_buffer ||= "".b) << data
+        if @chunk_buffer.bytesize >= @coalesce_bytes
+          flush_chunks
+        else
+          unless @chunk_timer
+            watch_unbind
+            @chunk_timer = EventMachine.add_timer(@coalesce_latency) {
+              @chunk_timer = nil
+              flush_chunks
+            }
+          end
+        end
+      else
+        if @chunk_buffer
+          data = @chunk_buffer << data
+          @chunk_buffer = nil
+        end
+        cancel_chunk_timer
+        send_data data
+      end
+    end
+
+    # Send any chunks held back by #coalesce_chunks now.
+    def flush_chunks
+      cancel_chunk_timer
+      if @chunk_buffer and !@chunk_buffer.empty?
+        data, @chunk_buffer = @chunk_buffer, nil
+        send_data data
       end
     end
 
+    def cancel_chunk_timer
+      if @chunk_timer
+        EventMachine.cancel_timer @chunk_timer
+        @chunk_timer = nil
+      end
+      unwatch_unbind
+    end
+    private :cancel_chunk_timer
+
     # To add a multipart to the outgoing response, specify the headers and the
     # body. If only a string is given, it's treated as the body (in this case,
     # the header is assumed to be empty).
@@ -315,7 +643,7 @@ module EventMachine
       end
     end
 
-    # TODO, this is going to be way too slow. Cache up the uuidgens.
+    # The guid is regenerated every thousand boundaries.
     #
     def self.concoct_multipart_boundary
       @multipart_index ||= 0
@@ -324,7 +652,7 @@ module EventMachine
         @multipart_index = 0
         @multipart_guid = nil
       end
-      @multipart_guid ||= `uuidgen -r`.chomp.gsub(/\-/,"")
+      @multipart_guid ||= SecureRandom.hex(16)
       "#{@multipart_guid}#{@multipart_index}"
     end
 
@@ -349,8 +677,38 @@ module EventMachine
       :close_connection_after_writing
 
     def initialize dele
-      super()
+      super(dele.instance_variable_get(:@http_protocol))
       @delegate = dele
     end
+
+    def get_outbound_data_size
+      @delegate.respond_to?(:get_outbound_data_size) ? @delegate.get_outbound_data_size : 0
+    end
+
+    def watch_unbind
+      if !@unbind_callback and @delegate.respond_to?(:add_unbind_callback)
+        @unbind_callback = @delegate.add_unbind_callback { cancel }
+      end
+    end
+    private :watch_unbind
+
+    def unwatch_unbind
+      @delegate.remove_unbind_callback @unbind_callback if @unbind_callback
+      @unbind_callback = nil
+    end
+    private :unwatch_unbind
+
+    # A response marked with #cache_for is captured by the connection as
+    # it's sent. Only successful responses are cached, and not files, which
+    # may still be going out after #send_response returns. Nor are answers
+    # to range requests, which are only right for the client that asked.
+    def send_response
+      if @cache_ttl and @delegate.is_a?(HttpServer) and (@status || "200 OK") == "200 OK" and !@file and
+          !@range and !@delegate.instance_variable_get(:@http_range)
+        @delegate.cache_response(@cache_ttl, @cache_vary) { super }
+      else
+        super
+      end
+    end
   end
 end
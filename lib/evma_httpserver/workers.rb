@@ -0,0 +1,63 @@
+# EventMachine HTTP Server
+# Body worker threads
+#
+#----------------------------------------------------------------------------
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+#
+#---------------------------------------------------------------------------
+#
+
+
+require 'etc'
+
+module EventMachine
+  module HttpServer
+
+    # Start the native threads that run body stages (see #body_stages and
+    # HttpServer.process_body), and have the reactor deliver their results.
+    # Call this inside EventMachine.run, and in each worker when you use
+    # Prefork, since threads don't survive a fork.
+    #
+    #   EventMachine.run {
+    #     EM::HttpServer.body_workers 4
+    #     EventMachine.start_server "0.0.0.0", 8080, MyHttpServer
+    #   }
+    #
+    def self.body_workers nthreads = Etc.nprocessors
+      fd = start_body_workers(nthreads)
+      io = IO.for_fd(fd, :autoclose => false)
+      @body_watch = EventMachine.watch(io, BodyCompletions)
+      @body_watch.notify_readable = true
+      @body_watch
+    end
+
+    # Stop the body workers after delivering whatever they've finished.
+    def self.stop_body_workers!
+      if @body_watch
+        @body_watch.detach
+        @body_watch = nil
+      end
+      stop_body_workers
+    end
+
+    module BodyCompletions # :nodoc:
+      def notify_readable
+        HttpServer.run_body_completions
+      end
+    end
+
+  end
+end
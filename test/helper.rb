@@ -0,0 +1,72 @@
+require 'test/unit'
+require 'evma_httpserver'
+
+begin
+  once = false
+  require 'eventmachine'
+rescue LoadError => e
+  raise e if once
+  once = true
+  require 'rubygems'
+  retry
+end
+
+
+#--------------------------------------
+
+
+# A connection for driving HttpServer without a reactor. What's sent is
+# kept rather than written, and the calls that EventMachine would pass
+# on to a real socket (pausing, closing, asking how much is still
+# queued) are answered here, so the tests don't depend on how they
+# behave without a signature. Anything that needs the reactor itself is
+# tested over loopback in test_app.rb.
+#
+#   class Server < TestConnection
+#     include EM::HttpServer
+#   end
+#   s = Server.open
+#   s.receive_data "GET / HTTP/1.1\r\n\r\n"
+#   s.out # => "HTTP/1.1 200 ..."
+
+class TestConnection < EM::Connection
+  attr_reader :out, :sent, :closed
+  attr_accessor :outbound
+
+  # Each connection gets its own subclass: post_init wraps the native
+  # connection in an object of the connection's class, after which Ruby
+  # won't allocate another instance of that class.
+  def self.open
+    Class.new(self).new(nil)
+  end
+
+  def send_data data
+    (@out ||= "".b) << data
+    (@sent ||= []) << data
+    data.bytesize
+  end
+
+  def close_connection after_writing=false
+    @closed = after_writing ? :after : :now
+  end
+
+  def close_connection_after_writing
+    @closed = :after
+  end
+
+  def pause
+    @paused = true
+  end
+
+  def resume
+    @paused = false
+  end
+
+  def paused?
+    !!@paused
+  end
+
+  def get_outbound_data_size
+    @outbound || 0
+  end
+end
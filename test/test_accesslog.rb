@@ -0,0 +1,105 @@
+require File.expand_path('../helper', __FILE__)
+require 'tmpdir'
+
+
+#--------------------------------------
+
+
+class TestAccessLog < Test::Unit::TestCase
+
+  class Server < TestConnection
+    include EM::HttpServer
+    def post_init
+      super
+      no_environment_strings
+    end
+    def process_http_request
+      send_data "HTTP/1.1 201 Created\r\nContent-Length: 2\r\n\r\n"
+      send_data "ok"
+    end
+  end
+
+  def teardown
+    EM::HttpServer.close_access_log
+  end
+
+  def request target
+    s = Server.open
+    s.receive_data "GET #{target} HTTP/1.1\r\n\r\n"
+    yield if block_given?
+    s.unbind
+  end
+
+  def wait_for_written n
+    20.times {
+      return if EM::HttpServer.access_log_stats[:written] >= n
+      sleep 0.05
+    }
+    flunk "access log writer stalled"
+  end
+
+  def test_format
+    Dir.mktmpdir {|dir|
+      path = File.join(dir, "access.log")
+      EM::HttpServer.open_access_log path, "%m|%U|%q|%H|%s|%O|%D|%%|%x|%t"
+      request("/a/b?x=1") { sleep 0.05 }
+      request("/c")
+      EM::HttpServer.close_access_log
+      assert_nil( EM::HttpServer.access_log_stats )
+
+      first, second = File.readlines(path)
+      fields = first.chomp.split("|")
+      assert_equal( ["GET", "/a/b", "?x=1", "HTTP/1.1", "201", "45"], fields[0, 6] )
+      # The time taken stops at the last byte of the response, not when
+      # the request gets logged.
+      assert( fields[6].to_i < 50_000, fields[6] )
+      assert_equal( ["%", "%x"], fields[7, 2] )
+      assert_match( /\A\[\d\d\/\w{3}\/\d{4}:\d\d:\d\d:\d\d [-+]\d{4}\]\z/, fields[9] )
+      assert_equal( ["GET", "/c", "", "HTTP/1.1"], second.split("|")[0, 4] )
+    }
+  end
+
+  def test_reopen
+    Dir.mktmpdir {|dir|
+      path = File.join(dir, "access.log")
+      EM::HttpServer.open_access_log path, "%U"
+      request "/before"
+      wait_for_written 1
+      File.rename path, path + ".1"
+      EM::HttpServer.reopen_access_log
+      20.times { break if File.exist?(path); sleep 0.05 }
+      request "/after"
+      EM::HttpServer.close_access_log
+
+      assert_equal( "/before\n", File.read(path + ".1") )
+      assert_equal( "/after\n", File.read(path) )
+    }
+  end
+
+  def test_dropped
+    omit( "needs a FIFO" ) unless File.respond_to?(:mkfifo)
+    Dir.mktmpdir {|dir|
+      # Nobody reads the FIFO at first, so the writer thread blocks once
+      # the pipe is full and the ring (4 entries) then overflows.
+      path = File.join(dir, "access.fifo")
+      File.mkfifo path
+      reader = File.open(path, File::RDONLY | File::NONBLOCK)
+      EM::HttpServer.open_access_log path, "%U", 4
+
+      target = "/" + "x" * 400
+      1000.times { request target }
+      stats = EM::HttpServer.access_log_stats
+      assert( stats[:dropped] > 0 )
+
+      # Drain the pipe so the writer can finish, then close the log.
+      lines = 0
+      drain = Thread.new { reader.each_line { lines += 1 } }
+      sleep 0.2
+      EM::HttpServer.close_access_log
+      drain.join
+      reader.close
+      assert_equal( 1000 - stats[:dropped], lines )
+    }
+  end
+
+end
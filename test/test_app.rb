@@ -236,4 +236,254 @@ EORESP
     assert_equal( received_content_type, content_type )
   end
 
+
+
+  class ExpectTestServer < EventMachine::Connection
+    include EventMachine::HttpServer
+    def post_init
+      super
+      max_content_length 1000
+    end
+    def generate_response
+      TestResponse_1
+    end
+  end
+
+  def test_expect_continue
+    continue_line = nil
+    accepted_response = nil
+    rejected_response = nil
+
+    EventMachine.run do
+      EventMachine.start_server TestHost, TestPort, ExpectTestServer
+      EventMachine.add_timer(1) {raise "timed out"} # make sure the test completes
+
+      cb = proc do
+        tcp = TCPSocket.new TestHost, TestPort
+        tcp.write "POST / HTTP/1.1\r\nExpect: 100-continue\r\nContent-length: 4\r\n\r\n"
+        continue_line = tcp.gets + tcp.gets
+        tcp.write "1234"
+        accepted_response = tcp.read
+
+        tcp = TCPSocket.new TestHost, TestPort
+        tcp.write "POST / HTTP/1.1\r\nExpect: 100-continue\r\nContent-length: 2000\r\n\r\n"
+        rejected_response = tcp.read
+      end
+      eb = proc { EventMachine.stop }
+      EventMachine.defer cb, eb
+    end
+
+    assert_equal( "HTTP/1.1 100 Continue\r\n\r\n", continue_line )
+    assert_equal( TestResponse_1, accepted_response )
+    assert_match( /\AHTTP\/1.1 413 /, rejected_response )
+  end
+
+
+  class StreamTestServer < EventMachine::Connection
+    include EventMachine::HttpServer
+    attr_reader :slices, :progress, :paused
+    def post_init
+      super
+      dont_accumulate_post
+      reuse_post_data_buffer
+      @slices = []
+      @progress = []
+    end
+    def receive_post_data data
+      @slices << data.dup
+      @progress << post_data_progress
+      if @slices.length == 1
+        pause_post_data
+        @paused = post_data_paused?
+        EventMachine.add_timer(0.2) { resume_post_data }
+      end
+    end
+    def process_http_request
+      send_data TestResponse_1
+      close_connection_after_writing
+    end
+  end
+
+  def test_streamed_post
+    server = nil
+    response = nil
+    parts = ["a" * 100, "b" * 100, "c" * 100]
+
+    EventMachine.run do
+      EventMachine.start_server(TestHost, TestPort, StreamTestServer) {|conn| server = conn }
+      EventMachine.add_timer(2) {raise "timed out"} # make sure the test completes
+
+      cb = proc do
+        tcp = TCPSocket.new TestHost, TestPort
+        tcp.write "POST / HTTP/1.1\r\nContent-length: 300\r\n\r\n#{parts[0]}"
+        parts[1..-1].each {|part|
+          sleep 0.05
+          tcp.write part
+        }
+        response = tcp.read
+      end
+      eb = proc { EventMachine.stop }
+      EventMachine.defer cb, eb
+    end
+
+    assert_equal( TestResponse_1, response )
+    assert( server.paused )
+    # The copies survive the buffer being refilled for later slices.
+    assert_equal( parts[0], server.slices.first )
+    assert_equal( parts.join, server.slices.join )
+    # Progress is taken as each slice arrives, before it's counted.
+    offsets = server.slices.inject([0]) {|a, slice| a << a.last + slice.bytesize }
+    assert_equal( offsets[0..-2].map {|n| [n, 300] }, server.progress )
+  end
+
+
+  class WebSocketTestServer < EventMachine::Connection
+    include EventMachine::HttpServer
+    def post_init
+      super
+      accept_websockets
+    end
+    def receive_websocket_message msg
+      send_websocket_message msg.upcase
+      close_websocket
+    end
+  end
+
+  def test_websocket_echo
+    handshake = nil
+    frames = nil
+
+    EventMachine.run do
+      EventMachine.start_server TestHost, TestPort, WebSocketTestServer
+      EventMachine.add_timer(1) {raise "timed out"} # make sure the test completes
+
+      cb = proc do
+        tcp = TCPSocket.new TestHost, TestPort
+        tcp.write [
+          "GET /chat HTTP/1.1\r\n",
+          "Upgrade: websocket\r\n",
+          "Connection: Upgrade\r\n",
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n",
+          "Sec-WebSocket-Version: 13\r\n",
+          "\r\n"
+        ].join
+        handshake = ""
+        handshake << tcp.gets until handshake.end_with?("\r\n\r\n")
+        # A masked text frame, "hi", with the mask 1,2,3,4.
+        tcp.write [0x81, 0x82, 1, 2, 3, 4, "h".ord ^ 1, "i".ord ^ 2].pack("C*")
+        frames = tcp.read
+      end
+      eb = proc { EventMachine.stop }
+      EventMachine.defer cb, eb
+    end
+
+    assert_match( /\AHTTP\/1.1 101 Switching Protocols\r\n/, handshake )
+    assert_match( /^Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK\+xOo=\r$/, handshake )
+    assert_equal( [0x81, 2, "H".ord, "I".ord, 0x88, 2, 0x03, 0xE8].pack("C*"), frames )
+  end
+
+
+  class WorkerTestServer < EventMachine::Connection
+    include EventMachine::HttpServer
+    attr_reader :paused
+    def post_init
+      super
+      body_stages "crc32"
+      @paused = []
+    end
+    def process_http_request
+      @paused << paused?
+      send_data "HTTP/1.1 200 OK\r\nContent-Length: 8\r\n\r\n#{@http_body_results["crc32"]}"
+    end
+  end
+
+  def test_parked_on_workers
+    server = nil
+    response = nil
+    paused_after = nil
+
+    EventMachine.run do
+      EventMachine::HttpServer.body_workers 2
+      EventMachine.start_server(TestHost, TestPort, WorkerTestServer) {|conn| server = conn }
+      EventMachine.add_timer(2) {raise "timed out"} # make sure the test completes
+
+      cb = proc do
+        tcp = TCPSocket.new TestHost, TestPort
+        tcp.write "POST /a HTTP/1.1\r\nContent-length: 3\r\n\r\nabc" +
+          "POST /b HTTP/1.1\r\nContent-length: 3\r\n\r\ndef"
+        response = tcp.read(92)
+        tcp.close
+      end
+      eb = proc {
+        paused_after = server.paused?
+        EventMachine::HttpServer.stop_body_workers!
+        EventMachine.stop
+      }
+      EventMachine.defer cb, eb
+    end
+
+    # The socket stays paused while each body is with the workers, and is
+    # read again once the handler has run.
+    one = "HTTP/1.1 200 OK\r\nContent-Length: 8\r\n\r\n"
+    assert_equal( "#{one}352441c2#{one}0cc4e161", response )
+    assert_equal( [true, true], server.paused )
+    assert( !paused_after )
+  end
+
+
+  class CacheTestServer < EventMachine::Connection
+    include EventMachine::HttpServer
+    class << self
+      attr_accessor :calls, :conns
+    end
+    def post_init
+      super
+      CacheTestServer.conns << self
+    end
+    def process_http_request
+      CacheTestServer.calls += 1
+      response = EventMachine::DelegatedHttpResponse.new(self)
+      response.content = "call #{CacheTestServer.calls}"
+      response.cache_for 60
+      # Held, so that the second request waits on it.
+      EventMachine.add_timer(0.3) { response.send_response }
+    end
+  end
+
+  def test_parked_on_cache
+    CacheTestServer.calls = 0
+    CacheTestServer.conns = []
+    responses = []
+    paused_while_waiting = nil
+    paused_after = nil
+
+    EventMachine.run do
+      EventMachine::HttpServer.enable_response_cache
+      EventMachine.start_server TestHost, TestPort, CacheTestServer
+      EventMachine.add_timer(2) {raise "timed out"} # make sure the test completes
+      EventMachine.add_timer(0.2) { paused_while_waiting = CacheTestServer.conns.map {|c| c.paused? } }
+
+      cb = proc do
+        tcps = (1..2).map {|i|
+          tcp = TCPSocket.new TestHost, TestPort
+          tcp.write "GET /a HTTP/1.1\r\n\r\n"
+          sleep 0.05
+          tcp
+        }
+        responses = tcps.map {|tcp| tcp.read }
+      end
+      eb = proc {
+        paused_after = CacheTestServer.conns.map {|c| c.paused? }
+        EventMachine::HttpServer.disable_response_cache
+        EventMachine.stop
+      }
+      EventMachine.defer cb, eb
+    end
+
+    assert_equal( 1, CacheTestServer.calls )
+    responses.each {|r| assert_match( /\r\n\r\ncall 1\z/, r ) }
+    assert_equal( [false, true], paused_while_waiting )
+    assert_equal( [false, false], paused_after )
+  end
+
 end
@@ -0,0 +1,176 @@
+require File.expand_path('../helper', __FILE__)
+
+
+#--------------------------------------
+
+
+class TestResponseCache < Test::Unit::TestCase
+
+  # Answers every request (unless told to hold it) with a count of the
+  # requests that reached it.
+  class Server < TestConnection
+    include EM::HttpServer
+    class << self
+      attr_accessor :calls, :hold, :ttl
+    end
+    def post_init
+      super
+      no_environment_strings
+    end
+    def process_http_request
+      Server.calls += 1
+      raise "waiter failed" if @http_headers.include?("X-Fail")
+      if @http_path_info == "/partial"
+        # Straight to the capture, past DelegatedHttpResponse's checks.
+        cache_response(Server.ttl) { send_data "HTTP/1.1 206 Partial Content\r\nContent-Length: 1\r\n\r\nx" }
+        return
+      end
+      @response = EM::DelegatedHttpResponse.new(self)
+      @response.content = "call #{Server.calls}"
+      @response.range @http_range if @http_range
+      @response.cache_for Server.ttl, "Accept-Language"
+      @response.keep_connection_open
+      @response.send_response unless Server.hold
+    end
+    def finish
+      @response.send_response
+    end
+  end
+
+  def setup
+    Server.calls = 0
+    Server.hold = false
+    Server.ttl = 60
+    EM::HttpServer.enable_response_cache
+  end
+
+  def teardown
+    EM::HttpServer.disable_response_cache
+  end
+
+  def request path, lang="en", extra=""
+    s = Server.open
+    s.receive_data "GET #{path} HTTP/1.1\r\nAccept-Language: #{lang}\r\n#{extra}\r\n"
+    s
+  end
+
+  def test_hit
+    assert_match( /call 1\z/, request("/a").out )
+    assert_match( /call 1\z/, request("/a").out )
+    assert_match( /Vary: Accept-Language\r\n/, request("/a").out )
+    assert_match( /call 2\z/, request("/a?x").out )
+    assert_match( /call 3\z/, request("/a", "fr").out )
+    assert_equal( 3, Server.calls )
+    assert_equal( 2, EM::HttpServer.response_cache_stats[:hits] )
+  end
+
+  def test_eviction
+    EM::HttpServer.enable_response_cache nil, 2
+    request("/a")
+    request("/b")
+    request("/a")
+    # /b is the least recently used, so it makes way for /c.
+    request("/c")
+    assert_match( /call 1\z/, request("/a").out )
+    assert_match( /call 4\z/, request("/b").out )
+    stats = EM::HttpServer.response_cache_stats
+    assert_equal( [2, 2], stats.values_at(:responses, :evicted) )
+
+    # The byte limit evicts the same way.
+    size = stats[:bytes] / 2
+    EM::HttpServer.enable_response_cache size * 2 + 1
+    Server.calls = 0
+    %w(/a /b /a /c /a /b).each {|path| request(path) }
+    assert_equal( 4, Server.calls )
+    assert( EM::HttpServer.response_cache_stats[:bytes] <= size * 2 + 1 )
+  end
+
+  def test_coalescing
+    Server.ttl = 0.05
+    request("/b")
+    sleep 0.1
+
+    # The entry has expired. The first request refreshes it, and the
+    # others wait for its response rather than computing their own.
+    Server.hold = true
+    leader = request("/b")
+    waiters = [request("/b"), request("/b")]
+    assert_equal( 2, Server.calls )
+    assert_equal( [nil, nil], waiters.map {|w| w.out } )
+    assert_equal( [true, true], waiters.map {|w| w.paused? } )
+
+    leader.finish
+    assert_match( /call 2\z/, leader.out )
+    waiters.each {|w| assert_match( /call 2\z/, w.out ) }
+    assert_equal( [false, false], waiters.map {|w| w.paused? } )
+    assert_equal( 2, Server.calls )
+    assert_equal( 2, EM::HttpServer.response_cache_stats[:coalesced] )
+  end
+
+  def test_ranges_not_cached
+    assert_match( /\AHTTP\/1.1 206 .*\r\n\r\nal\z/m, request("/d", "en", "Range: bytes=1-2\r\n").out )
+    assert_match( /\AHTTP\/1.1 206 .*\r\n\r\nal\z/m, request("/d", "en", "Range: bytes=1-2\r\n").out )
+    assert_match( /call 3\z/, request("/d").out )
+    assert_equal( 3, Server.calls )
+
+    request("/partial")
+    request("/partial")
+    assert_equal( 5, Server.calls )
+    assert_equal( 1, EM::HttpServer.response_cache_stats[:entries] )
+  end
+
+  def test_leader_collected
+    Server.ttl = 0.05
+    request("/e")
+    sleep 0.1
+
+    # The leader is freed without an unbind, as the GC would. Its waiter
+    # isn't handed back from there, where user code can't run, but
+    # afterwards.
+    Server.hold = true
+    leader = request("/e")
+    waiter = request("/e")
+    Server.hold = false
+    leader.send :free_http_connection
+    assert_nil( waiter.out )
+    EM::HttpServer.release_cache_waiters
+    assert_match( /call 3\z/, waiter.out )
+  end
+
+  def test_uncacheable_refresh
+    Server.ttl = 0.05
+    request("/c")
+    sleep 0.1
+
+    Server.hold = true
+    leader = request("/c")
+    waiter = request("/c")
+    Server.hold = false
+
+    # Sent without cache_response, so the waiter goes through itself.
+    leader.send_data "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n"
+    assert_match( /call 3\z/, waiter.out )
+  end
+
+  def test_raising_waiter
+    Server.ttl = 0.05
+    request("/f")
+    sleep 0.1
+
+    Server.hold = true
+    leader = request("/f")
+    failing = request("/f", "en", "X-Fail: 1\r\n")
+    waiter = request("/f")
+    Server.hold = false
+
+    # Both waiters go through to user code. The first raises, but the
+    # second is still handed back before the error reaches the leader.
+    e = assert_raises( RuntimeError ) {
+      leader.send_data "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n"
+    }
+    assert_equal( "waiter failed", e.message )
+    assert_nil( failing.out )
+    assert_match( /call 4\z/, waiter.out )
+  end
+
+end
@@ -0,0 +1,41 @@
+require File.expand_path('../helper', __FILE__)
+
+
+#--------------------------------------
+
+
+class TestCookies < Test::Unit::TestCase
+
+  class Server < TestConnection
+    include EM::HttpServer
+    attr_reader :seen
+    def process_http_request
+      @seen = [cookie("sid"), cookie("none"), cookies]
+    end
+  end
+
+  def test_parse_cookies
+    h = EM::HttpServer.parse_cookies(%Q(a=1; b = "two words" ;c=x%3Dy%2;=bad; flag; a=3))
+    assert_equal( {"a" => "1", "b" => "two words", "c" => "x=y%2"}, h )
+    assert_equal( {}, EM::HttpServer.parse_cookies(nil) )
+    assert_equal( {}, EM::HttpServer.parse_cookies("") )
+  end
+
+  def test_multiple_cookie_headers
+    s = Server.open
+    s.no_environment_strings
+    s.receive_data [
+      "GET / HTTP/1.1\r\n",
+      "Cookie: theme=dark; sid=abc%20def\r\n",
+      "Host: example.com\r\n",
+      "Cookie: lang=en; sid=second\r\n",
+      "\r\n"
+    ].join
+
+    assert_equal( "abc def", s.seen[0] )
+    assert_nil( s.seen[1] )
+    assert_equal( {"theme" => "dark", "sid" => "abc def", "lang" => "en"}, s.seen[2] )
+    assert_equal( "theme=dark; sid=abc%20def; lang=en; sid=second", s.instance_variable_get(:@http_cookie) )
+  end
+
+end
@@ -0,0 +1,161 @@
+require File.expand_path('../helper', __FILE__)
+
+
+#--------------------------------------
+
+
+class TestServerSentEvents < Test::Unit::TestCase
+
+  class Server < TestConnection
+    include EM::HttpServer
+    def post_init
+      super
+      no_environment_strings
+    end
+    def process_http_request
+      @response = EM::DelegatedHttpResponse.new(self)
+      @response.event_stream 2000
+      @response.send_response
+    end
+    def response; @response; end
+  end
+
+  def connect
+    s = Server.open
+    s.receive_data "GET /events HTTP/1.1\r\n\r\n"
+    s
+  end
+
+  def test_encode_event
+    assert_equal( "data: hi\n\n", EM::HttpServer.encode_event("hi") )
+    assert_equal( "event: tick\nid: 7\ndata: a\ndata: b\ndata: \ndata: c\n\n",
+      EM::HttpServer.encode_event("a\r\nb\n\rc", "tick", "7") )
+    assert_raises( ArgumentError ) { EM::HttpServer.encode_event("x", "bad\nname") }
+  end
+
+  def test_stream
+    s = connect
+    head, retry_hint = s.sent
+    assert_match( /\AHTTP\/1.1 200 OK\r\n/, head )
+    assert_match( /^Content-Type: text\/event-stream\r\n/, head )
+    assert_no_match( /Content-Length/, head )
+    assert_equal( "retry: 2000\n\n", retry_hint )
+    assert_nil( s.closed )
+
+    s.response.send_event "hello", "greeting"
+    assert_equal( "event: greeting\ndata: hello\n\n", s.sent.last )
+  end
+
+  def test_channel
+    channel = EM::HttpEventChannel.new(100, 50)
+    conns = (1..3).map { connect }
+    conns.each {|c| channel.subscribe c }
+    assert_equal( 3, channel.publish("one") )
+
+    # Framed once, and the same String goes to everyone.
+    sent = conns.map {|c| c.sent.last }
+    assert_equal( "data: one\n\n", sent[0] )
+    assert( sent.all? {|x| x.equal?(sent[0]) } )
+
+    # A backed-up connection queues events, and is dropped once it's
+    # more than 100 bytes behind.
+    slow = conns[2]
+    slow.outbound = 50
+    channel.publish "two"
+    assert_equal( "data: one\n\n", slow.sent.last )
+    slow.outbound = 0
+    channel.pump
+    assert_equal( "data: two\n\n", slow.sent.last )
+
+    slow.outbound = 50
+    10.times {|i| channel.publish "event #{i}" }
+    assert_equal( :now, slow.closed )
+    assert_equal( 2, channel.size )
+    assert_equal( 1, channel.stats[:dropped] )
+
+    conns[1].unbind
+    assert_equal( 1, channel.publish("three") )
+    assert( channel.unsubscribe(conns[0]) )
+    assert_equal( 0, channel.size )
+  end
+
+  def test_backlog_waits_for_publish_or_pump
+    channel = EM::HttpEventChannel.new(1000, 50)
+    c = connect
+    channel.subscribe c
+    c.outbound = 50
+    channel.publish "one"
+    sent = c.sent.length
+
+    # The connection drains, but nobody tells the channel.
+    c.outbound = 0
+    assert_equal( sent, c.sent.length )
+    assert_equal( 11, channel.stats[:queued_bytes] )
+
+    # The next event takes the backlog with it.
+    channel.publish "two"
+    assert_equal( ["data: one\n\n", "data: two\n\n"], c.sent[sent..-1] )
+
+    c.outbound = 50
+    channel.publish "three"
+    c.outbound = 0
+    channel.pump
+    assert_equal( "data: three\n\n", c.sent.last )
+    assert_equal( 0, channel.stats[:queued_bytes] )
+  end
+
+  class Timer
+    attr_reader :interval, :block, :cancelled
+    def initialize interval, block
+      @interval, @block = interval, block
+    end
+    def cancel
+      @cancelled = true
+    end
+  end
+
+  # Pretend the reactor is running, and keep the periodic timers.
+  def with_reactor
+    timers = []
+    methods = [:reactor_running?, :add_periodic_timer]
+    saved = methods.select {|m| EventMachine.respond_to?(m) }.map {|m| EventMachine.method(m) }
+    EventMachine.define_singleton_method(:reactor_running?) { true }
+    EventMachine.define_singleton_method(:add_periodic_timer) {|interval, &blk| (timers << Timer.new(interval, blk)).last }
+    yield timers
+  ensure
+    methods.each {|m| EventMachine.singleton_class.send(:remove_method, m) }
+    saved.each {|m| EventMachine.define_singleton_method(m.name, m) }
+  end
+
+  def test_pump_timer
+    with_reactor {|timers|
+      channel = EM::HttpEventChannel.new(1000, 50)
+      a, b = connect, connect
+      channel.subscribe a
+      channel.subscribe b
+      assert_equal( 1, timers.length )
+      timer = timers.first
+      assert_equal( 0.1, timer.interval )
+
+      # The timer moves a backlog along without another publish.
+      a.outbound = 50
+      channel.publish "one"
+      a.outbound = 0
+      timer.block.call
+      assert_equal( "data: one\n\n", a.sent.last )
+      assert( !timer.cancelled )
+
+      # It stops once the last subscriber has gone, however it went.
+      channel.unsubscribe a
+      b.unbind
+      timer.block.call
+      assert( timer.cancelled )
+
+      channel.pump_interval = 0.5
+      channel.subscribe connect
+      assert_equal( 2, timers.length )
+      assert_equal( 0.5, timers.last.interval )
+    }
+  end
+
+end
@@ -0,0 +1,81 @@
+require File.expand_path('../helper', __FILE__)
+require 'zlib'
+
+
+#--------------------------------------
+
+
+class TestInflate < Test::Unit::TestCase
+
+  class Server < TestConnection
+    include EM::HttpServer
+    attr_reader :bodies, :slices, :headers
+    def post_init
+      super
+      no_environment_strings
+      inflate_request_bodies 100_000
+      @bodies = []
+      @headers = []
+    end
+    def process_http_request
+      @bodies << @http_post_content
+      @headers << @http_headers.split("\0")
+    end
+  end
+
+  class Streamer < Server
+    def post_init
+      super
+      dont_accumulate_post
+      @slices = []
+    end
+    def receive_post_data data
+      @slices << data
+    end
+  end
+
+  def post body, encoding="gzip"
+    "POST / HTTP/1.1\r\nContent-Encoding: #{encoding}\r\nContent-Length: #{body.bytesize}\r\n\r\n#{body}"
+  end
+
+  def test_accumulated
+    text = "telemetry " * 5000
+    s = Server.open
+    s.receive_data post(Zlib.gzip(text)) + post(Zlib::Deflate.deflate("abc"), "deflate") + post("plain", "identity")
+    assert_equal( [text, "abc", "plain"], s.bodies )
+
+    # The headers describe the inflated body, except where it wasn't.
+    assert_equal( ["Content-Length: #{text.bytesize}"], s.headers[0] )
+    assert_equal( ["Content-Length: 3"], s.headers[1] )
+    assert_equal( ["Content-Encoding: identity", "Content-Length: 5"], s.headers[2] )
+  end
+
+  def test_streamed
+    text = (0...15000).map {|i| i.to_s }.join(",")
+    gz = Zlib.gzip(text) + Zlib.gzip("tail")
+    s = Streamer.open
+    data = post(gz)
+    # A byte at a time, to cross every boundary.
+    data.each_char {|c| s.receive_data c }
+    assert_equal( text + "tail", s.slices.join )
+    assert( s.slices.size > 1 )
+    assert_equal( [nil], s.bodies )
+    assert_equal( [["Content-Length: #{(text + "tail").bytesize}"]], s.headers )
+  end
+
+  def test_errors
+    s = Server.open
+    s.receive_data post(Zlib.gzip("x" * 200_000))
+    assert_match( /\AHTTP\/1.1 413 /, s.out )
+
+    s = Server.open
+    s.receive_data post("not compressed")
+    assert_match( /\AHTTP\/1.1 400 /, s.out )
+
+    s = Server.open
+    s.receive_data post(Zlib.gzip("x" * 1000)[0..-5])
+    assert_match( /\AHTTP\/1.1 400 /, s.out )
+    assert_equal( [], s.bodies )
+  end
+
+end
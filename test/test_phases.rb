@@ -0,0 +1,64 @@
+require File.expand_path('../helper', __FILE__)
+require 'tmpdir'
+
+
+#--------------------------------------
+
+
+class TestRequestPhases < Test::Unit::TestCase
+
+  class Server < TestConnection
+    include EM::HttpServer
+    attr_reader :seen
+    def post_init
+      super
+      no_environment_strings
+    end
+    def process_http_request
+      @seen = request_phases
+      sleep 0.02 if @http_path_info == "/slow"
+      send_data "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n"
+      send_data "ok"
+    end
+  end
+
+  def teardown
+    EM::HttpServer.close_slow_request_log
+  end
+
+  def test_phases
+    s = Server.open
+    assert_nil( s.request_phases )
+
+    s.receive_data "POST /a HTTP/1.1\r\nContent-Length: 4\r\n\r\n"
+    p = s.request_phases
+    assert_equal( 0, p[:first_byte] )
+    assert_not_nil( p[:headers] )
+    assert_nil( p[:body] )
+
+    s.receive_data "abcd"
+    assert_nil( s.seen[:first_response_byte] )
+    p = s.request_phases
+    order = [:first_byte, :headers, :body, :dispatch, :first_response_byte, :last_response_byte]
+    assert_equal( order, p.keys )
+    assert_equal( p.values_at(*order), p.values_at(*order).sort )
+  end
+
+  def test_slow_request_log
+    Dir.mktmpdir {|dir|
+      path = File.join(dir, "slow.log")
+      EM::HttpServer.open_slow_request_log path, 0.01
+      s = Server.open
+      s.receive_data "GET /fast HTTP/1.1\r\nHost: a\r\n\r\n"
+      s.receive_data "GET /slow?x=1 HTTP/1.1\r\nHost: b\r\nCookie: secret=1\r\n\r\n"
+      s.unbind
+      EM::HttpServer.close_slow_request_log
+
+      log = File.read(path)
+      assert_no_match( /fast/, log )
+      assert_match( /\] [\d.]+ms GET \/slow\?x=1 HTTP\/1.1 200 40\n  headers [\d.]+ms body [\d.]+ms queued [\d.]+ms handler [\d.]+ms response [\d.]+ms\n/, log )
+      assert_match( /^  Host: b\n  Cookie: \[filtered\]\n\n\z/, log )
+    }
+  end
+
+end
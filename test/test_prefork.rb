@@ -0,0 +1,142 @@
+require 'test/unit'
+require 'evma_httpserver'
+require 'evma_httpserver/prefork'
+require 'socket'
+
+begin
+  once = false
+  require 'eventmachine'
+rescue LoadError => e
+  raise e if once
+  once = true
+  require 'rubygems'
+  retry
+end
+
+
+#--------------------------------------
+
+
+class TestPrefork < Test::Unit::TestCase
+
+  TestHost = "127.0.0.1"
+  TestPort = 8912
+
+  module Handler
+    include EventMachine::HttpServer
+    def process_http_request
+      send_data "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok"
+      close_connection_after_writing
+    end
+  end
+
+  def get
+    tcp = TCPSocket.new TestHost, TestPort
+    tcp.write "GET / HTTP/1.1\r\nConnection: close\r\n\r\n"
+    tcp.read
+  ensure
+    tcp.close if tcp
+  end
+
+  # A runner that records the workers it would fork.
+  def runner
+    omit( "needs SO_REUSEPORT" ) unless Socket.const_defined?(:SO_REUSEPORT)
+    runner = EventMachine::HttpServer::Prefork.new(TestHost, TestPort, Handler, :workers => 1)
+    forked = []
+    runner.define_singleton_method(:spawn_worker) {|index|
+      forked << index
+      @workers[forked.size] = index
+      @spawned[index] = Time.now
+    }
+    [runner, forked]
+  end
+
+  def test_restart_backoff
+    r, forked = runner
+    restarts = r.instance_variable_get(:@restarts)
+
+    # A worker that dies at once waits, and longer each time.
+    [0.5, 1.0, 2.0].each {|delay|
+      r.send :spawn_worker, 0
+      r.send :schedule_restart, 0
+      assert_in_delta( delay, restarts[0] - Time.now, 0.1 )
+    }
+    r.send :restart_due
+    assert_equal( [0, 0, 0], forked )
+
+    # Once it's due, it's forked.
+    restarts[0] = Time.now
+    r.send :restart_due
+    assert_equal( [0, 0, 0, 0], forked )
+    assert( restarts.empty? )
+
+    # One that ran for a while comes back straight away.
+    r.instance_variable_get(:@spawned)[0] = Time.now - 60
+    r.send :schedule_restart, 0
+    assert( restarts[0] <= Time.now )
+  end
+
+  def test_metrics_skip_retiring
+    r, forked = runner
+    r.instance_variable_set(:@workers, {101 => 0})
+    r.instance_variable_set(:@retiring, {100 => 0})
+    r.send :record_report, "100 7 2 0\n"
+    r.send :record_report, "101 3 1 0\n"
+    assert_equal( {:workers => 1, :requests => 3, :connections => 1, :access_log_dropped => 0}, r.metrics )
+  end
+
+  def test_workers
+    omit( "needs SO_REUSEPORT" ) unless Socket.const_defined?(:SO_REUSEPORT)
+    omit( "needs a real reactor" ) unless EventMachine.respond_to?(:attach_server)
+
+    r, w = IO.pipe
+    master = fork {
+      r.close
+      w.sync = true
+      EventMachine::HttpServer::Prefork.new(TestHost, TestPort, Handler,
+        :workers => 2, :drain_timeout => 2, :metrics_interval => 0.1,
+        :on_metrics => proc {|m| w.puts "#{m[:workers]} #{m[:requests]}" }).run
+      exit!(0)
+    }
+    w.close
+
+    # Wait for a worker to be listening.
+    50.times {
+      begin
+        TCPSocket.new(TestHost, TestPort).close
+        break
+      rescue Errno::ECONNREFUSED
+        sleep 0.1
+      end
+    }
+
+    6.times { assert_match( /\r\n\r\nok\z/, get ) }
+
+    # Each worker reports its own count, and the master sums them. The
+    # probe connection above didn't send a request.
+    workers = requests = nil
+    deadline = Time.now + 5
+    until requests == 6 or Time.now > deadline
+      next unless IO.select([r], nil, nil, 0.5)
+      workers, requests = r.gets.split.map {|v| v.to_i }
+    end
+    assert_equal( [2, 6], [workers, requests] )
+
+    Process.kill(:TERM, master)
+    status = nil
+    50.times {
+      break if status = Process.wait2(master, Process::WNOHANG)
+      sleep 0.1
+    }
+    assert_not_nil( status, "master didn't stop" )
+    assert( status[1].success?, status[1].inspect )
+    assert_raises( Errno::ECONNREFUSED ) { TCPSocket.new(TestHost, TestPort) }
+  ensure
+    if master and !status
+      Process.kill(:KILL, master) rescue nil
+      Process.wait(master) rescue nil
+    end
+    r.close if r
+  end
+
+end
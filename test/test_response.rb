@@ -1,5 +1,6 @@
 require 'test/unit'
 require 'evma_httpserver'
+require 'tmpdir'
 
 begin
   once = false
@@ -22,6 +23,7 @@ module EventMachine
   class HttpResponse
     attr_reader :output_data
     attr_reader :closed_after_writing
+    attr_reader :closed
 
     def send_data data
       @output_data ||= ""
@@ -30,6 +32,9 @@ module EventMachine
     def close_connection_after_writing
       @closed_after_writing = true
     end
+    def close_connection
+      @closed = true
+    end
   end
 end
 
@@ -172,4 +177,275 @@ class TestHttpResponse < Test::Unit::TestCase
     assert( a.closed_after_writing )
   end
 
+  def test_send_chunks_byte_lengths_and_trailers
+    a = EventMachine::HttpResponse.new
+    a.trailer "X-Checksum", "abc123"
+    a.chunk "caf\u00e9"
+    a.keep_connection_open
+    a.send_response
+    assert_equal([
+           "HTTP/1.1 200 OK\r\n",
+           "Trailer: X-Checksum\r\n",
+           "Transfer-Encoding: chunked\r\n",
+           "\r\n",
+           "5\r\n",
+           "caf\u00e9\r\n",
+           "0\r\n",
+           "X-Checksum: abc123\r\n",
+           "\r\n"
+    ].join.b, a.output_data.b)
+  end
+
+  def test_no_chunks_for_http10
+    a = EventMachine::HttpResponse.new
+    a.request_protocol = "HTTP/1.0"
+    assert_raise( RuntimeError ) {
+      a.chunk "ABC"
+    }
+
+    a = EventMachine::HttpResponse.new("HTTP/1.0")
+    assert_raise( RuntimeError ) { a.chunk "ABC" }
+    a = EventMachine::HttpResponse.new("HTTP/1.1")
+    a.chunk "ABC"
+
+    # Whatever the delegate is, its request's protocol is picked up.
+    conn = Object.new
+    conn.instance_variable_set(:@http_protocol, "HTTP/1.0")
+    a = EventMachine::DelegatedHttpResponse.new(conn)
+    assert_raise( RuntimeError ) { a.chunk "ABC" }
+  end
+
+  def test_coalesce_chunks
+    a = EventMachine::HttpResponse.new
+    a.coalesce_chunks 8
+    a.send_headers
+    a.chunk "ABCDEFGH"
+    a.send_chunks
+    assert_match( /\r\n\r\n8\r\nABCDEFGH\r\n\z/, a.output_data )
+    a.chunk "IJ"
+    a.chunk ""
+    a.send_chunks
+    assert_match( /\r\n2\r\nIJ\r\n0\r\n\r\n\z/, a.output_data )
+  end
+
+  def test_send_single_range
+    a = EventMachine::HttpResponse.new
+    a.content = "0123456789"
+    a.range "bytes=2-4"
+    a.keep_connection_open
+    a.send_response
+    assert_equal([
+           "HTTP/1.1 206 Partial Content\r\n",
+           "Accept-Ranges: bytes\r\n",
+           "Content-Length: 3\r\n",
+           "Content-Range: bytes 2-4/10\r\n",
+           "\r\n",
+           "234"
+    ].join, a.output_data)
+    assert( !a.closed_after_writing )
+  end
+
+  def test_send_multiple_ranges
+    a = EventMachine::HttpResponse.new
+    a.content_type "text/plain"
+    a.content = "0123456789"
+    a.range "bytes=0-1,-2"
+    a.send_response
+    head, body = a.output_data.split("\r\n\r\n", 2)
+    boundary = head[/boundary=(\w+)/, 1]
+    assert_match( /\AHTTP\/1.1 206 Partial Content\r\n/, head )
+    assert_match( /^Content-Length: #{body.bytesize}\r?$/, head )
+    assert_equal([
+           "\r\n--#{boundary}\r\n",
+           "Content-Type: text/plain\r\n",
+           "Content-Range: bytes 0-1/10\r\n",
+           "\r\n",
+           "01",
+           "\r\n--#{boundary}\r\n",
+           "Content-Type: text/plain\r\n",
+           "Content-Range: bytes 8-9/10\r\n",
+           "\r\n",
+           "89",
+           "\r\n--#{boundary}--\r\n"
+    ].join, body)
+  end
+
+  def test_send_unsatisfiable_range
+    a = EventMachine::HttpResponse.new
+    a.content = "0123456789"
+    a.range "bytes=20-"
+    a.send_response
+    assert_equal([
+           "HTTP/1.1 416 Requested Range Not Satisfiable\r\n",
+           "Accept-Ranges: bytes\r\n",
+           "Content-Length: 0\r\n",
+           "Content-Range: bytes */10\r\n",
+           "\r\n"
+    ].join, a.output_data)
+  end
+
+  def test_if_range_mismatch
+    a = EventMachine::HttpResponse.new
+    a.headers["ETag"] = '"abc"'
+    a.content = "0123456789"
+    a.range "bytes=2-4", '"xyz"'
+    a.send_response
+    assert_match( /\AHTTP\/1.1 200 OK\r\n/, a.output_data )
+    assert_match( /\r\n\r\n0123456789\z/, a.output_data )
+  end
+
+  def test_weak_if_range
+    a = EventMachine::HttpResponse.new
+    a.headers["ETag"] = 'W/"abc"'
+    a.content = "0123456789"
+    a.range "bytes=2-4", 'W/"abc"'
+    a.send_response
+    assert_match( /\AHTTP\/1.1 200 OK\r\n/, a.output_data )
+    assert_match( /\r\n\r\n0123456789\z/, a.output_data )
+  end
+
+  def test_range_only_for_200
+    a = EventMachine::HttpResponse.new
+    a.status = 404
+    a.content = "not found"
+    a.range "bytes=0-2"
+    a.send_response
+    assert_match( /\AHTTP\/1.1 404 Not Found\r\n/, a.output_data )
+    assert_no_match( /Content-Range/, a.output_data )
+    assert_match( /\r\n\r\nnot found\z/, a.output_data )
+  end
+
+  def test_send_file_range
+    a = EventMachine::HttpResponse.new
+    a.file = __FILE__
+    a.range "bytes=0-11"
+    a.send_response
+    assert_match( /\r\nContent-Range: bytes 0-11\/#{File.size(__FILE__)}\r\n/, a.output_data )
+    assert_match( /\r\n\r\nrequire 'tes\z/, a.output_data )
+  end
+
+  # Runs the block with EventMachine's timers replaced by a list of the
+  # blocks that were scheduled, and a list of those cancelled.
+  def with_timers
+    timers, cancelled = [], []
+    saved = [:add_timer, :cancel_timer].select {|m| EventMachine.respond_to?(m) }.map {|m| EventMachine.method(m) }
+    EventMachine.define_singleton_method(:add_timer) {|*args, &blk| timers << blk; blk }
+    EventMachine.define_singleton_method(:cancel_timer) {|t| cancelled << t }
+    yield timers, cancelled
+  ensure
+    [:add_timer, :cancel_timer].each {|m| EventMachine.singleton_class.send(:remove_method, m) }
+    saved.each {|m| EventMachine.define_singleton_method(m.name, m) }
+  end
+
+  def paced_file_response file
+    a = EventMachine::HttpResponse.new
+    a.file = file
+    def a.get_outbound_data_size() @outbound end
+    a.instance_variable_set(:@outbound, EventMachine::HttpResponse::FileHighWater)
+    a
+  end
+
+  def test_send_file_paced
+    with_timers {|timers, cancelled|
+      a = paced_file_response(__FILE__)
+      a.send_response
+      assert_match( /\r\n\r\n\z/, a.output_data )
+      assert( !a.closed_after_writing )
+      assert_equal( 1, timers.length )
+
+      a.instance_variable_set(:@outbound, 0)
+      timers.shift.call
+      assert( a.output_data.end_with?("\r\n\r\n" + File.binread(__FILE__)) )
+      assert( a.closed_after_writing )
+      assert( timers.empty? )
+    }
+  end
+
+  def test_send_file_cancelled
+    with_timers {|timers, cancelled|
+      a = paced_file_response(__FILE__)
+      a.send_response
+      a.cancel
+      assert_equal( timers, cancelled )
+      assert_nil( a.instance_variable_get(:@file_io) )
+      assert( !a.closed_after_writing )
+    }
+  end
+
+  def test_send_file_shrunk
+    Dir.mktmpdir {|dir|
+      path = File.join(dir, "f")
+      File.binwrite path, "x" * 100
+      with_timers {|timers, cancelled|
+        a = paced_file_response(path)
+        a.send_response
+        File.binwrite path, "x" * 10
+        a.instance_variable_set(:@outbound, 0)
+        timers.shift.call
+        # The client was promised 100 bytes, so it only learns the
+        # response is over when the connection closes.
+        assert_match( /Content-Length: 100\r\n\r\nx{10}\z/, a.output_data )
+        assert( a.closed )
+        assert( !a.closed_after_writing )
+      }
+    }
+  end
+
+  class UnbindServer < EventMachine::Connection
+    include EventMachine::HttpServer
+    def send_data data; end
+    def get_outbound_data_size; EventMachine::HttpResponse::FileHighWater; end
+  end
+
+  def test_coalesced_chunks_cancelled_on_unbind
+    with_timers {|timers, cancelled|
+      conn = Class.new(UnbindServer).new(nil)
+      a = EventMachine::DelegatedHttpResponse.new(conn)
+      a.coalesce_chunks 1024
+      a.chunk "held"
+      a.send_chunks
+      assert_equal( 1, timers.length )
+      conn.unbind
+      assert_equal( timers, cancelled )
+      assert_nil( a.instance_variable_get(:@chunk_buffer) )
+
+      # Once the held chunks have gone out, unbind has nothing to cancel.
+      conn = Class.new(UnbindServer).new(nil)
+      a = EventMachine::DelegatedHttpResponse.new(conn)
+      a.coalesce_chunks 1024
+      a.chunk "held"
+      a.send_chunks
+      timers.pop.call
+      cancelled.clear
+      conn.unbind
+      assert_equal( [], cancelled )
+    }
+  end
+
+  def test_delegated_file_cancelled_on_unbind
+    with_timers {|timers, cancelled|
+      conn = Class.new(UnbindServer).new(nil)
+      a = EventMachine::DelegatedHttpResponse.new(conn)
+      a.file = __FILE__
+      a.send_response
+      assert_equal( 1, timers.length )
+      conn.unbind
+      assert_equal( timers, cancelled )
+      assert_nil( a.instance_variable_get(:@file_io) )
+    }
+  end
+
+  def test_date_header
+    EventMachine::HttpResponse.date_header = true
+    a = EventMachine::HttpResponse.new
+    a.send_response
+    assert_match( /^Date: \w{3}, \d\d \w{3} \d{4} \d\d:\d\d:\d\d GMT\r$/, a.output_data )
+    # The cached value can be a second behind the clock.
+    require 'time'
+    date = Time.httpdate(EventMachine::HttpServer.http_date)
+    assert_in_delta( Time.now.to_i, date.to_i, 1 )
+  ensure
+    EventMachine::HttpResponse.date_header = nil
+  end
+
 end
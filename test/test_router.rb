@@ -0,0 +1,136 @@
+require File.expand_path('../helper', __FILE__)
+
+
+#--------------------------------------
+
+
+class TestHttpRouter < Test::Unit::TestCase
+
+  def setup
+    @r = EM::HttpRouter.new
+    @r.add "GET", "/", :root
+    @r.add "GET", "/users", :users
+    @r.add "GET", "/users/new", :new_user
+    @r.add "GET", "/users/:id", :user
+    @r.add "GET", "/users/:id/posts/:post_id", :post
+    @r.add "GET", "/files/*path", :file
+    @r.add "POST", "/users", :create_user
+    @r.add "*", "/ping", :ping
+  end
+
+  def test_static
+    assert_equal( [:root, {}], @r.match("GET", "/") )
+    assert_equal( [:users, {}], @r.match("GET", "/users") )
+    assert_equal( [:create_user, {}], @r.match("POST", "/users") )
+    assert_equal( nil, @r.match("PUT", "/users") )
+    assert_equal( 8, @r.size )
+  end
+
+  def test_params
+    assert_equal( [:new_user, {}], @r.match("GET", "/users/new") )
+    assert_equal( [:user, {"id" => "newt"}], @r.match("GET", "/users/newt") )
+    assert_equal( [:post, {"id" => "7", "post_id" => "42"}], @r.match("GET", "/users/7/posts/42") )
+    assert_equal( nil, @r.match("GET", "/users/7/posts") )
+    assert_equal( nil, @r.match("GET", "/users/") )
+  end
+
+  def test_splat
+    assert_equal( [:file, {"path" => "a/b/c.txt"}], @r.match("GET", "/files/a/b/c.txt") )
+    assert_equal( [:file, {"path" => ""}], @r.match("GET", "/files/") )
+  end
+
+  def test_any_method
+    assert_equal( [:ping, {}], @r.match("HEAD", "/ping") )
+  end
+
+  def test_block_handler
+    r = EM::HttpRouter.new
+    r.add("get", "/x") {|conn, params| :called }
+    handler, params = r.match("GET", "/x")
+    assert_equal( :called, handler.call(nil, params) )
+  end
+
+  def test_bad_patterns
+    assert_raise(ArgumentError) { @r.add "GET", "users", :x }
+    assert_raise(ArgumentError) { @r.add "GET", "/users/:name", :x }
+    assert_raise(ArgumentError) { @r.add "GET", "/users", :x }
+    assert_raise(ArgumentError) { @r.add "GET", "/a/:", :x }
+  end
+
+  class Server < TestConnection
+    include EM::HttpServer
+    attr_reader :calls
+    def post_init
+      super
+      no_environment_strings
+      use_router ROUTES
+      @calls = []
+    end
+    def show_user params
+      @calls << [:show_user, params]
+    end
+    def page params
+      @calls << [:page, @http_request_method]
+      # The blank line ending the head is split across sends.
+      send_data "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r"
+      send_data "\nhel"
+      send_data "lo"
+    end
+    def process_http_request
+      @calls << [:fallback, @http_route_status, @http_route_allow]
+    end
+  end
+
+  ROUTES = EM::HttpRouter.new
+  ROUTES.add "GET", "/users/:id", :show_user
+  ROUTES.add "DELETE", "/users/:id", :show_user
+  ROUTES.add "GET", "/page", :page
+  ROUTES.add("*", "/ping") {|conn, params| conn.calls << [:ping, conn.instance_variable_get(:@http_request_method)] }
+
+  def dispatch *requests
+    connect(*requests).calls
+  end
+
+  def connect *requests
+    s = Server.open
+    requests.each {|r| s.receive_data "#{r} HTTP/1.1\r\n\r\n" }
+    s
+  end
+
+  def test_dispatch
+    assert_equal( [[:show_user, {"id" => "7"}]], dispatch("GET /users/7") )
+    assert_equal( [[:ping, "HEAD"], [:ping, "POST"]], dispatch("HEAD /ping", "POST /ping") )
+    assert_equal( [[:fallback, 404, nil]], dispatch("GET /nowhere") )
+    assert_equal( [[:fallback, 405, "DELETE, GET"]], dispatch("PUT /users/7") )
+
+    # Routing state doesn't leak into the next request on the connection.
+    assert_equal( [[:fallback, 404, nil], [:show_user, {"id" => "1"}]], dispatch("GET /x", "GET /users/1") )
+  end
+
+  def test_head_falls_back_to_get
+    head = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n"
+    s = connect("HEAD /page")
+    assert_equal( [[:page, "HEAD"]], s.calls )
+    assert_equal( head, s.out )
+
+    # Only that request loses its body.
+    s = connect("HEAD /page", "GET /page")
+    assert_equal( [[:page, "HEAD"], [:page, "GET"]], s.calls )
+    assert_equal( head + head + "hello", s.out )
+
+    assert_equal( [[:show_user, {"id" => "7"}]], dispatch("HEAD /users/7") )
+    assert_equal( [[:fallback, 404, nil]], dispatch("HEAD /nowhere") )
+  end
+
+  def test_use_router_before_super
+    klass = Class.new(TestConnection) {
+      include EM::HttpServer
+      def post_init
+        use_router ROUTES
+        super
+      end
+    }
+    assert_raise(RuntimeError) { klass.open }
+  end
+
+end
@@ -0,0 +1,98 @@
+require File.expand_path('../helper', __FILE__)
+
+
+#--------------------------------------
+
+
+class TestWebSocket < Test::Unit::TestCase
+
+  class Server < TestConnection
+    include EM::HttpServer
+    attr_reader :messages, :closed_with
+    def post_init
+      super
+      no_environment_strings
+      accept_websockets
+      @messages = []
+    end
+    def process_websocket_open
+    end
+    def receive_websocket_message msg
+      @messages << msg
+    end
+    def process_websocket_close code, reason
+      @closed_with = [code, reason]
+    end
+  end
+
+  # A masked client frame, with the mask 1,2,3,4.
+  def frame opcode, payload
+    mask = [1, 2, 3, 4]
+    masked = payload.b.bytes.each_with_index.map {|c, i| c ^ mask[i % 4] }
+    [0x80 | opcode, 0x80 | payload.bytesize, *mask, *masked].pack("C*")
+  end
+
+  def connect
+    s = Server.open
+    s.receive_data [
+      "GET /chat HTTP/1.1\r\n",
+      "Upgrade: websocket\r\n",
+      "Connection: Upgrade\r\n",
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n",
+      "Sec-WebSocket-Version: 13\r\n",
+      "\r\n"
+    ].join
+    s.out.clear
+    s
+  end
+
+  def close_frame code
+    [0x88, 2, code >> 8, code & 0xFF].pack("C*")
+  end
+
+  def test_text_must_be_utf8
+    s = connect
+    s.receive_data frame(0x1, "caf\xC3\xA9 \xF0\x9F\x98\x80")
+    assert_equal( ["café \u{1F600}".b], s.messages.map(&:b) )
+
+    ["\xC3", "\xC0\xAF", "\xED\xA0\x80", "\xF4\x90\x80\x80", "ok\xFF"].each {|bad|
+      s = connect
+      s.receive_data frame(0x1, bad)
+      assert_equal( [], s.messages, bad.inspect )
+      assert_equal( close_frame(1007), s.out, bad.inspect )
+      assert_equal( 1007, s.closed_with.first )
+    }
+
+    # Binary messages are whatever they are.
+    s = connect
+    s.receive_data frame(0x2, "\xFF\xFE")
+    assert_equal( ["\xFF\xFE".b], s.messages.map(&:b) )
+  end
+
+  def test_close_codes
+    [1000, 1001, 1003, 1007, 1011, 3000, 4999].each {|code|
+      s = connect
+      s.receive_data frame(0x8, [code].pack("n"))
+      assert_equal( close_frame(code), s.out, code.to_s )
+      assert_equal( [code, ""], s.closed_with )
+    }
+
+    [0, 999, 1004, 1005, 1006, 1015, 1016, 2000, 2999, 5000].each {|code|
+      s = connect
+      s.receive_data frame(0x8, [code].pack("n"))
+      assert_equal( close_frame(1002), s.out, code.to_s )
+      assert_equal( 1002, s.closed_with.first )
+    }
+
+    # No code at all is fine, and we answer with a normal close.
+    s = connect
+    s.receive_data frame(0x8, "")
+    assert_equal( close_frame(1000), s.out )
+    assert_equal( 1005, s.closed_with.first )
+
+    s = connect
+    s.receive_data frame(0x8, [1000].pack("n") + "\xFF".b)
+    assert_equal( close_frame(1007), s.out )
+  end
+
+end
@@ -0,0 +1,121 @@
+require File.expand_path('../helper', __FILE__)
+require 'digest'
+require 'zlib'
+
+
+#--------------------------------------
+
+
+class TestBodyWorkers < Test::Unit::TestCase
+
+  class Server < TestConnection
+    include EM::HttpServer
+    class << self
+      attr_accessor :seen
+    end
+    def post_init
+      super
+      no_environment_strings
+      body_stages "crc32", "sha256", "json"
+    end
+    def process_http_request
+      raise "handler failed" if @http_path_info == "/raise"
+      Server.seen << [@http_post_content, @http_body_results]
+      send_data "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n"
+    end
+  end
+
+  def setup
+    Server.seen = []
+    EM::HttpServer.start_body_workers 2
+  end
+
+  def teardown
+    EM::HttpServer.stop_body_workers
+  end
+
+  # The reactor would do this when the notification descriptor fires.
+  def wait_for
+    200.times {
+      EM::HttpServer.run_body_completions
+      return if yield
+      sleep 0.01
+    }
+    flunk "body workers didn't finish"
+  end
+
+  def test_request_body
+    body = '{"a": [1, 2.5e3, "x\\u00e9"], "b": null}'
+    s = Server.open
+    s.receive_data "POST /a HTTP/1.1\r\nContent-Length: #{body.bytesize}\r\n\r\n#{body}" +
+      "POST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\n{x}"
+
+    # The second request waits behind the first, and the socket isn't
+    # read while the body is with the workers.
+    assert_equal( [], Server.seen )
+    assert( s.paused? )
+    wait_for { Server.seen.size == 2 }
+    assert( !s.paused? )
+
+    content, results = Server.seen[0]
+    assert_equal( body, content )
+    assert_equal( "%08x" % Zlib.crc32(body), results["crc32"] )
+    assert_equal( Digest::SHA256.hexdigest(body), results["sha256"] )
+    assert_equal( true, results["json"] )
+
+    content, results = Server.seen[1]
+    assert_equal( "{x}", content )
+    assert_nil( results["json"] )
+    assert_not_nil( results["error"] )
+  end
+
+  def test_raising_handler
+    # Every finished job is delivered before the first error is raised.
+    failing = Server.open
+    failing.receive_data "POST /raise HTTP/1.1\r\nContent-Length: 2\r\n\r\n{}"
+    ok = Server.open
+    ok.receive_data "POST /ok HTTP/1.1\r\nContent-Length: 2\r\n\r\n[]"
+    e = assert_raises( RuntimeError ) { EM::HttpServer.stop_body_workers }
+    assert_equal( "handler failed", e.message )
+    assert_equal( [["[]", true]], Server.seen.map {|c, r| [c, r["json"]] } )
+  end
+
+  def test_process_body
+    body = "--XX\r\nContent-Type: text/plain\r\n\r\none\r\n--XX\r\n\r\ntwo\r\n--XX--\r\n"
+    got = nil
+    EM::HttpServer.process_body(body, ["multipart"], "multipart/form-data; boundary=XX") {|b, r| got = r }
+    wait_for { got }
+    assert_equal( [["Content-Type: text/plain", "one"], ["", "two"]], got["multipart"] )
+
+    got = nil
+    EM::HttpServer.process_body(Zlib.gzip("hello " * 100), ["inflate", "crc32"]) {|b, r| got = [b, r] }
+    wait_for { got }
+    assert_equal( "hello " * 100, got[0] )
+    assert_equal( "%08x" % Zlib.crc32("hello " * 100), got[1]["crc32"] )
+  end
+
+  def test_digests
+    # Known answers around the SHA-256 padding boundaries: a 55-byte
+    # message still fits its length in one block, a 56-byte one doesn't.
+    bodies = ["", "abc"] + [55, 56, 57, 63, 64, 65, 119, 120, 128, 100_000].map {|n|
+      (0...n).map {|i| (i * 7 % 256).chr }.join
+    }
+    got = {}
+    bodies.each {|body|
+      EM::HttpServer.process_body(body, ["sha256", "crc32"]) {|b, r| got[body] = r }
+    }
+    wait_for { got.size == bodies.size }
+    bodies.each {|body|
+      assert_equal( Digest::SHA256.hexdigest(body), got[body]["sha256"], "#{body.bytesize} bytes" )
+      assert_equal( "%08x" % Zlib.crc32(body), got[body]["crc32"], "#{body.bytesize} bytes" )
+    }
+    assert_equal( "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", got["abc"]["sha256"] )
+    assert_equal( "00000000", got[""]["crc32"] )
+  end
+
+  def test_unknown_stage
+    assert_raises( ArgumentError ) { Server.open.body_stages "rot13" }
+    assert_raises( ArgumentError ) { EM::HttpServer.process_body("", ["rot13"]) {} }
+  end
+
+end